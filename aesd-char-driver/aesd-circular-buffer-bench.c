@@ -0,0 +1,1386 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace harness for the circular buffer behind the aesdchar driver
+ *
+ * Builds aesd-circular-buffer.c outside the kernel (see "make bench") and models the
+ * driver's file operations on top of it, with a pthread mutex standing in for dev->lock
+ * and memcpy() standing in for copy_to_user().
+ *
+ * The concurrency and staging modes time models of the driver's locking and write staging,
+ * not the driver, so they are baselines only. aesdchar-bench producers checks the loaded
+ * driver for interleaved commands and torn reads.
+ *
+ * Usage: aesd-circular-buffer-bench read [entry_size] [iterations]
+ *        aesd-circular-buffer-bench capacity [max_capacity]
+ *        aesd-circular-buffer-bench lookup [max_capacity]
+ *        aesd-circular-buffer-bench sequential [max_capacity] [read_size]
+ *        aesd-circular-buffer-bench alloc [command_size] [commands]
+ *        aesd-circular-buffer-bench concurrency [max_readers] [seconds]
+ *        aesd-circular-buffer-bench mmap [capacity] [entry_size]
+ *        aesd-circular-buffer-bench staging [max_writers] [seconds]
+ *        aesd-circular-buffer-bench budget [max_bytes] [commands]
+ *
+ */
+
+#define _GNU_SOURCE // for pthread_rwlockattr_setkind_np()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h> // for sysconf()
+
+#include "aesd-circular-buffer.h"
+#include "aesd-pool.h"
+
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills @param buffer with AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED newline terminated
+ * commands of @param entry_size bytes each.
+ * @return the total number of bytes stored
+ */
+static size_t fill_buffer(struct aesd_circular_buffer *buffer, size_t entry_size)
+{
+    struct aesd_buffer_entry entry;
+    size_t lost_size = 0;
+    size_t total = 0;
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
+        char *data = malloc(entry_size);
+        memset(data, 'a' + i, entry_size - 1);
+        data[entry_size - 1] = '\n';
+        entry.buffptr = data;
+        entry.size = entry_size;
+        aesd_circular_buffer_add_entry(buffer, &entry, &lost_size);
+        total += entry_size;
+    }
+    return total;
+}
+
+static void free_buffer(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        free((char *)entry->buffptr);
+    }
+    aesd_circular_buffer_free(buffer);
+}
+
+/**
+ * The previous aesd_read(): one byte per call no matter how large count is.
+ */
+static size_t model_read_bytewise(struct aesd_circular_buffer *buffer, char *buf, size_t count, size_t *f_pos)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset_byte_rtn = 0;
+    size_t retval = 0;
+
+    pthread_mutex_lock(&dev_lock);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, *f_pos, &offset_byte_rtn);
+    if (entry && count > 0) {
+        memcpy(buf, entry->buffptr + offset_byte_rtn, 1);
+        (*f_pos)++;
+        retval = 1;
+    }
+    pthread_mutex_unlock(&dev_lock);
+    return retval;
+}
+
+/**
+ * The current aesd_read(): copies up to count bytes, one copy per entry.
+ */
+static size_t model_read_bulk(struct aesd_circular_buffer *buffer, char *buf, size_t count, size_t *f_pos)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset_byte_rtn = 0;
+    size_t copied = 0;
+
+    pthread_mutex_lock(&dev_lock);
+    while (copied < count) {
+        size_t chunk;
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, *f_pos, &offset_byte_rtn);
+        if (!entry) {
+            break;
+        }
+        chunk = entry->size - offset_byte_rtn;
+        if (chunk > count - copied) {
+            chunk = count - copied;
+        }
+        memcpy(buf + copied, entry->buffptr + offset_byte_rtn, chunk);
+        copied += chunk;
+        *f_pos += chunk;
+    }
+    pthread_mutex_unlock(&dev_lock);
+    return copied;
+}
+
+/**
+ * aesd_read() with the per open file cursor: each lookup after the first of a sequential
+ * read resumes from where the last one landed.
+ */
+static size_t model_read_cursor(struct aesd_circular_buffer *buffer, struct aesd_read_cursor *cursor,
+        char *buf, size_t count, size_t *f_pos)
+{
+    struct aesd_buffer_entry *entry;
+    size_t offset_byte_rtn = 0;
+    size_t copied = 0;
+
+    pthread_mutex_lock(&dev_lock);
+    while (copied < count) {
+        size_t chunk;
+        entry = aesd_circular_buffer_find_entry_cursor(buffer, *f_pos, &offset_byte_rtn, cursor);
+        if (!entry) {
+            break;
+        }
+        chunk = entry->size - offset_byte_rtn;
+        if (chunk > count - copied) {
+            chunk = count - copied;
+        }
+        memcpy(buf + copied, entry->buffptr + offset_byte_rtn, chunk);
+        copied += chunk;
+        *f_pos += chunk;
+    }
+    pthread_mutex_unlock(&dev_lock);
+    return copied;
+}
+
+typedef size_t (*read_fn)(struct aesd_circular_buffer *, char *, size_t, size_t *);
+
+/**
+ * Reads the whole history @param iterations times the way "cat" would, with
+ * @param count bytes requested per call, and prints the throughput.
+ * @return 0 if every pass returned exactly @param expected
+ */
+static int bench_read_strategy(const char *name, read_fn fn, struct aesd_circular_buffer *buffer,
+        const char *expected, size_t total, size_t count, int iterations)
+{
+    char *out = malloc(total + count);
+    unsigned long calls = 0;
+    double start;
+    double elapsed;
+    int i;
+    int rc = 0;
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        size_t f_pos = 0;
+        size_t n;
+        while ((n = fn(buffer, out + f_pos, count, &f_pos)) > 0) {
+            calls++;
+        }
+        if (f_pos != total || memcmp(out, expected, total) != 0) {
+            rc = -1;
+        }
+    }
+    elapsed = now_sec() - start;
+
+    printf("%-9s %10.1f MB/s %12.1f calls/pass%s\n", name,
+           (double)total * iterations / elapsed / 1e6,
+           (double)calls / iterations, rc ? "  MISMATCH" : "");
+    free(out);
+    return rc;
+}
+
+static int bench_read(int argc, char *argv[])
+{
+    struct aesd_circular_buffer buffer;
+    size_t entry_size = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1024;
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    size_t total;
+    char *expected;
+    int rc = 0;
+
+    if (entry_size < 2 || iterations < 1) {
+        fprintf(stderr, "entry_size must be at least 2 and iterations at least 1\n");
+        return 1;
+    }
+
+    total = fill_buffer(&buffer, entry_size);
+    expected = malloc(total);
+    for (size_t i = 0; i < total; i += entry_size) {
+        memset(expected + i, 'a' + i / entry_size, entry_size - 1);
+        expected[i + entry_size - 1] = '\n';
+    }
+
+    printf("read: %d entries x %zu bytes, 4096 bytes requested per call\n",
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_size);
+    rc |= bench_read_strategy("bytewise", model_read_bytewise, &buffer, expected, total, 4096, iterations);
+    rc |= bench_read_strategy("bulk", model_read_bulk, &buffer, expected, total, 4096, iterations);
+
+    free(expected);
+    free_buffer(&buffer);
+    return rc ? 1 : 0;
+}
+
+/**
+ * Measures add_entry (with eviction) and find_entry_offset_for_fpos throughput for capacities
+ * from 10 up to @param argv[0] entries. Each measurement runs for about BENCH_SECONDS.
+ * Entries share one static payload so only the ring itself is measured.
+ */
+#define BENCH_SECONDS 0.3
+static int bench_capacity(int argc, char *argv[])
+{
+    static const char payload[] = "0123456789abcdef0123456789abcde\n";
+    uint32_t max_capacity = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+    uint32_t capacity;
+
+    printf("%10s %14s %14s\n", "capacity", "adds/s", "finds/s");
+    for (capacity = 10; capacity <= max_capacity; capacity *= 10) {
+        struct aesd_circular_buffer buffer;
+        struct aesd_buffer_entry entry = { .buffptr = payload, .size = sizeof(payload) - 1 };
+        size_t lost_size = 0;
+        size_t total;
+        size_t offset_byte_rtn;
+        unsigned long adds = 0;
+        unsigned long finds = 0;
+        unsigned long seed = 1;
+        double start;
+        double add_elapsed;
+        double find_elapsed;
+
+        if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+            fprintf(stderr, "Can't allocate %u entries\n", capacity);
+            return 1;
+        }
+
+        // Steady state: the ring is full and every add evicts the oldest entry
+        start = now_sec();
+        do {
+            for (int i = 0; i < 1024; i++) {
+                aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size);
+            }
+            adds += 1024;
+            add_elapsed = now_sec() - start;
+        } while (add_elapsed < BENCH_SECONDS || adds < 2UL * capacity);
+
+        total = (size_t)aesd_circular_buffer_count(&buffer) * entry.size;
+        start = now_sec();
+        do {
+            for (int i = 0; i < 64; i++) {
+                seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+                if (!aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, (seed >> 17) % total, &offset_byte_rtn)) {
+                    fprintf(stderr, "Lookup failed at capacity %u\n", capacity);
+                    return 1;
+                }
+            }
+            finds += 64;
+            find_elapsed = now_sec() - start;
+        } while (find_elapsed < BENCH_SECONDS);
+
+        printf("%10u %14.0f %14.0f\n", capacity, adds / add_elapsed, finds / find_elapsed);
+        aesd_circular_buffer_free(&buffer);
+    }
+    return 0;
+}
+
+/**
+ * The previous aesd_circular_buffer_find_entry_offset_for_fpos(): walks the entries oldest first,
+ * subtracting sizes. Kept as the reference the offset index is checked against.
+ */
+static struct aesd_buffer_entry *find_linear(struct aesd_circular_buffer *buffer,
+        size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + i) & buffer->mask];
+        if (char_offset < entry->size) {
+            *entry_offset_byte_rtn = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static volatile size_t lookup_sink;
+
+typedef struct aesd_buffer_entry *(*find_fn)(struct aesd_circular_buffer *, size_t, size_t *);
+
+/**
+ * Runs random lookups over the @param total bytes of @param buffer for about BENCH_SECONDS.
+ * @return lookups per second
+ */
+static double lookups_per_sec(find_fn fn, struct aesd_circular_buffer *buffer, size_t total)
+{
+    unsigned long seed = 7;
+    unsigned long lookups = 0;
+    size_t offset_byte_rtn = 0;
+    size_t sink = 0;
+    double start = now_sec();
+    double elapsed;
+
+    do {
+        for (int i = 0; i < 64; i++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            // Consume the result so the lookup can't be optimized away
+            sink += (size_t)fn(buffer, (seed >> 17) % total, &offset_byte_rtn) + offset_byte_rtn;
+        }
+        lookups += 64;
+        elapsed = now_sec() - start;
+    } while (elapsed < BENCH_SECONDS);
+    lookup_sink = sink;
+    return lookups / elapsed;
+}
+
+/**
+ * Fills rings of 10 up to @param argv[0] entries of random sizes, wrapped several times so the
+ * running byte count and out_offs are well past zero. Checks that every entry boundary, and a
+ * sample of offsets inside entries, resolve the same through the offset index as through the
+ * linear walk, then compares their random lookup rates.
+ */
+static int bench_lookup(int argc, char *argv[])
+{
+    static char payload[256];
+    uint32_t max_capacity = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+    uint32_t capacity;
+
+    memset(payload, 'x', sizeof(payload));
+    printf("%10s %16s %16s %8s\n", "capacity", "linear lookups/s", "index lookups/s", "speedup");
+    for (capacity = 10; capacity <= max_capacity; capacity *= 10) {
+        struct aesd_circular_buffer buffer;
+        struct aesd_buffer_entry entry = { .buffptr = payload };
+        size_t lost_size = 0;
+        size_t total = 0;
+        unsigned long seed = capacity;
+        double linear;
+        double indexed;
+
+        if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+            fprintf(stderr, "Can't allocate %u entries\n", capacity);
+            return 1;
+        }
+        for (uint64_t i = 0; i < 3ULL * capacity + capacity / 3; i++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            entry.size = 1 + (seed >> 33) % sizeof(payload);
+            aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size);
+        }
+        for (uint32_t i = 0; i < aesd_circular_buffer_count(&buffer); i++) {
+            total += buffer.entry[(buffer.out_offs + i) & buffer.mask].size;
+        }
+        if (total != aesd_circular_buffer_size(&buffer)) {
+            fprintf(stderr, "capacity %u: size %zu, expected %zu\n", capacity, aesd_circular_buffer_size(&buffer), total);
+            return 1;
+        }
+
+        // Differential check, skipped for the largest rings where the linear walk is too slow
+        if (capacity <= 10000) {
+            for (size_t fpos = 0; fpos <= total; fpos += 1 + fpos % 37) {
+                size_t want_offset = 0;
+                size_t got_offset = 0;
+                struct aesd_buffer_entry *want = find_linear(&buffer, fpos, &want_offset);
+                struct aesd_buffer_entry *got = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &got_offset);
+                if (want != got || (want && want_offset != got_offset)) {
+                    fprintf(stderr, "capacity %u: fpos %zu resolved differently\n", capacity, fpos);
+                    return 1;
+                }
+            }
+        }
+
+        linear = lookups_per_sec(find_linear, &buffer, total);
+        indexed = lookups_per_sec(aesd_circular_buffer_find_entry_offset_for_fpos, &buffer, total);
+        printf("%10u %16.0f %16.0f %7.0fx\n", capacity, linear, indexed, indexed / linear);
+        aesd_circular_buffer_free(&buffer);
+    }
+    return 0;
+}
+
+/**
+ * Reads rings of 10 up to @param argv[0] 64 byte entries start to finish, @param argv[1] bytes
+ * per call (default 48, so most calls straddle two entries), once searching every lookup and
+ * once with a read cursor, and reports the cost per read call. A read cursor also has to survive
+ * writes: a final pass adds an entry (evicting the oldest) between every pair of reads and
+ * checks the reader still gets consistent data.
+ */
+static int bench_sequential(int argc, char *argv[])
+{
+    uint32_t max_capacity = (argc > 0) ? strtoul(argv[0], NULL, 10) : 1000000;
+    size_t read_size = (argc > 1) ? strtoul(argv[1], NULL, 10) : 48;
+    static char payloads[26][64];
+    uint32_t capacity;
+
+    if (read_size < 1) {
+        fprintf(stderr, "read_size must be at least 1\n");
+        return 1;
+    }
+    for (int i = 0; i < 26; i++) {
+        memset(payloads[i], 'a' + i, sizeof(payloads[i]) - 1);
+        payloads[i][sizeof(payloads[i]) - 1] = '\n';
+    }
+
+    printf("%10s %18s %18s\n", "capacity", "search ns/read", "cursor ns/read");
+    for (capacity = 10; capacity <= max_capacity; capacity *= 10) {
+        struct aesd_circular_buffer buffer;
+        struct aesd_buffer_entry entry = { .size = sizeof(payloads[0]) };
+        size_t lost_size = 0;
+        size_t total;
+        char *out;
+        double elapsed[2];
+        unsigned long calls = 0;
+
+        if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+            fprintf(stderr, "Can't allocate %u entries\n", capacity);
+            return 1;
+        }
+        // Wrap the ring once so out_offs is in the middle
+        for (uint64_t i = 0; i < capacity + capacity / 2; i++) {
+            entry.buffptr = payloads[i % 26];
+            aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size);
+        }
+        total = aesd_circular_buffer_size(&buffer);
+        out = malloc(total + read_size);
+
+        for (int with_cursor = 0; with_cursor <= 1; with_cursor++) {
+            struct aesd_read_cursor cursor = {0};
+            size_t f_pos = 0;
+            double start;
+            // Enough passes over the small rings for a stable timing
+            int passes = 1 + 2000000 / (total / read_size + 1);
+
+            calls = 0;
+            start = now_sec();
+            for (int pass = 0; pass < passes; pass++) {
+                size_t n;
+                f_pos = 0;
+                while ((n = with_cursor ? model_read_cursor(&buffer, &cursor, out + f_pos, read_size, &f_pos)
+                                        : model_read_bulk(&buffer, out + f_pos, read_size, &f_pos)) > 0) {
+                    calls++;
+                }
+            }
+            elapsed[with_cursor] = now_sec() - start;
+
+            for (uint32_t i = 0; i < aesd_circular_buffer_count(&buffer); i++) {
+                if (f_pos != total || memcmp(out + (size_t)i * entry.size,
+                        buffer.entry[(buffer.out_offs + i) & buffer.mask].buffptr, entry.size) != 0) {
+                    fprintf(stderr, "capacity %u: read back the wrong data\n", capacity);
+                    return 1;
+                }
+            }
+            elapsed[with_cursor] = elapsed[with_cursor] * 1e9 / calls;
+        }
+        printf("%10u %18.1f %18.1f\n", capacity, elapsed[0], elapsed[1]);
+
+        // Interleave evicting writes with cursor reads. Every eviction shifts the history by one
+        // entry, so each read must return bytes that start at the same offset into an entry as the
+        // previous read ended at, and stay within the current history.
+        {
+            struct aesd_read_cursor cursor = {0};
+            size_t f_pos = 0;
+            char chunk[256];
+            for (int i = 0; i < 1000 && f_pos < aesd_circular_buffer_size(&buffer); i++) {
+                size_t offset_byte_rtn;
+                size_t n;
+                struct aesd_buffer_entry *expect;
+
+                entry.buffptr = payloads[i % 26];
+                aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size);
+                expect = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, f_pos, &offset_byte_rtn);
+                n = model_read_cursor(&buffer, &cursor, chunk, read_size < sizeof(chunk) ? read_size : sizeof(chunk), &f_pos);
+                if (!expect || n == 0 || memcmp(chunk, expect->buffptr + offset_byte_rtn,
+                        n < expect->size - offset_byte_rtn ? n : expect->size - offset_byte_rtn) != 0) {
+                    fprintf(stderr, "capacity %u: stale cursor after eviction %d\n", capacity, i);
+                    return 1;
+                }
+            }
+        }
+        free(out);
+        aesd_circular_buffer_free(&buffer);
+    }
+    return 0;
+}
+
+/**
+ * Device state for the write models: the history plus the partial command being built
+ */
+struct model_dev {
+    struct aesd_circular_buffer buffer;
+    struct aesd_pool pool;
+    char *partial;
+    size_t partial_size;
+    size_t partial_capacity;
+    // malloc()/realloc() calls made by model_write_kmalloc()
+    unsigned long kmalloc_calls;
+};
+
+/**
+ * The previous aesd_write(): a temporary copy of every write, a krealloc() of the partial
+ * command per write, and a kfree() of every evicted entry.
+ */
+static void model_write_kmalloc(struct model_dev *dev, const char *buf, size_t count)
+{
+    struct aesd_buffer_entry entry;
+    size_t lost_size = 0;
+    const char *lost;
+    char *temp = malloc(count + 1);
+
+    dev->kmalloc_calls++;
+    memcpy(temp, buf, count);
+    pthread_mutex_lock(&dev_lock);
+    if (dev->partial == NULL && memchr(temp, '\n', count)) {
+        entry.buffptr = temp;
+        entry.size = count;
+    }
+    else {
+        dev->partial = realloc(dev->partial, dev->partial_size + count);
+        dev->kmalloc_calls++;
+        memcpy(dev->partial + dev->partial_size, temp, count);
+        dev->partial_size += count;
+        free(temp);
+        if (!memchr(buf, '\n', count)) {
+            pthread_mutex_unlock(&dev_lock);
+            return;
+        }
+        entry.buffptr = dev->partial;
+        entry.size = dev->partial_size;
+    }
+    lost = aesd_circular_buffer_add_entry(&dev->buffer, &entry, &lost_size);
+    free((char *)lost);
+    dev->partial = NULL;
+    dev->partial_size = 0;
+    pthread_mutex_unlock(&dev_lock);
+}
+
+/**
+ * Makes room for @param needed bytes in dev->partial, moving to the next pool class that fits,
+ * so a command built from many small appends is copied O(log n) times rather than once per append.
+ * The partial command only grows until it is added, so its block stays in the class of its length.
+ */
+static void model_grow_partial(struct model_dev *dev, size_t needed)
+{
+    size_t capacity;
+    char *grown;
+
+    if (needed <= dev->partial_capacity) {
+        return;
+    }
+    // Oversized blocks are not pooled, double them so they grow geometrically too
+    if (needed > ((size_t)1 << AESD_POOL_MAX_SHIFT) && needed < 2 * dev->partial_capacity) {
+        needed = 2 * dev->partial_capacity;
+    }
+    grown = aesd_pool_alloc(&dev->pool, needed, &capacity);
+    if (dev->partial) {
+        memcpy(grown, dev->partial, dev->partial_size);
+        aesd_pool_free(&dev->pool, dev->partial, dev->partial_capacity);
+    }
+    dev->partial = grown;
+    dev->partial_capacity = capacity;
+}
+
+/**
+ * The pool aesd_write() with one partial command per device: copies straight into a partial
+ * command that grows geometrically from the pool, and recycles evicted entries into it.
+ */
+static void model_write_pool_locked(struct model_dev *dev, const char *buf, size_t count)
+{
+    struct aesd_buffer_entry entry;
+    size_t lost_size = 0;
+    const char *lost;
+
+    model_grow_partial(dev, dev->partial_size + count);
+    memcpy(dev->partial + dev->partial_size, buf, count);
+    if (!memchr(buf, '\n', count)) {
+        dev->partial_size += count;
+        return;
+    }
+    entry.size = dev->partial_size + count;
+    entry.buffptr = dev->partial;
+    lost = aesd_circular_buffer_add_entry(&dev->buffer, &entry, &lost_size);
+    aesd_pool_free(&dev->pool, lost, lost_size);
+    dev->partial = NULL;
+    dev->partial_size = 0;
+    dev->partial_capacity = 0;
+}
+
+static void model_write_pool(struct model_dev *dev, const char *buf, size_t count)
+{
+    pthread_mutex_lock(&dev_lock);
+    model_write_pool_locked(dev, buf, count);
+    pthread_mutex_unlock(&dev_lock);
+}
+
+typedef void (*write_fn)(struct model_dev *, const char *, size_t);
+
+/**
+ * Writes @param commands commands of @param command_size bytes into a default size history,
+ * each split into writes of @param piece bytes. The first pass over the history is warm-up;
+ * allocations are counted over the rest.
+ * @return allocator calls per command in the steady state, with the throughput in @param mb_per_sec
+ */
+static double bench_write_strategy(write_fn fn, bool pooled, size_t command_size, size_t piece,
+        unsigned long commands, double *mb_per_sec)
+{
+    struct model_dev dev;
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+    char *command = malloc(command_size);
+    unsigned long warmup = 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    unsigned long allocs_at_warmup = 0;
+    unsigned long allocs;
+    double start;
+
+    memset(&dev, 0, sizeof(dev));
+    aesd_circular_buffer_init(&dev.buffer);
+    aesd_pool_init(&dev.pool);
+    memset(command, 'w', command_size - 1);
+    command[command_size - 1] = '\n';
+
+    start = now_sec();
+    for (unsigned long i = 0; i < warmup + commands; i++) {
+        if (i == warmup) {
+            allocs_at_warmup = pooled ? dev.pool.stats.backing_allocs : dev.kmalloc_calls;
+            start = now_sec();
+        }
+        for (size_t off = 0; off < command_size; off += piece) {
+            fn(&dev, command + off, off + piece <= command_size ? piece : command_size - off);
+        }
+    }
+    *mb_per_sec = (double)command_size * commands / (now_sec() - start) / 1e6;
+    allocs = (pooled ? dev.pool.stats.backing_allocs : dev.kmalloc_calls) - allocs_at_warmup;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev.buffer, index) {
+        if (pooled) {
+            aesd_pool_free(&dev.pool, entry->buffptr, entry->size);
+        }
+        else {
+            free((char *)entry->buffptr);
+        }
+    }
+    aesd_circular_buffer_free(&dev.buffer);
+    aesd_pool_destroy(&dev.pool);
+    free(command);
+    return (double)allocs / commands;
+}
+
+/**
+ * Compares the kmalloc and pool write paths for commands of @param argv[0] bytes written whole
+ * and in smaller pieces, down to a byte at a time. Fails if the pool allocates anything in the
+ * steady state.
+ */
+static int bench_alloc(int argc, char *argv[])
+{
+    size_t command_size = (argc > 0) ? strtoul(argv[0], NULL, 10) : 4096;
+    unsigned long commands = (argc > 1) ? strtoul(argv[1], NULL, 10) : 20000;
+    size_t pieces[] = { command_size, 256, 16, 1 };
+
+    if (command_size < 2 || commands < 1) {
+        fprintf(stderr, "command_size must be at least 2 and commands at least 1\n");
+        return 1;
+    }
+    printf("alloc: %zu byte commands, %lu commands after warm-up\n", command_size, commands);
+    printf("%12s %14s %16s %14s %16s\n", "write size", "kmalloc MB/s", "kmalloc allocs/cmd",
+           "pool MB/s", "pool allocs/cmd");
+    for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++) {
+        double kmalloc_mb;
+        double pool_mb;
+        double kmalloc_allocs;
+        double pool_allocs;
+        // Byte at a time writes are slow in both, keep their run short
+        unsigned long n = pieces[i] < 16 ? commands / 10 + 1 : commands;
+
+        if (pieces[i] > command_size) {
+            continue;
+        }
+        kmalloc_allocs = bench_write_strategy(model_write_kmalloc, false, command_size, pieces[i], n, &kmalloc_mb);
+        pool_allocs = bench_write_strategy(model_write_pool, true, command_size, pieces[i], n, &pool_mb);
+        printf("%12zu %14.1f %16.2f %14.1f %16.2f\n", pieces[i], kmalloc_mb, kmalloc_allocs, pool_mb, pool_allocs);
+        // Commands over the largest class go to malloc() every time, by design
+        if (pool_allocs != 0 && command_size <= ((size_t)1 << AESD_POOL_MAX_SHIFT)) {
+            fprintf(stderr, "the pool allocated in the steady state\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * dev->lock for the concurrency model: a mutex like the driver used to have, or a reader-writer
+ * lock that prefers writers like an rwsem
+ */
+struct model_lock {
+    bool shared;
+    pthread_mutex_t mutex;
+    pthread_rwlock_t rwlock;
+};
+
+static void model_lock_init(struct model_lock *lock, bool shared)
+{
+    pthread_rwlockattr_t attr;
+
+    lock->shared = shared;
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+static void model_lock_destroy(struct model_lock *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+    pthread_rwlock_destroy(&lock->rwlock);
+}
+
+static void model_lock_take(struct model_lock *lock, bool write)
+{
+    if (!lock->shared) {
+        pthread_mutex_lock(&lock->mutex);
+    }
+    else if (write) {
+        pthread_rwlock_wrlock(&lock->rwlock);
+    }
+    else {
+        pthread_rwlock_rdlock(&lock->rwlock);
+    }
+}
+
+static void model_lock_release(struct model_lock *lock)
+{
+    if (lock->shared) {
+        pthread_rwlock_unlock(&lock->rwlock);
+    }
+    else {
+        pthread_mutex_unlock(&lock->mutex);
+    }
+}
+
+struct concurrency_state {
+    struct model_dev dev;
+    struct model_lock lock;
+    volatile bool stop;
+    size_t entry_size;
+    unsigned long writes;
+};
+
+struct reader_result {
+    struct concurrency_state *state;
+    unsigned long bytes;
+    unsigned long torn;
+};
+
+/**
+ * A reader: reads the history start to finish over and over, 4096 bytes per aesd_read(),
+ * and checks every read call returned whole runs of one letter separated by newlines.
+ * A write landing in the middle of a read call would show up as two letters meeting.
+ */
+static void *concurrency_reader(void *arg)
+{
+    struct reader_result *result = arg;
+    struct concurrency_state *state = result->state;
+    struct aesd_read_cursor cursor = {0};
+    char out[4096];
+
+    while (!state->stop) {
+        size_t f_pos = 0;
+        while (!state->stop) {
+            struct aesd_buffer_entry *entry;
+            size_t offset_byte_rtn = 0;
+            size_t copied = 0;
+
+            model_lock_take(&state->lock, false);
+            while (copied < sizeof(out)) {
+                size_t chunk;
+                entry = aesd_circular_buffer_find_entry_cursor(&state->dev.buffer, f_pos, &offset_byte_rtn, &cursor);
+                if (!entry) {
+                    break;
+                }
+                chunk = entry->size - offset_byte_rtn;
+                if (chunk > sizeof(out) - copied) {
+                    chunk = sizeof(out) - copied;
+                }
+                memcpy(out + copied, entry->buffptr + offset_byte_rtn, chunk);
+                copied += chunk;
+                f_pos += chunk;
+            }
+            model_lock_release(&state->lock);
+
+            if (copied == 0) {
+                break;
+            }
+            for (size_t i = 0; i + 1 < copied; i++) {
+                if (out[i] != '\n' && out[i + 1] != '\n' && out[i] != out[i + 1]) {
+                    result->torn++;
+                    break;
+                }
+            }
+            result->bytes += copied;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The writer: one whole command every @param state->entry_size bytes, through the pool write
+ * path, pausing between writes like a network-fed producer would.
+ */
+static void *concurrency_writer(void *arg)
+{
+    struct concurrency_state *state = arg;
+    char *command = malloc(state->entry_size);
+    struct timespec pause = { 0, 20000 };
+
+    while (!state->stop) {
+        memset(command, 'a' + state->writes % 26, state->entry_size - 1);
+        command[state->entry_size - 1] = '\n';
+        model_lock_take(&state->lock, true);
+        model_write_pool_locked(&state->dev, command, state->entry_size);
+        model_lock_release(&state->lock);
+        state->writes++;
+        nanosleep(&pause, NULL);
+    }
+    free(command);
+    return NULL;
+}
+
+/**
+ * Runs 1, 2, 4 ... @param argv[0] readers against one writer for @param argv[1] seconds each,
+ * first with a mutex and then with a reader-writer lock, and reports the aggregate read
+ * throughput and any torn read calls. A baseline for the model's locking only.
+ */
+static int bench_concurrency(int argc, char *argv[])
+{
+    int max_readers = (argc > 0) ? atoi(argv[0]) : 8;
+    double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+
+    if (max_readers < 1 || seconds <= 0) {
+        fprintf(stderr, "max_readers must be at least 1 and seconds positive\n");
+        return 1;
+    }
+    printf("concurrency (model baseline): %d entries x 1024 bytes, 1 writer, %ld online CPUs\n",
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %12s %16s %12s\n", "readers", "mutex MB/s", "writes/s", "rwlock MB/s", "writes/s");
+    for (int readers = 1; readers <= max_readers; readers *= 2) {
+        printf("%8d", readers);
+        for (int shared = 0; shared <= 1; shared++) {
+            struct concurrency_state state;
+            struct reader_result results[readers];
+            pthread_t reader_threads[readers];
+            pthread_t writer_thread;
+            struct timespec run = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+            struct aesd_buffer_entry *entry;
+            uint32_t index;
+            unsigned long bytes = 0;
+
+            memset(&state, 0, sizeof(state));
+            state.entry_size = 1024;
+            aesd_circular_buffer_init(&state.dev.buffer);
+            aesd_pool_init(&state.dev.pool);
+            model_lock_init(&state.lock, shared);
+
+            pthread_create(&writer_thread, NULL, concurrency_writer, &state);
+            for (int i = 0; i < readers; i++) {
+                results[i] = (struct reader_result){ .state = &state };
+                pthread_create(&reader_threads[i], NULL, concurrency_reader, &results[i]);
+            }
+            nanosleep(&run, NULL);
+            state.stop = true;
+            pthread_join(writer_thread, NULL);
+            for (int i = 0; i < readers; i++) {
+                pthread_join(reader_threads[i], NULL);
+                bytes += results[i].bytes;
+                if (results[i].torn) {
+                    fprintf(stderr, "\nreader %d saw %lu torn reads in the model\n", i, results[i].torn);
+                }
+            }
+            printf(" %16.1f %12.0f", bytes / seconds / 1e6, state.writes / seconds);
+
+            AESD_CIRCULAR_BUFFER_FOREACH(entry, &state.dev.buffer, index) {
+                aesd_pool_free(&state.dev.pool, entry->buffptr, entry->size);
+            }
+            aesd_circular_buffer_free(&state.dev.buffer);
+            aesd_pool_destroy(&state.dev.pool);
+            model_lock_destroy(&state.lock);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// Body bytes per staging command, written as a header, the body and the newline
+#define STAGING_BODY 48
+
+struct staging_state {
+    struct model_dev dev;
+    // Stage partial commands per writer rather than in dev.partial
+    bool per_file;
+    volatile bool stop;
+};
+
+struct staging_writer {
+    struct staging_state *state;
+    int id;
+    unsigned long commits;
+    // The writer's own partial command, for the per file model
+    char *stage;
+    size_t stage_size;
+    size_t stage_capacity;
+};
+
+/**
+ * The per file aesd_write(): appends to the writer's own stage without the lock, and only takes
+ * it to copy commands completed by this write into the pool and add them.
+ */
+static void model_write_staged(struct staging_writer *writer, const char *buf, size_t count)
+{
+    struct model_dev *dev = &writer->state->dev;
+    size_t start = 0;
+    size_t complete;
+
+    if (writer->stage_size + count > writer->stage_capacity) {
+        writer->stage_capacity = 2 * (writer->stage_size + count);
+        writer->stage = realloc(writer->stage, writer->stage_capacity);
+    }
+    memcpy(writer->stage + writer->stage_size, buf, count);
+    complete = writer->stage_size + count;
+    while (complete > writer->stage_size && writer->stage[complete - 1] != '\n') {
+        complete--;
+    }
+    if (complete == writer->stage_size) {
+        writer->stage_size += count;
+        return;
+    }
+
+    pthread_mutex_lock(&dev_lock);
+    while (start < complete) {
+        struct aesd_buffer_entry entry;
+        size_t lost_size = 0;
+        size_t capacity;
+        const char *lost;
+        char *newline = memchr(writer->stage + start, '\n', complete - start);
+        char *command;
+
+        entry.size = newline + 1 - (writer->stage + start);
+        command = aesd_pool_alloc(&dev->pool, entry.size, &capacity);
+        memcpy(command, writer->stage + start, entry.size);
+        entry.buffptr = command;
+        lost = aesd_circular_buffer_add_entry(&dev->buffer, &entry, &lost_size);
+        aesd_pool_free(&dev->pool, lost, lost_size);
+        start += entry.size;
+    }
+    pthread_mutex_unlock(&dev_lock);
+
+    writer->stage_size += count - start;
+    memmove(writer->stage, writer->stage + start, writer->stage_size);
+}
+
+/**
+ * A producer: writes commands "<id>:" followed by STAGING_BODY copies of its own letter, as
+ * three write calls each, through the device wide or the per file stage.
+ */
+static void *staging_writer(void *arg)
+{
+    struct staging_writer *writer = arg;
+    struct staging_state *state = writer->state;
+    char header[16];
+    char body[STAGING_BODY];
+    const char *pieces[3] = { header, body, "\n" };
+    size_t lengths[3] = { 0, sizeof(body), 1 };
+
+    lengths[0] = snprintf(header, sizeof(header), "%d:", writer->id);
+    memset(body, 'a' + writer->id % 26, sizeof(body));
+    while (!state->stop) {
+        for (int i = 0; i < 3; i++) {
+            if (state->per_file) {
+                model_write_staged(writer, pieces[i], lengths[i]);
+            }
+            else {
+                model_write_pool(&state->dev, pieces[i], lengths[i]);
+            }
+        }
+        writer->commits++;
+    }
+    free(writer->stage);
+    return NULL;
+}
+
+/**
+ * @return true if @param entry is one whole staging command: a writer's header, its letter
+ * STAGING_BODY times and the newline, with nothing from another writer in between
+ */
+static bool staging_command_intact(const struct aesd_buffer_entry *entry)
+{
+    char expected[16 + STAGING_BODY + 1];
+    char *end;
+    long id = strtol(entry->buffptr, &end, 10);
+    size_t header;
+
+    if (end == entry->buffptr || *end != ':' || id < 0) {
+        return false;
+    }
+    header = end + 1 - entry->buffptr;
+    if (entry->size != header + STAGING_BODY + 1) {
+        return false;
+    }
+    memset(expected, 'a' + id % 26, STAGING_BODY);
+    expected[STAGING_BODY] = '\n';
+    return memcmp(entry->buffptr + header, expected, STAGING_BODY + 1) == 0;
+}
+
+/**
+ * Runs 1, 2, 4 ... @param argv[0] writers for @param argv[1] seconds each, every command split
+ * over three writes, staged first in the one device wide partial command and then per writer.
+ * Reports commits per second and how many of the last 4096 commands came out interleaved. A
+ * baseline for the model's staging only, aesdchar-bench producers checks the driver's.
+ */
+static int bench_staging(int argc, char *argv[])
+{
+    int max_writers = (argc > 0) ? atoi(argv[0]) : 16;
+    double seconds = (argc > 1) ? atof(argv[1]) : BENCH_SECONDS;
+
+    if (max_writers < 1 || seconds <= 0) {
+        fprintf(stderr, "max_writers must be at least 1 and seconds positive\n");
+        return 1;
+    }
+    printf("staging (model baseline): commands of a header, %d bytes and a newline in 3 writes each, %ld online CPUs\n",
+           STAGING_BODY, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %12s %16s %12s\n", "writers", "device commits/s", "interleaved",
+           "file commits/s", "interleaved");
+    for (int writers = 1; writers <= max_writers; writers *= 2) {
+        printf("%8d", writers);
+        for (int per_file = 0; per_file <= 1; per_file++) {
+            struct staging_state state;
+            struct staging_writer results[writers];
+            pthread_t threads[writers];
+            struct timespec run = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+            struct aesd_buffer_entry *entry;
+            uint32_t index;
+            unsigned long commits = 0;
+            unsigned long interleaved = 0;
+
+            memset(&state, 0, sizeof(state));
+            state.per_file = per_file;
+            aesd_circular_buffer_init_capacity(&state.dev.buffer, 4096);
+            aesd_pool_init(&state.dev.pool);
+
+            for (int i = 0; i < writers; i++) {
+                results[i] = (struct staging_writer){ .state = &state, .id = i };
+                pthread_create(&threads[i], NULL, staging_writer, &results[i]);
+            }
+            nanosleep(&run, NULL);
+            state.stop = true;
+            for (int i = 0; i < writers; i++) {
+                pthread_join(threads[i], NULL);
+                commits += results[i].commits;
+            }
+
+            AESD_CIRCULAR_BUFFER_FOREACH(entry, &state.dev.buffer, index) {
+                if (entry->buffptr && !staging_command_intact(entry)) {
+                    interleaved++;
+                }
+            }
+            printf(" %16.0f %12lu", commits / seconds, interleaved);
+
+            AESD_CIRCULAR_BUFFER_FOREACH(entry, &state.dev.buffer, index) {
+                aesd_pool_free(&state.dev.pool, entry->buffptr, entry->size);
+            }
+            aesd_circular_buffer_free(&state.dev.buffer);
+            aesd_pool_free(&state.dev.pool, state.dev.partial, state.dev.partial_capacity);
+            aesd_pool_destroy(&state.dev.pool);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+/**
+ * @return the bytes of the pool block holding a command of @param size bytes
+ */
+static size_t block_bytes(size_t size)
+{
+    size_t capacity = (size_t)1 << AESD_POOL_MIN_SHIFT;
+
+    if (size > ((size_t)1 << AESD_POOL_MAX_SHIFT)) {
+        return size;
+    }
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+static int compare_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sizes for the mixed workload: mostly short commands, some 4KiB, a few of 1MiB
+ */
+static size_t mixed_command_size(uint32_t *state)
+{
+    uint32_t r;
+
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    r = *state % 1000;
+    if (r < 10) {
+        return 1 << 20;
+    }
+    if (r < 100) {
+        return 4096;
+    }
+    return 64 + r % 192;
+}
+
+/**
+ * Adds @param commands mixed size commands to a history of @param capacity entries with a
+ * byte budget of @param budget (0 for none) the way aesd_add_command() does, and prints the
+ * bytes held and the add latency, evictions and frees included.
+ */
+static void bench_budget_policy(const char *name, uint32_t capacity, size_t budget, unsigned long commands)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_pool pool;
+    struct aesd_buffer_entry *entry;
+    unsigned long *latency = malloc(commands * sizeof(*latency));
+    uint32_t state = 0x2545F491;
+    uint32_t index;
+    size_t blocks = 0;
+    size_t peak_bytes = 0;
+    size_t peak_blocks = 0;
+    double sum_bytes = 0;
+
+    aesd_circular_buffer_init_capacity(&buffer, capacity);
+    buffer.byte_budget = budget;
+    aesd_pool_init(&pool);
+
+    for (unsigned long i = 0; i < commands; i++) {
+        struct aesd_buffer_entry add;
+        struct timespec begin;
+        struct timespec end;
+        size_t lost_size = 0;
+        size_t pool_capacity;
+        const char *lost;
+        char *command;
+
+        add.size = mixed_command_size(&state);
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        command = aesd_pool_alloc(&pool, add.size, &pool_capacity);
+        memset(command, 'm', add.size);
+        add.buffptr = command;
+        while ((lost = aesd_circular_buffer_make_room(&buffer, add.size, &lost_size)) != NULL) {
+            aesd_pool_free(&pool, lost, lost_size);
+            blocks -= block_bytes(lost_size);
+        }
+        lost = aesd_circular_buffer_add_entry(&buffer, &add, &lost_size);
+        if (lost) {
+            aesd_pool_free(&pool, lost, lost_size);
+            blocks -= block_bytes(lost_size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        blocks += pool_capacity;
+
+        latency[i] = (end.tv_sec - begin.tv_sec) * 1000000000UL + end.tv_nsec - begin.tv_nsec;
+        sum_bytes += aesd_circular_buffer_size(&buffer);
+        if (aesd_circular_buffer_size(&buffer) > peak_bytes) {
+            peak_bytes = aesd_circular_buffer_size(&buffer);
+        }
+        if (blocks > peak_blocks) {
+            peak_blocks = blocks;
+        }
+    }
+
+    qsort(latency, commands, sizeof(*latency), compare_ulong);
+    printf("%-22s %12.0f %12zu %12zu %10lu %10lu %10lu\n", name, sum_bytes / commands / 1024,
+           peak_bytes / 1024, peak_blocks / 1024, latency[commands / 2], latency[commands * 99 / 100],
+           latency[commands - 1]);
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+        aesd_pool_free(&pool, entry->buffptr, entry->size);
+    }
+    aesd_circular_buffer_free(&buffer);
+    aesd_pool_destroy(&pool);
+    free(latency);
+}
+
+/**
+ * Compares a history bounded only by entry count with the same history also held to a byte
+ * budget of @param argv[0], over @param argv[1] commands that are 90% 64-255 bytes, 9% 4KiB
+ * and 1% 1MiB.
+ */
+static int bench_budget(int argc, char *argv[])
+{
+    size_t budget = (argc > 0) ? strtoul(argv[0], NULL, 10) : 4 << 20;
+    unsigned long commands = (argc > 1) ? strtoul(argv[1], NULL, 10) : 50000;
+    char name[64];
+
+    if (budget < 1 || commands < 1) {
+        fprintf(stderr, "max_bytes and commands must be at least 1\n");
+        return 1;
+    }
+    printf("budget: %lu mixed size commands, history of 1024 entries\n", commands);
+    printf("%-22s %12s %12s %12s %10s %10s %10s\n", "policy", "mean KiB", "peak KiB", "blocks KiB",
+           "p50 ns", "p99 ns", "max ns");
+    bench_budget_policy("count only", 1024, 0, commands);
+    snprintf(name, sizeof(name), "count + %zu KiB", budget / 1024);
+    bench_budget_policy(name, 1024, budget, commands);
+    return 0;
+}
+
+/**
+ * Lays out a wrapped ring of @param argv[0] entries of up to @param argv[1] bytes the way
+ * mmap() of the device presents it, checks the view against reads of the ring, and compares
+ * consuming the whole history through 4096 byte reads with scanning the view in place.
+ */
+static int bench_mmap(int argc, char *argv[])
+{
+    uint32_t capacity = (argc > 0) ? strtoul(argv[0], NULL, 10) : 10000;
+    size_t max_entry = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200;
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_history_header *header;
+    struct aesd_read_cursor cursor = {0};
+    size_t lost_size = 0;
+    size_t total;
+    unsigned long seed = 3;
+    unsigned long newlines = 0;
+    char *payload;
+    char *out;
+    int passes = 200;
+    double start;
+    double read_elapsed;
+    double scan_elapsed;
+
+    if (capacity < 1 || max_entry < 1) {
+        fprintf(stderr, "capacity and entry_size must be at least 1\n");
+        return 1;
+    }
+    if (aesd_circular_buffer_init_capacity(&buffer, capacity) != 0) {
+        fprintf(stderr, "Can't allocate %u entries\n", capacity);
+        return 1;
+    }
+    payload = malloc(max_entry + 26);
+    for (size_t i = 0; i < max_entry + 26; i++) {
+        payload[i] = 'a' + i % 26;
+    }
+    // Each entry ends in a newline so the scan below has something to count
+    for (uint64_t i = 0; i < capacity + capacity / 2; i++) {
+        char *data;
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        entry.size = 1 + (seed >> 33) % max_entry;
+        data = malloc(entry.size);
+        memcpy(data, payload + i % 26, entry.size - 1);
+        data[entry.size - 1] = '\n';
+        entry.buffptr = data;
+        free((char *)aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size));
+    }
+    total = aesd_circular_buffer_size(&buffer);
+
+    header = malloc(aesd_circular_buffer_layout_size(&buffer));
+    aesd_circular_buffer_layout(&buffer, header);
+    out = malloc(total + 4096);
+    {
+        size_t f_pos = 0;
+        while (model_read_cursor(&buffer, &cursor, out + f_pos, 4096, &f_pos) > 0) {
+        }
+    }
+    if (header->magic != AESD_HISTORY_MAGIC || header->entry_count != aesd_circular_buffer_count(&buffer) ||
+        header->data_size != total || header->layout_size != aesd_circular_buffer_layout_size(&buffer) ||
+        memcmp(AESD_HISTORY_DATA(header), out, total) != 0) {
+        fprintf(stderr, "layout does not match the history\n");
+        return 1;
+    }
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        const struct aesd_buffer_entry *expect = &buffer.entry[(buffer.out_offs + i) & buffer.mask];
+        if (header->entry_offset[i + 1] - header->entry_offset[i] != expect->size ||
+            memcmp(AESD_HISTORY_DATA(header) + header->entry_offset[i], expect->buffptr, expect->size) != 0) {
+            fprintf(stderr, "entry %u does not match\n", i);
+            return 1;
+        }
+    }
+
+    // What a consumer does with the history: here, count the commands
+    start = now_sec();
+    for (int pass = 0; pass < passes; pass++) {
+        size_t f_pos = 0;
+        size_t n;
+        while ((n = model_read_cursor(&buffer, &cursor, out, 4096, &f_pos)) > 0) {
+            for (const char *p = out; (p = memchr(p, '\n', out + n - p)) != NULL; p++) {
+                newlines++;
+            }
+        }
+    }
+    read_elapsed = now_sec() - start;
+
+    start = now_sec();
+    for (int pass = 0; pass < passes; pass++) {
+        const char *data = AESD_HISTORY_DATA(header);
+        for (const char *p = data; (p = memchr(p, '\n', data + header->data_size - p)) != NULL; p++) {
+            newlines++;
+        }
+    }
+    scan_elapsed = now_sec() - start;
+
+    if (newlines != 2UL * passes * header->entry_count) {
+        fprintf(stderr, "counted %lu commands, expected %lu\n", newlines, 2UL * passes * header->entry_count);
+        return 1;
+    }
+    printf("mmap: %u entries, %zu bytes, layout %llu bytes\n", header->entry_count, total,
+           (unsigned long long)header->layout_size);
+    printf("%-22s %10.1f MB/s %12.1f calls/pass\n", "read() 4096 per call", total * passes / read_elapsed / 1e6,
+           (double)((total + 4095) / 4096 + 1));
+    printf("%-22s %10.1f MB/s %12.1f calls/pass\n", "scan mapped view", total * passes / scan_elapsed / 1e6, 0.0);
+
+    free_buffer(&buffer);
+    free(header);
+    free(out);
+    free(payload);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "read") == 0) {
+        return bench_read(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "capacity") == 0) {
+        return bench_capacity(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "lookup") == 0) {
+        return bench_lookup(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "sequential") == 0) {
+        return bench_sequential(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "alloc") == 0) {
+        return bench_alloc(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "concurrency") == 0) {
+        return bench_concurrency(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "mmap") == 0) {
+        return bench_mmap(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "staging") == 0) {
+        return bench_staging(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "budget") == 0) {
+        return bench_budget(argc - 2, argv + 2);
+    }
+
+    fprintf(stderr, "Usage: %s read [entry_size] [iterations]\n"
+                    "       %s capacity [max_capacity]\n"
+                    "       %s lookup [max_capacity]\n"
+                    "       %s sequential [max_capacity] [read_size]\n"
+                    "       %s alloc [command_size] [commands]\n"
+                    "       %s concurrency [max_readers] [seconds]\n"
+                    "       %s mmap [capacity] [entry_size]\n"
+                    "       %s staging [max_writers] [seconds]\n"
+                    "       %s budget [max_bytes] [commands]\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
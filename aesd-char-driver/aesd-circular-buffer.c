@@ -10,9 +10,15 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include <linux/slab.h> // for kvcalloc()
+#include <linux/mm.h> // for kvfree()
+#include <linux/log2.h> // for roundup_pow_of_two()
+#include <linux/errno.h>
 #else
 #include <string.h>
 #include <stdio.h> // for PDEBUG()
+#include <stdlib.h> // for calloc()
+#include <errno.h>
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -30,112 +36,129 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    /**
-    * TODO: implement per description
-    */
-    // int entryptr = NULL;
-    uint8_t index = 0;
-    // uint8_t curr_pos = 0;
-    struct aesd_buffer_entry *entry;
-    int char_offset_signed = char_offset; // to allow it to go negative
-
-    PDEBUG("* char_offset: %zu\n", char_offset);
-    // PDEBUG("* buffer is full?: %i\n", buffer->full);
-    // PDEBUG("* buffer->in_offs: %i\n", buffer->in_offs);
-    // PDEBUG("* buffer->out_offs: %i\n", buffer->out_offs);
-
-    /* 4 possible scenarios to search through
-    A. |out/in             | starting state. out = in. Buffer is empty.
-    B. |  out------->in    | in has advanced but isn't yet behind out.
-    C. |-->in       out----| in has rolled over and is now behind out.
-    D. |------>in/out------| in has caught up to out. out = in again. Buffer is full.
-    */
-    // Scenario A
-    if (buffer->out_offs == buffer->in_offs && !buffer->full) {
-        PDEBUG("----Scenario A\n");
-        // do nothing since the buffer has nothing in it.
-    }
+    uint32_t lo = 0;
+    uint32_t hi = aesd_circular_buffer_count(buffer);
+    uint32_t slot;
 
-    // Scenario B
-    if (buffer->in_offs > buffer->out_offs) {
-        PDEBUG("----Scenario B\n");
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
-            // skip empty indices
-            if (index < buffer->out_offs || index > buffer->in_offs) {
-                continue;
-            }
+    if (char_offset >= buffer->end - buffer->base) {
+        return NULL;
+    }
 
-            // check current index
-            char_offset_signed -= buffer->entry[index].size;
-            if (char_offset_signed < 0) {
-                // Add back in the subtracted size and return
-                *entry_offset_byte_rtn = char_offset_signed + buffer->entry[index].size;
-                return entry;
-            }
+    // Binary search the logical entries (out_offs + i) for the last one starting at or before char_offset
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (buffer->start[(buffer->out_offs + mid) & buffer->mask] - buffer->base <= char_offset) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
         }
     }
 
-    // Scenario C or Scenario D (same situation as far as looping goes)
-    if ((buffer->out_offs > buffer->in_offs) || // Scenario C
-        (buffer->out_offs == buffer->in_offs && buffer->full)) { // Scenario D
-        uint8_t entries_checked;
-        PDEBUG("----Scenario C or D\n");
-
-        entries_checked = 0; // will count from 1 to 10
-        // from out_offs to the end
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
-            // PDEBUG("Checking index %i\n", index);
-            // PDEBUG("Buffer entry: %s with size: %zu\n", (char*)entry->buffptr, entry->size);
-            if (index < buffer->out_offs) {
-                // PDEBUG("Skipped index %i\n", index);
-                continue;
-            }
+    slot = (buffer->out_offs + lo) & buffer->mask;
+    *entry_offset_byte_rtn = char_offset - (buffer->start[slot] - buffer->base);
+    return &buffer->entry[slot];
+}
 
-            entries_checked++;
-            // PDEBUG("entries_checked: %i\n", entries_checked);
-            // check current index
-            // PDEBUG("Current entry size: %zu\n", buffer->entry[index].size);
-            char_offset_signed -= buffer->entry[index].size;
-            // PDEBUG("char_offset_signed: %i\n", char_offset_signed);
-            if (char_offset_signed < 0) {
-                PDEBUG("Entry %i is the one\n", index);
-                // Add back in the subtracted size and return
-                *entry_offset_byte_rtn = char_offset_signed + buffer->entry[index].size;
-                // PDEBUG("entry_offset_byte_rtn: %zu\n", *entry_offset_byte_rtn);
-                return entry;
-            }
-        }
-        PDEBUG("Not found from out_offs to end. Wrapping to beginning\n");
-        PDEBUG("char_offset_signed: %i\n", char_offset_signed);
-
-        // now from the beginning to in_offs if haven't already found the answer
-        index = 0;
-        AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
-            if (entries_checked++ == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-                PDEBUG("Reached end of buffer. Entry not found. entries_checked: %i\n", entries_checked);
-                return NULL;
-            }
-            PDEBUG("entries_checked: %i\n", entries_checked);
-            PDEBUG("Checking index %i\n", index);
-
-            // check current index
-            char_offset_signed -= buffer->entry[index].size;
-            if (char_offset_signed < 0) {
-                // Add back in the subtracted size and return
-                PDEBUG("Entry %i is the one\n", index);
-                *entry_offset_byte_rtn = char_offset_signed + buffer->entry[index].size;
-                return entry;
-            }
+/**
+* Same as aesd_circular_buffer_find_entry_offset_for_fpos(), but first tries the entry @param cursor
+* points at and the one after it, which is where a sequential reader's next lookup lands.
+* Falls back to the binary search when the cursor is from an older generation or misses.
+* @param cursor is updated to the returned position. Any necessary locking must be performed by caller.
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_find_entry_cursor(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn, struct aesd_read_cursor *cursor)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    struct aesd_buffer_entry *entry;
 
-            if (index > buffer->in_offs) {
-                // error occurred! should not get here
-                PDEBUG("Arrived an an err'd location. index: %i in_offs: %i out_offs: %i\n", index, buffer->in_offs, buffer->out_offs);
-                return entry;
+    if (cursor->valid && cursor->generation == buffer->generation) {
+        uint32_t index;
+        for (index = cursor->index; index < count && index <= cursor->index + 1; index++) {
+            uint32_t slot = (buffer->out_offs + index) & buffer->mask;
+            size_t entry_start = buffer->start[slot] - buffer->base;
+            if (char_offset >= entry_start && char_offset - entry_start < buffer->entry[slot].size) {
+                cursor->index = index;
+                cursor->offset = char_offset - entry_start;
+                *entry_offset_byte_rtn = cursor->offset;
+                return &buffer->entry[slot];
             }
         }
     }
 
-    return NULL;
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, entry_offset_byte_rtn);
+    if (entry) {
+        cursor->index = ((entry - buffer->entry) - buffer->out_offs) & buffer->mask;
+        cursor->offset = *entry_offset_byte_rtn;
+        cursor->generation = buffer->generation;
+        cursor->valid = true;
+    }
+    return entry;
+}
+
+/**
+ * The reverse of aesd_circular_buffer_find_entry_offset_for_fpos(), in O(1) from the cumulative
+ * offset index. Any necessary locking must be performed by caller.
+ * @param index the logical entry, zero referenced from the oldest (out_offs)
+ * @param entry_offset the zero referenced byte within that entry
+ * @param fpos_rtn set to the position of that byte in the concatenated history when found
+ * @return the entry, or NULL if @param index or @param entry_offset is past what the buffer holds
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry_offset(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t entry_offset, size_t *fpos_rtn)
+{
+    uint32_t slot;
+
+    if (index >= aesd_circular_buffer_count(buffer)) {
+        return NULL;
+    }
+    slot = (buffer->out_offs + index) & buffer->mask;
+    if (entry_offset >= buffer->entry[slot].size) {
+        return NULL;
+    }
+    *fpos_rtn = buffer->start[slot] - buffer->base + entry_offset;
+    return &buffer->entry[slot];
+}
+
+/**
+* Removes the oldest entry of @param buffer, which must not be empty.
+* @return its buffptr for the caller to free, with its size in @param lost_size
+*/
+static const char *aesd_circular_buffer_evict_oldest(struct aesd_circular_buffer *buffer, size_t *lost_size)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char *lost_entry_buffptr = oldest->buffptr;
+
+    *lost_size = oldest->size; // added for asy9
+
+    // Advance output offset. Previous data is lost. Clear the slot: with more slots than capacity
+    // it is not reused right away, and AESD_CIRCULAR_BUFFER_FOREACH must not see it again.
+    buffer->base += oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->generation++;
+    buffer->full = false;
+    return lost_entry_buffptr;
+}
+
+/**
+* Evicts the oldest entry of @param buffer if an entry of @param size bytes would take it over
+* buffer->byte_budget. Call until it returns NULL before aesd_circular_buffer_add_entry(), which
+* still evicts by count. An entry larger than the whole budget is let in once the buffer is empty.
+* Any necessary locking must be handled by the caller.
+* @return NULL when the entry fits, or the buffptr of the evicted entry for the caller to free,
+* with its size in @param lost_size
+*/
+const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size, size_t *lost_size)
+{
+    size_t held = aesd_circular_buffer_size(buffer);
+
+    if (buffer->byte_budget == 0 || aesd_circular_buffer_count(buffer) == 0 ||
+            (size <= buffer->byte_budget && held <= buffer->byte_budget - size)) {
+        return NULL;
+    }
+    return aesd_circular_buffer_evict_oldest(buffer, lost_size);
 }
 
 /**
@@ -149,68 +172,152 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry, size_t *lost_size)
 {
-    /**
-    * TODO: implement per description
-    */
     const char * lost_entry_buffptr = NULL;
-    PDEBUG("add_entry: %s with size: %zu at in_offs: %i and out_offs: %i\n", (char*)add_entry->buffptr, add_entry->size, buffer->in_offs, buffer->out_offs);
-
-    // PDEBUG("size: %zu\n", add_entry->size);
-    // for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-    //     PDEBUG("buff[%i]: %s\n", i, (char*)buffer->entry[i].buffptr);
-    // }
-    // PDEBUG("end\n");
+    PDEBUG("add_entry with size: %zu at in_offs: %u and out_offs: %u\n", add_entry->size, buffer->in_offs, buffer->out_offs);
 
     // if buffer is already full, overwrite oldest entry with newest
     if (buffer->full) {
-        PDEBUG("Overwrite %s with %s\n", (char*)buffer->entry[buffer->out_offs].buffptr, (char*)add_entry->buffptr);
+        // Need to return the overwritten buffer pointer because it was previously alloc'd and needs
+        // to now be freed in the caller.
+        lost_entry_buffptr = aesd_circular_buffer_evict_oldest(buffer, lost_size);
+    }
+
+    // Add the input value to the buffer and record where it starts
+    buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->start[buffer->in_offs] = buffer->end;
+    buffer->end += add_entry->size;
+
+    // Advance input offset
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
 
-        // Save buffptr to entry about to be overwritten before it is overwritten
-        lost_entry_buffptr = buffer->entry[buffer->out_offs].buffptr;
-        *lost_size = buffer->entry[buffer->out_offs].size; // added for asy9
+    // if buffer just got full. When capacity fills every slot this is in_offs == out_offs.
+    if (!buffer->full && ((buffer->in_offs - buffer->out_offs) & buffer->mask) == (buffer->capacity & buffer->mask)) {
+        buffer->full = true;
+        PDEBUG("Buffer now filled: %i\n", buffer->full);
+    }
 
-        // Advance output offset. Previous data is lost.
-        buffer->out_offs++;
-        buffer->out_offs %= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    return lost_entry_buffptr;
+}
 
-        // Add the input value to the buffer
-        memcpy(&buffer->entry[buffer->in_offs], add_entry, sizeof(*add_entry));
-        // memcpy(&buffer->entry[buffer->in_offs], add_entry, add_entry->size);
+/**
+* @return the number of entries currently held in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+    return (buffer->in_offs - buffer->out_offs) & buffer->mask;
+}
 
-        // Advance input offset
-        buffer->in_offs++;
-        buffer->in_offs %= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+/**
+* @return the number of bytes currently held in @param buffer, the size of the concatenated history
+*/
+size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->end - buffer->base;
+}
 
-        // TODO: Return either null or the pointer to the entry in the buffer that was overwritten
-        // Need to return the overwritten buffer pointer because it was previously alloc'd and needs
-        // to now be freed in the caller.
-        return lost_entry_buffptr;
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries.
+* @return 0 on success or -ENOMEM
+*/
+int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    return aesd_circular_buffer_init_capacity(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to
+* @param capacity entries (0 selects AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED).
+* Entry storage is rounded up to a power of two and must be released with aesd_circular_buffer_free().
+* @return 0 on success, -EINVAL for a capacity over AESDCHAR_MAX_CAPACITY or -ENOMEM
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    uint32_t slots = 1;
+
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    if (capacity == 0) {
+        capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    if (capacity > AESDCHAR_MAX_CAPACITY) {
+        return -EINVAL;
     }
-    else {
-        // Add the input value to the buffer
-        memcpy(&buffer->entry[buffer->in_offs], add_entry, sizeof(*add_entry));
-        // memcpy(&buffer->entry[buffer->in_offs], add_entry, add_entry->size);
-
-        // Advance input offset
-        buffer->in_offs++;
-        buffer->in_offs %= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-        // if buffer just got full
-        if (buffer->in_offs == buffer->out_offs) {
-                buffer->full = true;
-                PDEBUG("Buffer now filled: %i\n", buffer->full);
-        }
 
-        // No entry was lost, return null
-        PDEBUG("No entry was lost\n");
-        return NULL;
+#ifdef __KERNEL__
+    slots = roundup_pow_of_two(capacity);
+    buffer->entry = kvcalloc(slots, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    buffer->start = kvcalloc(slots, sizeof(size_t), GFP_KERNEL);
+#else
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+    buffer->entry = calloc(slots, sizeof(struct aesd_buffer_entry));
+    buffer->start = calloc(slots, sizeof(size_t));
+#endif
+    if (!buffer->entry || !buffer->start) {
+        aesd_circular_buffer_free(buffer);
+        return -ENOMEM;
     }
+
+    buffer->capacity = capacity;
+    buffer->mask = slots - 1;
+    return 0;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Releases the entry storage allocated by aesd_circular_buffer_init_capacity(). The buffptr memory of each
+* entry is owned by the caller and must be freed first.
 */
-void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer)
 {
-    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+#ifdef __KERNEL__
+    kvfree(buffer->entry);
+    kvfree(buffer->start);
+#else
+    free(buffer->entry);
+    free(buffer->start);
+#endif
+    buffer->entry = NULL;
+    buffer->start = NULL;
+}
+
+/**
+* @return the bytes aesd_circular_buffer_layout() needs for @param buffer
+*/
+size_t aesd_circular_buffer_layout_size(const struct aesd_circular_buffer *buffer)
+{
+    return sizeof(struct aesd_history_header) +
+           (aesd_circular_buffer_count(buffer) + 1) * sizeof(uint64_t) +
+           aesd_circular_buffer_size(buffer);
+}
+
+/**
+* Writes a contiguous view of @param buffer to @param layout, which must hold
+* aesd_circular_buffer_layout_size() bytes: a struct aesd_history_header with the entry offsets,
+* followed by every entry oldest first. Any necessary locking must be performed by caller.
+*/
+void aesd_circular_buffer_layout(const struct aesd_circular_buffer *buffer, void *layout)
+{
+    struct aesd_history_header *header = layout;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    char *data;
+    uint32_t i;
+
+    header->magic = AESD_HISTORY_MAGIC;
+    header->entry_count = count;
+    header->generation = buffer->generation;
+    header->layout_size = aesd_circular_buffer_layout_size(buffer);
+    header->data_offset = sizeof(struct aesd_history_header) + (count + 1) * sizeof(uint64_t);
+    header->data_size = aesd_circular_buffer_size(buffer);
+
+    data = (char *)layout + header->data_offset;
+    for (i = 0; i < count; i++) {
+        uint32_t slot = (buffer->out_offs + i) & buffer->mask;
+        header->entry_offset[i] = buffer->start[slot] - buffer->base;
+        memcpy(data + header->entry_offset[i], buffer->entry[slot].buffptr, buffer->entry[slot].size);
+    }
+    header->entry_offset[count] = header->data_size;
 }
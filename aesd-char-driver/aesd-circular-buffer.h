@@ -16,7 +16,15 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of write commands kept in the history. The driver's max_entries module
+ * parameter and the capacity argument of aesd_circular_buffer_init_capacity() override it.
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Largest supported capacity. Entry storage is rounded up to a power of two.
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 24)
 
 struct aesd_buffer_entry
 {
@@ -33,39 +41,151 @@ struct aesd_buffer_entry
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Holds mask + 1 slots, a power of two, so offsets wrap with "& mask" rather than "%".
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of write operations kept before the oldest is overwritten, at most mask + 1
+     */
+    uint32_t capacity;
+    /**
+     * Number of slots in entry minus one
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t mask;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
+    /**
+     * Cumulative offset index, one per slot: the running count of bytes ever added when
+     * entry[i] was added. start[i] - base is where entry[i] begins in the concatenated history,
+     * so fpos lookups binary search instead of summing sizes. Unsigned differences keep this
+     * correct when the running count wraps.
+     */
+    size_t *start;
+    /**
+     * Running byte count at the start of the entry at out_offs
+     */
+    size_t base;
+    /**
+     * Running byte count at the end of the newest entry
+     */
+    size_t end;
     /**
-     * set to true when the buffer entry structure is full
+     * Most bytes held at once, enforced by aesd_circular_buffer_make_room(). 0 for no limit,
+     * which leaves capacity as the only bound. Set by the caller after init.
+     */
+    size_t byte_budget;
+    /**
+     * Incremented whenever out_offs advances, which changes what every fpos and logical
+     * index refers to. Read cursors from an older generation are ignored.
+     */
+    unsigned long generation;
+    /**
+     * set to true when the buffer holds capacity entries
      */
     bool full;
 };
 
+/**
+ * Where a reader's last lookup landed, so the next sequential lookup resumes in O(1).
+ * Zero-initialized is a valid (empty) cursor.
+ */
+struct aesd_read_cursor
+{
+    /**
+     * Logical index of the entry, counted from out_offs
+     */
+    uint32_t index;
+    /**
+     * Byte offset into that entry
+     */
+    size_t offset;
+    /**
+     * buffer->generation when the cursor was set
+     */
+    unsigned long generation;
+    bool valid;
+};
+
+/**
+ * Layout of the contiguous history view aesd_circular_buffer_layout() writes, and what
+ * mmap() of the aesdchar device maps: this header, then entry_count + 1 offsets, then the
+ * entries concatenated oldest first. All fields are fixed width so the layout is the same
+ * for 32 and 64 bit readers.
+ */
+#define AESD_HISTORY_MAGIC 0x44534541 // "AESD" in little endian
+struct aesd_history_header
+{
+    uint32_t magic;
+    uint32_t entry_count;
+    /**
+     * The buffer generation the view was taken at. Views with the same generation and
+     * entry_count hold the same history.
+     */
+    uint64_t generation;
+    /**
+     * Bytes of header, offsets and data. A reader that mapped less remaps at least this much.
+     */
+    uint64_t layout_size;
+    /**
+     * From the start of the header to the first byte of the history
+     */
+    uint64_t data_offset;
+    uint64_t data_size;
+    /**
+     * Where each entry starts in the data. entry_offset[entry_count] is data_size, so entry i
+     * is entry_offset[i + 1] - entry_offset[i] bytes long.
+     */
+    uint64_t entry_offset[];
+};
+
+/**
+ * @return the history of a view laid out by aesd_circular_buffer_layout()
+ */
+#define AESD_HISTORY_DATA(header) ((const char *)(header) + (header)->data_offset)
+
+extern size_t aesd_circular_buffer_layout_size(const struct aesd_circular_buffer *buffer);
+
+extern void aesd_circular_buffer_layout(const struct aesd_circular_buffer *buffer, void *layout);
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_cursor(struct aesd_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn, struct aesd_read_cursor *cursor);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry_offset(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t entry_offset, size_t *fpos_rtn);
+
 extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry, size_t *lost_size);
 
-extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+extern const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size, size_t *lost_size);
+
+extern int aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
+
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity);
+
+extern void aesd_circular_buffer_free(struct aesd_circular_buffer *buffer);
+
+extern uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer);
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +194,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,163 @@
+/**
+ * @file aesd-pool.c
+ * @brief Size-classed allocator for write command storage
+ *
+ * A block's class is derived from its size, so callers free with the size they stored rather
+ * than a header in front of every block. Any size between the requested size and the
+ * capacity returned maps to the same class.
+ *
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/slab.h> // for kmem_cache_create()
+#include <linux/mm.h> // for kvmalloc()
+#include <linux/errno.h>
+#else
+#include <string.h>
+#include <stdlib.h> // for malloc()
+#include <errno.h>
+#endif
+
+#include "aesd-pool.h"
+
+/**
+ * @return the class index for a block of @param size bytes, or AESD_POOL_CLASSES when it is
+ * too large to pool
+ */
+static unsigned int aesd_pool_class(size_t size)
+{
+    unsigned int shift = AESD_POOL_MIN_SHIFT;
+
+    while (shift <= AESD_POOL_MAX_SHIFT && ((size_t)1 << shift) < size) {
+        shift++;
+    }
+    return shift - AESD_POOL_MIN_SHIFT;
+}
+
+/**
+ * Creates the backing caches, one per class, with empty free lists.
+ * @return 0 on success or -ENOMEM
+ */
+int aesd_pool_init(struct aesd_pool *pool)
+{
+    memset(pool, 0, sizeof(struct aesd_pool));
+#ifdef __KERNEL__
+    {
+        // kmem_cache_create() keeps a pointer to the name, so it has to outlive the cache
+        static const char *names[AESD_POOL_CLASSES] = {
+            "aesdchar-64", "aesdchar-128", "aesdchar-256", "aesdchar-512", "aesdchar-1k", "aesdchar-2k",
+            "aesdchar-4k", "aesdchar-8k", "aesdchar-16k", "aesdchar-32k", "aesdchar-64k",
+        };
+        unsigned int class;
+
+        for (class = 0; class < AESD_POOL_CLASSES; class++) {
+            pool->cache[class] = kmem_cache_create(names[class], 1U << (class + AESD_POOL_MIN_SHIFT), 0, 0, NULL);
+            if (!pool->cache[class]) {
+                aesd_pool_destroy(pool);
+                return -ENOMEM;
+            }
+        }
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Releases every free block and the backing caches. Blocks still handed out must be freed first.
+ */
+void aesd_pool_destroy(struct aesd_pool *pool)
+{
+    unsigned int class;
+
+    for (class = 0; class < AESD_POOL_CLASSES; class++) {
+        while (pool->free_list[class]) {
+            void *block = pool->free_list[class];
+            pool->free_list[class] = *(void **)block;
+#ifdef __KERNEL__
+            kmem_cache_free(pool->cache[class], block);
+#else
+            free(block);
+#endif
+        }
+        pool->free_count[class] = 0;
+#ifdef __KERNEL__
+        kmem_cache_destroy(pool->cache[class]);
+        pool->cache[class] = NULL;
+#endif
+    }
+}
+
+/**
+ * @return a block of at least @param size bytes, with its usable size in @param capacity,
+ * or NULL if it could not be allocated
+ */
+void *aesd_pool_alloc(struct aesd_pool *pool, size_t size, size_t *capacity)
+{
+    unsigned int class = aesd_pool_class(size);
+    void *block;
+
+    pool->stats.allocs++;
+    if (class >= AESD_POOL_CLASSES) {
+        pool->stats.backing_allocs++;
+        *capacity = size;
+#ifdef __KERNEL__
+        return kvmalloc(size, GFP_KERNEL);
+#else
+        return malloc(size);
+#endif
+    }
+
+    *capacity = (size_t)1 << (class + AESD_POOL_MIN_SHIFT);
+    block = pool->free_list[class];
+    if (block) {
+        pool->free_list[class] = *(void **)block;
+        pool->free_count[class]--;
+        return block;
+    }
+
+    pool->stats.backing_allocs++;
+#ifdef __KERNEL__
+    return kmem_cache_alloc(pool->cache[class], GFP_KERNEL);
+#else
+    return malloc(*capacity);
+#endif
+}
+
+/**
+ * Returns @param ptr, holding @param size bytes, to its class free list.
+ * NULL is ignored, like kfree().
+ */
+void aesd_pool_free(struct aesd_pool *pool, const void *ptr, size_t size)
+{
+    unsigned int class = aesd_pool_class(size);
+    void *block = (void *)ptr;
+
+    if (!block) {
+        return;
+    }
+    pool->stats.frees++;
+    if (class >= AESD_POOL_CLASSES) {
+        pool->stats.backing_frees++;
+#ifdef __KERNEL__
+        kvfree(block);
+#else
+        free(block);
+#endif
+        return;
+    }
+
+    if (pool->free_count[class] >= AESD_POOL_MAX_CACHED) {
+        pool->stats.backing_frees++;
+#ifdef __KERNEL__
+        kmem_cache_free(pool->cache[class], block);
+#else
+        free(block);
+#endif
+        return;
+    }
+
+    *(void **)block = pool->free_list[class];
+    pool->free_list[class] = block;
+    pool->free_count[class]++;
+}
@@ -0,0 +1,75 @@
+/*
+ * aesd-pool.h
+ *
+ * Size-classed allocator for write command storage.
+ *
+ * Blocks come in power of two classes from 64 bytes to 64KiB. Freed blocks are kept on a
+ * per-class free list and handed out again before anything new is allocated, so once the
+ * history is full every write reuses the block of the entry it evicts. Behind the free lists
+ * each class is a kmem_cache in the kernel and plain malloc() in the userspace build.
+ * Requests over the largest class go straight to kvmalloc()/malloc().
+ *
+ * The pool does no locking of its own. Any necessary locking must be performed by caller.
+ */
+
+#ifndef AESD_POOL_H
+#define AESD_POOL_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+struct kmem_cache;
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#endif
+
+// Smallest class is 1 << AESD_POOL_MIN_SHIFT bytes, largest 1 << AESD_POOL_MAX_SHIFT
+#define AESD_POOL_MIN_SHIFT 6
+#define AESD_POOL_MAX_SHIFT 16
+#define AESD_POOL_CLASSES (AESD_POOL_MAX_SHIFT - AESD_POOL_MIN_SHIFT + 1)
+// Free blocks kept per class before they go back to the backing allocator
+#define AESD_POOL_MAX_CACHED 64
+
+struct aesd_pool_stats
+{
+    /**
+     * aesd_pool_alloc() calls
+     */
+    unsigned long allocs;
+    /**
+     * Allocations the free lists could not satisfy, which went to the backing allocator.
+     * Stays flat in the steady state.
+     */
+    unsigned long backing_allocs;
+    /**
+     * aesd_pool_free() calls
+     */
+    unsigned long frees;
+    /**
+     * Blocks returned to the backing allocator because their free list was full, or too large to pool
+     */
+    unsigned long backing_frees;
+};
+
+struct aesd_pool
+{
+#ifdef __KERNEL__
+    struct kmem_cache *cache[AESD_POOL_CLASSES];
+#endif
+    /**
+     * Singly linked through the first bytes of each free block
+     */
+    void *free_list[AESD_POOL_CLASSES];
+    uint32_t free_count[AESD_POOL_CLASSES];
+    struct aesd_pool_stats stats;
+};
+
+extern int aesd_pool_init(struct aesd_pool *pool);
+
+extern void aesd_pool_destroy(struct aesd_pool *pool);
+
+extern void *aesd_pool_alloc(struct aesd_pool *pool, size_t size, size_t *capacity);
+
+extern void aesd_pool_free(struct aesd_pool *pool, const void *ptr, size_t size);
+
+#endif /* AESD_POOL_H */
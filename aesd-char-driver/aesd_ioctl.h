@@ -33,14 +33,111 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One piece of history for AESDCHAR_IOCREADCMDS
+ */
+struct aesd_read_desc {
+    /**
+     * The zero referenced write command to read from, oldest first as for AESDCHAR_IOCSEEKTO
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Bytes wanted. Set to the bytes copied, which stop at the end of the write command
+     * and when the buffer is full.
+     */
+    uint32_t length;
+};
+
+/**
+ * Argument of AESDCHAR_IOCREADCMDS. Pointers are carried as 64 bit values so 32 bit
+ * processes pass the same layout.
+ */
+struct aesd_read_cmds {
+    /**
+     * User pointer to count struct aesd_read_desc
+     */
+    uint64_t descs;
+    /**
+     * User pointer to the buffer the pieces are copied into, back to back in descriptor order
+     */
+    uint64_t buffer;
+    uint64_t buffer_size;
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Set to the history generation the pieces were read at, see struct aesd_history_info
+     */
+    uint64_t generation;
+};
+
+/**
+ * Argument of AESDCHAR_IOCQUERY
+ */
+struct aesd_history_info {
+    /**
+     * User pointer to sizes_count uint64_t, filled with the size of each write command oldest
+     * first, as many as fit. May be 0 with sizes_count 0 to only query the totals.
+     */
+    uint64_t sizes;
+    uint32_t sizes_count;
+    /**
+     * Set to the number of write commands in the history
+     */
+    uint32_t entry_count;
+    /**
+     * Set to the bytes in the history, what a read from offset 0 returns
+     */
+    uint64_t total_size;
+    /**
+     * Set to a count that changes whenever the oldest write command is dropped, which
+     * renumbers every write_cmd. Equal generations and entry counts mean the same history.
+     */
+    uint64_t generation;
+    /**
+     * Set to the running count of bytes ever written at the oldest byte of the history and
+     * past the newest one, so end - base is total_size. A byte keeps its running count while
+     * older ones are evicted: one held from an earlier query is still in the history if it is
+     * at least base, at offset count - base. They wrap with the driver's size_t.
+     */
+    uint64_t base;
+    uint64_t end;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Tail mode for this open file, on when the argument is nonzero. A tailing reader that reaches
+ * the end of the history blocks until the next command is written (or fails with EAGAIN when
+ * opened O_NONBLOCK) instead of reading end of file, and poll() reports it readable once there
+ * is a command it hasn't read. It starts from its current file position and keeps its place as
+ * old commands are evicted.
+ */
+#define AESDCHAR_IOCTAIL _IO(AESD_IOC_MAGIC, 2)
+/**
+ * Copies several pieces of history into one buffer in a single call, all from the same
+ * history. Fails with EINVAL, copying nothing, when a descriptor names a write command or
+ * offset that doesn't exist. Returns the total bytes copied.
+ */
+#define AESDCHAR_IOCREADCMDS _IOWR(AESD_IOC_MAGIC, 3, struct aesd_read_cmds)
+/**
+ * Reports the number of write commands, their sizes, the total size of the history and its
+ * running byte counts
+ */
+#define AESDCHAR_IOCQUERY _IOWR(AESD_IOC_MAGIC, 4, struct aesd_history_info)
+/**
+ * Most descriptors one AESDCHAR_IOCREADCMDS takes
+ */
+#define AESDCHAR_READ_CMDS_MAX 65536
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
 
 #endif /* AESD_IOCTL_H */
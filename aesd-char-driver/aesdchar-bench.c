@@ -0,0 +1,724 @@
+/**
+ * @file aesdchar-bench.c
+ * @brief Benchmarks against a loaded aesdchar device
+ *
+ * Unlike aesd-circular-buffer-bench, which models the driver in userspace, this goes through
+ * real system calls, so it measures the driver as loaded (see aesdchar_load). Any path can be
+ * given instead of /dev/aesdchar to compare against, e.g., a tmpfs file.
+ *
+ * Usage: aesdchar-bench writev [device] [commands]
+ *        aesdchar-bench mmap [device] [iterations]
+ *        aesdchar-bench tail [device] [samples]
+ *        aesdchar-bench producers [device] [max_writers] [commands]
+ *        aesdchar-bench readcmds [device] [iterations]
+ *
+ */
+
+#define _GNU_SOURCE // for sched_yield() alongside pthreads, and memrchr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "aesd-circular-buffer.h" // for struct aesd_history_header
+#include "aesd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Writes @param commands short commands to @param fd, @param batch per system call: write() for
+ * a batch of one, writev() with one iovec per command otherwise.
+ * @return commands per second, or a negative value if a call failed or wrote short
+ */
+static double write_commands(int fd, unsigned long commands, int batch)
+{
+    struct iovec iov[1024];
+    char text[1024][32];
+    double start;
+    unsigned long sent = 0;
+
+    for (int i = 0; i < batch; i++) {
+        iov[i].iov_base = text[i];
+        iov[i].iov_len = snprintf(text[i], sizeof(text[i]), "batch %d command %d\n", batch, i);
+    }
+
+    start = now_sec();
+    while (sent < commands) {
+        ssize_t expected = 0;
+        ssize_t rc;
+        int n = (commands - sent < (unsigned long)batch) ? (int)(commands - sent) : batch;
+
+        for (int i = 0; i < n; i++) {
+            expected += iov[i].iov_len;
+        }
+        rc = (n == 1) ? write(fd, iov[0].iov_base, iov[0].iov_len) : writev(fd, iov, n);
+        if (rc != expected) {
+            perror("write");
+            return -1;
+        }
+        sent += n;
+    }
+    return commands / (now_sec() - start);
+}
+
+/**
+ * Compares commands/sec for one write() per command against writev() batches of 2..1024.
+ */
+static int bench_writev(int argc, char *argv[])
+{
+    const char *device = (argc > 0) ? argv[0] : DEFAULT_DEVICE;
+    unsigned long commands = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+    static const int batches[] = { 1, 4, 16, 64, 256, 1024 };
+    double baseline = 0;
+    int fd = open(device, O_WRONLY | O_APPEND);
+
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+    printf("writev: %lu commands to %s\n", commands, device);
+    printf("%8s %16s %10s\n", "batch", "commands/s", "vs write");
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+        double rate = write_commands(fd, commands, batches[i]);
+        if (rate < 0) {
+            close(fd);
+            return 1;
+        }
+        if (batches[i] == 1) {
+            baseline = rate;
+        }
+        printf("%8d %16.0f %9.1fx\n", batches[i], rate, rate / baseline);
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * Maps the history of @param fd, remapping until the mapping covers the whole layout.
+ * @return the header, with the mapping length in @param map_size, or NULL on failure
+ */
+static struct aesd_history_header *map_history(int fd, size_t *map_size)
+{
+    struct aesd_history_header *header;
+    size_t size = sysconf(_SC_PAGESIZE);
+    size_t layout_size;
+
+    while (1) {
+        header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        if (header->magic != AESD_HISTORY_MAGIC) {
+            fprintf(stderr, "bad history magic 0x%x\n", header->magic);
+            munmap(header, size);
+            return NULL;
+        }
+        if (header->layout_size <= size) {
+            *map_size = size;
+            return header;
+        }
+        // Each mmap() is a new snapshot, which may have grown again since
+        layout_size = header->layout_size;
+        munmap(header, size);
+        size = layout_size;
+    }
+}
+
+/**
+ * Checks the mapped history of @param argv[0] against read(), then compares reading the whole
+ * history with 4096 byte read() calls to mapping it and scanning the view, @param argv[1] times each.
+ */
+static int bench_mmap(int argc, char *argv[])
+{
+    const char *device = (argc > 0) ? argv[0] : DEFAULT_DEVICE;
+    int iterations = (argc > 1) ? atoi(argv[1]) : 1000;
+    struct aesd_history_header *header;
+    size_t map_size;
+    size_t total = 0;
+    size_t cap = 4096;
+    char *history = malloc(cap);
+    unsigned long commands = 0;
+    double start;
+    double read_elapsed;
+    double map_elapsed;
+    ssize_t n;
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+    while ((n = read(fd, history + total, cap - total)) > 0) {
+        total += n;
+        if (total == cap) {
+            history = realloc(history, cap *= 2);
+        }
+    }
+    header = map_history(fd, &map_size);
+    if (!header) {
+        return 1;
+    }
+    if (header->data_size != total || memcmp(AESD_HISTORY_DATA(header), history, total) != 0) {
+        fprintf(stderr, "mapped history (%llu bytes) does not match read() (%zu bytes)\n",
+                (unsigned long long)header->data_size, total);
+        return 1;
+    }
+    printf("mmap: %u entries, %zu bytes, generation %llu\n", header->entry_count, total,
+           (unsigned long long)header->generation);
+    munmap(header, map_size);
+
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, history, 4096)) > 0) {
+            for (const char *p = history; (p = memchr(p, '\n', history + n - p)) != NULL; p++) {
+                commands++;
+            }
+        }
+    }
+    read_elapsed = now_sec() - start;
+
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        const char *data;
+        header = map_history(fd, &map_size);
+        if (!header) {
+            return 1;
+        }
+        data = AESD_HISTORY_DATA(header);
+        for (const char *p = data; (p = memchr(p, '\n', data + header->data_size - p)) != NULL; p++) {
+            commands++;
+        }
+        munmap(header, map_size);
+    }
+    map_elapsed = now_sec() - start;
+
+    printf("%-22s %10.1f us/history\n", "read() 4096 per call", read_elapsed * 1e6 / iterations);
+    printf("%-22s %10.1f us/history\n", "mmap() and scan", map_elapsed * 1e6 / iterations);
+    printf("%lu commands counted\n", commands);
+    free(history);
+    close(fd);
+    return 0;
+}
+
+enum tail_mode { TAIL_SPIN, TAIL_BLOCKING, TAIL_EPOLL };
+
+struct tail_state {
+    const char *device;
+    enum tail_mode mode;
+    int samples;
+    double *latency;
+    volatile int received;
+    volatile int ready;
+    int failed;
+};
+
+/**
+ * Follows the device in tail mode and records, for every command, the time from the write
+ * stamped in it to the read returning it.
+ */
+static void *tail_reader(void *arg)
+{
+    struct tail_state *state = arg;
+    int flags = (state->mode == TAIL_BLOCKING) ? O_RDONLY : O_RDONLY | O_NONBLOCK;
+    int fd = open(state->device, flags);
+    int epfd = -1;
+    char buf[4096];
+    size_t len = 0;
+
+    if (fd < 0 || lseek(fd, 0, SEEK_END) < 0 || ioctl(fd, AESDCHAR_IOCTAIL, 1) != 0) {
+        perror("tail setup");
+        state->failed = 1;
+        state->ready = 1;
+        return NULL;
+    }
+    if (state->mode == TAIL_EPOLL) {
+        struct epoll_event event = { .events = EPOLLIN };
+        epfd = epoll_create1(0);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+    }
+    state->ready = 1;
+
+    while (state->received < state->samples) {
+        ssize_t n;
+        char *newline;
+
+        if (state->mode == TAIL_EPOLL) {
+            struct epoll_event event;
+            if (epoll_wait(epfd, &event, 1, 1000) <= 0) {
+                continue;
+            }
+        }
+        n = read(fd, buf + len, sizeof(buf) - len - 1);
+        if (n < 0 && errno == EAGAIN) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("tail read");
+            state->failed = 1;
+            break;
+        }
+        len += n;
+        while ((newline = memchr(buf, '\n', len)) != NULL) {
+            double stamp = strtod(buf, NULL);
+            state->latency[state->received++] = now_sec() - stamp;
+            len -= newline + 1 - buf;
+            memmove(buf, newline + 1, len);
+        }
+    }
+    if (epfd >= 0) {
+        close(epfd);
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Measures write to wakeup latency for a tailing reader that spins on O_NONBLOCK reads, one that
+ * blocks in read(), and one that waits in epoll_wait(). The writer waits for each command to
+ * arrive, then pauses so the reader is idle again, before writing the next.
+ */
+static int bench_tail(int argc, char *argv[])
+{
+    const char *device = (argc > 0) ? argv[0] : DEFAULT_DEVICE;
+    int samples = (argc > 1) ? atoi(argv[1]) : 2000;
+    static const char *names[] = { "spin O_NONBLOCK", "blocking read", "epoll" };
+    struct timespec idle = { 0, 200000 };
+    int fd = open(device, O_WRONLY);
+
+    if (fd < 0 || samples < 1) {
+        perror(device);
+        return 1;
+    }
+    printf("tail: %d commands per mode, write to read latency\n", samples);
+    printf("%-16s %10s %10s %10s\n", "reader", "p50 us", "p99 us", "max us");
+    for (int mode = TAIL_SPIN; mode <= TAIL_EPOLL; mode++) {
+        struct tail_state state = { .device = device, .mode = mode, .samples = samples };
+        pthread_t reader;
+
+        state.latency = calloc(samples, sizeof(double));
+        pthread_create(&reader, NULL, tail_reader, &state);
+        while (!state.ready) {
+            nanosleep(&idle, NULL);
+        }
+        nanosleep(&idle, NULL);
+        for (int i = 0; i < samples && !state.failed; i++) {
+            char command[64];
+            int len = snprintf(command, sizeof(command), "%.9f\n", now_sec());
+            if (write(fd, command, len) != len) {
+                perror("write");
+                state.failed = 1;
+                break;
+            }
+            while (state.received <= i && !state.failed) {
+                // the reader is measuring, stay out of its way
+                sched_yield();
+            }
+            nanosleep(&idle, NULL);
+        }
+        pthread_join(reader, NULL);
+        if (state.failed) {
+            free(state.latency);
+            close(fd);
+            return 1;
+        }
+        qsort(state.latency, samples, sizeof(double), compare_double);
+        printf("%-16s %10.1f %10.1f %10.1f\n", names[mode], state.latency[samples / 2] * 1e6,
+               state.latency[samples * 99 / 100] * 1e6, state.latency[samples - 1] * 1e6);
+        free(state.latency);
+    }
+    close(fd);
+    return 0;
+}
+
+// Body bytes per producer command
+#define PRODUCER_BODY 48
+// The tail checker's read buffer, far more than a history of producer commands holds
+#define CHECKER_BUFFER (1024 * 1024)
+
+struct producer {
+    const char *device;
+    int id;
+    unsigned long commands;
+    int failed;
+};
+
+/**
+ * Writes @param producer->commands commands "<id>:" followed by PRODUCER_BODY copies of its own
+ * letter and a newline through its own descriptor, each cut into write() calls at random points,
+ * so partial commands of every length meet the other producers' in the driver.
+ */
+static void *producer_thread(void *arg)
+{
+    struct producer *producer = arg;
+    char command[16 + PRODUCER_BODY + 1];
+    unsigned int seed = producer->id + 1;
+    size_t len = snprintf(command, sizeof(command), "%d:", producer->id);
+    int fd = open(producer->device, O_WRONLY);
+
+    if (fd < 0) {
+        perror(producer->device);
+        producer->failed = 1;
+        return NULL;
+    }
+    memset(command + len, 'a' + producer->id % 26, PRODUCER_BODY);
+    len += PRODUCER_BODY;
+    command[len++] = '\n';
+    for (unsigned long i = 0; i < producer->commands && !producer->failed; i++) {
+        size_t written = 0;
+        while (written < len) {
+            ssize_t piece = 1 + rand_r(&seed) % (len - written);
+            if (write(fd, command + written, piece) != piece) {
+                perror("write");
+                producer->failed = 1;
+                break;
+            }
+            written += piece;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Checks the whole lines in the @param len bytes at @param data, counting them in @param commands.
+ * @return the number of lines that aren't one whole producer command
+ */
+static long check_commands(const char *data, size_t len, unsigned long *commands)
+{
+    long interleaved = 0;
+
+    for (const char *line = data; line < data + len; ) {
+        const char *newline = memchr(line, '\n', data + len - line);
+        char *end;
+        long id = strtol(line, &end, 10);
+        size_t line_len;
+        size_t i;
+
+        if (!newline) {
+            break;
+        }
+        line_len = newline - line;
+        if (end == line || *end != ':' || id < 0 || line_len != (size_t)(end + 1 - line) + PRODUCER_BODY) {
+            interleaved++;
+        }
+        else {
+            for (i = end + 1 - line; i < line_len && line[i] == 'a' + id % 26; i++) {
+            }
+            interleaved += i != line_len;
+        }
+        (*commands)++;
+        line = newline + 1;
+    }
+    return interleaved;
+}
+
+/**
+ * @return the number of lines in the history of @param device that aren't one whole producer
+ * command, or -1 if it can't be read
+ */
+static long count_interleaved(const char *device)
+{
+    char *history = NULL;
+    size_t total = 0;
+    size_t cap = 0;
+    ssize_t n;
+    unsigned long commands = 0;
+    long interleaved;
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+    do {
+        if (total + 4096 > cap) {
+            cap = 2 * (total + 4096);
+            history = realloc(history, cap);
+        }
+        n = read(fd, history + total, 4096);
+        total += n > 0 ? n : 0;
+    } while (n > 0);
+    close(fd);
+
+    interleaved = check_commands(history, total, &commands);
+    free(history);
+    return interleaved;
+}
+
+struct tail_checker {
+    const char *device;
+    volatile int stop;
+    volatile int ready;
+    unsigned long commands;
+    long interleaved;
+    int failed;
+};
+
+/**
+ * Follows the device in tail mode while the producers run and checks every command it reads,
+ * so commands the history evicts before the producers finish are checked as well. Runs until
+ * @param checker->stop is set and the device has nothing more to read.
+ */
+static void *tail_checker_thread(void *arg)
+{
+    struct tail_checker *checker = arg;
+    struct timespec idle = { 0, 100000 };
+    char *buf = malloc(CHECKER_BUFFER);
+    size_t len = 0;
+    int fd = open(checker->device, O_RDONLY | O_NONBLOCK);
+
+    if (buf == NULL || fd < 0 || lseek(fd, 0, SEEK_END) < 0 || ioctl(fd, AESDCHAR_IOCTAIL, 1) != 0) {
+        perror("tail checker setup");
+        checker->failed = 1;
+        checker->ready = 1;
+        free(buf);
+        return NULL;
+    }
+    checker->ready = 1;
+
+    while (1) {
+        ssize_t n = read(fd, buf + len, CHECKER_BUFFER - len);
+        const char *last;
+
+        if (n < 0 && errno == EAGAIN) {
+            // The producers are joined before stop is set, so nothing is left to read
+            if (checker->stop) {
+                break;
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        if (n <= 0) {
+            perror("tail checker read");
+            checker->failed = 1;
+            break;
+        }
+        len += n;
+        last = memrchr(buf, '\n', len);
+        if (last) {
+            checker->interleaved += check_commands(buf, last + 1 - buf, &checker->commands);
+            len -= last + 1 - buf;
+            memmove(buf, last + 1, len);
+        }
+        else if (len == CHECKER_BUFFER) {
+            // No producer command is this long
+            checker->interleaved++;
+            len = 0;
+        }
+    }
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Runs 1, 2, 4 ... @param argv[1] producers, each writing @param argv[2] commands cut into
+ * partial writes at random points through its own descriptor, and reports commits per second.
+ * A tailing reader checks every command as it is committed, and the history left afterwards is
+ * checked again. Fails if any command read back is not one producer's whole command.
+ */
+static int bench_producers(int argc, char *argv[])
+{
+    const char *device = (argc > 0) ? argv[0] : DEFAULT_DEVICE;
+    int max_writers = (argc > 1) ? atoi(argv[1]) : 16;
+    unsigned long commands = (argc > 2) ? strtoul(argv[2], NULL, 10) : 20000;
+    struct timespec idle = { 0, 200000 };
+
+    if (max_writers < 1 || commands < 1) {
+        fprintf(stderr, "max_writers and commands must be at least 1\n");
+        return 1;
+    }
+    printf("producers: %lu commands per writer to %s, %ld online CPUs\n", commands, device,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %12s %12s\n", "writers", "commits/s", "checked", "interleaved");
+    for (int writers = 1; writers <= max_writers; writers *= 2) {
+        struct producer producers[writers];
+        pthread_t threads[writers];
+        struct tail_checker checker = { .device = device };
+        pthread_t checker_thread;
+        double start;
+        double elapsed;
+        long interleaved;
+        int failed = 0;
+
+        pthread_create(&checker_thread, NULL, tail_checker_thread, &checker);
+        while (!checker.ready) {
+            nanosleep(&idle, NULL);
+        }
+        start = now_sec();
+        for (int i = 0; i < writers; i++) {
+            producers[i] = (struct producer){ .device = device, .id = i, .commands = commands };
+            pthread_create(&threads[i], NULL, producer_thread, &producers[i]);
+        }
+        for (int i = 0; i < writers; i++) {
+            pthread_join(threads[i], NULL);
+            failed |= producers[i].failed;
+        }
+        elapsed = now_sec() - start;
+        checker.stop = 1;
+        pthread_join(checker_thread, NULL);
+        if (failed || checker.failed) {
+            return 1;
+        }
+
+        interleaved = count_interleaved(device);
+        if (interleaved < 0) {
+            return 1;
+        }
+        interleaved += checker.interleaved;
+        printf("%8d %16.0f %12lu %12ld\n", writers, writers * commands / elapsed, checker.commands, interleaved);
+        if (interleaved != 0) {
+            fprintf(stderr, "%ld commands interleaved\n", interleaved);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Fetches every write command in the history @param argv[1] times, first with an
+ * AESDCHAR_IOCSEEKTO and a read() per command, then with one AESDCHAR_IOCQUERY and one
+ * AESDCHAR_IOCREADCMDS, and checks both fetched the same bytes.
+ */
+static int bench_readcmds(int argc, char *argv[])
+{
+    const char *device = (argc > 0) ? argv[0] : DEFAULT_DEVICE;
+    int iterations = (argc > 1) ? atoi(argv[1]) : 10000;
+    struct aesd_history_info info = { 0 };
+    struct aesd_read_cmds request = { 0 };
+    struct aesd_read_desc *descs;
+    uint64_t *sizes;
+    char *seek_buffer;
+    char *batch_buffer;
+    double start;
+    double seek_elapsed;
+    double batch_elapsed;
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd, AESDCHAR_IOCQUERY, &info) != 0 || info.entry_count == 0) {
+        fprintf(stderr, "%s: no history to read\n", device);
+        close(fd);
+        return 1;
+    }
+    if (info.end - info.base != info.total_size) {
+        fprintf(stderr, "%s: running byte counts %llu..%llu don't span the %llu byte history\n", device,
+                (unsigned long long)info.base, (unsigned long long)info.end, (unsigned long long)info.total_size);
+        close(fd);
+        return 1;
+    }
+    sizes = calloc(info.entry_count, sizeof(*sizes));
+    descs = calloc(info.entry_count, sizeof(*descs));
+    seek_buffer = malloc(info.total_size);
+    batch_buffer = malloc(info.total_size);
+    printf("readcmds: %u commands, %llu bytes, %d iterations\n", info.entry_count,
+           (unsigned long long)info.total_size, iterations);
+
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        size_t used = 0;
+        info.sizes = (uintptr_t)sizes;
+        info.sizes_count = info.entry_count;
+        if (ioctl(fd, AESDCHAR_IOCQUERY, &info) != 0) {
+            perror("AESDCHAR_IOCQUERY");
+            return 1;
+        }
+        for (uint32_t cmd = 0; cmd < info.entry_count; cmd++) {
+            struct aesd_seekto seekto = { cmd, 0 };
+            if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0 ||
+                    read(fd, seek_buffer + used, sizes[cmd]) != (ssize_t)sizes[cmd]) {
+                perror("AESDCHAR_IOCSEEKTO and read");
+                return 1;
+            }
+            used += sizes[cmd];
+        }
+    }
+    seek_elapsed = now_sec() - start;
+
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        if (ioctl(fd, AESDCHAR_IOCQUERY, &info) != 0) {
+            perror("AESDCHAR_IOCQUERY");
+            return 1;
+        }
+        for (uint32_t cmd = 0; cmd < info.entry_count; cmd++) {
+            descs[cmd] = (struct aesd_read_desc){ cmd, 0, sizes[cmd] };
+        }
+        request = (struct aesd_read_cmds){ .descs = (uintptr_t)descs, .buffer = (uintptr_t)batch_buffer,
+                                           .buffer_size = info.total_size, .count = info.entry_count };
+        if (ioctl(fd, AESDCHAR_IOCREADCMDS, &request) != (int)info.total_size) {
+            perror("AESDCHAR_IOCREADCMDS");
+            return 1;
+        }
+    }
+    batch_elapsed = now_sec() - start;
+
+    if (memcmp(seek_buffer, batch_buffer, info.total_size) != 0) {
+        fprintf(stderr, "AESDCHAR_IOCREADCMDS returned different bytes, was the history written to?\n");
+        return 1;
+    }
+    printf("%-22s %10.2f us/history %8.1f syscalls\n", "seekto + read", seek_elapsed * 1e6 / iterations,
+           1 + 2.0 * info.entry_count);
+    printf("%-22s %10.2f us/history %8.1f syscalls\n", "query + readcmds", batch_elapsed * 1e6 / iterations, 2.0);
+    free(sizes);
+    free(descs);
+    free(seek_buffer);
+    free(batch_buffer);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "writev") == 0) {
+        return bench_writev(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "mmap") == 0) {
+        return bench_mmap(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "tail") == 0) {
+        return bench_tail(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "producers") == 0) {
+        return bench_producers(argc - 2, argv + 2);
+    }
+    if (argc >= 2 && strcmp(argv[1], "readcmds") == 0) {
+        return bench_readcmds(argc - 2, argv + 2);
+    }
+
+    fprintf(stderr, "Usage: %s writev [device] [commands]\n"
+                    "       %s mmap [device] [iterations]\n"
+                    "       %s tail [device] [samples]\n"
+                    "       %s producers [device] [max_writers] [commands]\n"
+                    "       %s readcmds [device] [iterations]\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -8,11 +8,20 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
+#ifdef __KERNEL__
 #include <linux/cdev.h> // cdev_init(), cdev_add(), cdev_del()
+#include <linux/rwsem.h> // struct rw_semaphore
+#include <linux/mutex.h> // struct mutex
+#include <linux/wait.h> // wait_queue_head_t
+#endif
 #include "aesd-circular-buffer.h"
+#include "aesd-pool.h"
 // #include <stdio.h> // for stderr. Will this cause issues to include this??
 
+// Userspace benchmarks build with -DAESD_NO_DEBUG so the per-call prints don't dominate the timings
+#ifndef AESD_NO_DEBUG
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
+#endif
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -27,16 +36,58 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+#ifdef __KERNEL__
+/**
+ * A command still waiting for its newline. Stages grow without dev->lock, so they are
+ * kvmalloc()ed rather than taken from dev->pool, and don't show in its statistics.
+ */
+struct aesd_stage
+{
+    char *buffer;
+    size_t size;
+    // Allocated size of buffer, which grows geometrically
+    size_t capacity;
+};
+
 struct aesd_dev
 {
     // TODO: Add structure(s) and locks needed to complete assignment requirements
     struct cdev cdev;     /* Char device structure      */
-    struct mutex lock;
+    // Shared by readers (read, llseek, seek ioctl), exclusive for writers
+    struct rw_semaphore lock;
     struct aesd_circular_buffer circ_buffer;
-    char *incomplete_write_buffer;
-    size_t incomplete_write_buffer_size;
+    // Partial commands of files closed before their newline, picked up by the next file
+    // opened for writing, so `echo -n` followed by `echo` still builds one command
+    struct aesd_stage orphan;
     size_t buff_size;
+    // Storage for the write commands in the history
+    struct aesd_pool pool;
+    // Woken whenever a write completes one or more commands
+    wait_queue_head_t readq;
+};
+
+/**
+ * Per open file state, hung off filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    // Serializes reads and AESDCHAR_IOCTAIL through this file, which move cursor and tail_pos
+    // under a shared dev->lock. Taken before dev->lock.
+    struct mutex read_lock;
+    // Where the last read stopped, so the next sequential read resumes without a search
+    struct aesd_read_cursor cursor;
+    // Set by AESDCHAR_IOCTAIL: reads wait for new commands at the end of the history
+    bool tail;
+    // The running byte count (circ_buffer.end) this tailing reader has read up to
+    size_t tail_pos;
+    // Serializes writes through this file, taken before dev->lock
+    struct mutex write_lock;
+    // This file's partial command. Writes append here without dev->lock, which is only
+    // taken once a newline completes a command.
+    struct aesd_stage stage;
 };
+#endif /* __KERNEL__ */
 
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
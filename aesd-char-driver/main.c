@@ -17,27 +17,121 @@
 #include <linux/types.h>
 #include <linux/fs.h> // file_operations. For MKDEV()
 #include <linux/slab.h> // for kfree()
+#include <linux/moduleparam.h> // for module_param()
+#include <linux/uio.h> // for copy_to_iter()
+#include <linux/mm.h> // for struct vm_area_struct
+#include <linux/vmalloc.h> // for vmalloc_user(), remap_vmalloc_range()
+#include <linux/version.h>
+#include <linux/poll.h> // for poll_wait()
+#include <linux/sched/signal.h> // for wait_event_interruptible()
 #include "aesdchar.h"
 #include "aesd_ioctl.h" // for asy9
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 15, 0)
+// No down_read_interruptible() before 5.15, where only fatal signals interrupt a waiting reader
+#define down_read_interruptible(sem) down_read_killable(sem)
+#endif
+
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
 MODULE_AUTHOR("Spencer Manning"); /** DONE: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
+// Number of write commands kept in the history, e.g. "./aesdchar_load max_entries=4096"
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(max_entries, "Number of write commands kept in the history (default 10)");
+
+// Bytes of write commands kept in the history, e.g. "./aesdchar_load max_bytes=1048576". The
+// oldest commands are evicted to stay under it, so large commands can't pin max_entries times
+// their size. The newest command is always kept, however large.
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Bytes of write commands kept in the history (default 0, no limit)");
+
 struct aesd_dev aesd_device;
 
+// Write command allocation counters, under /sys/module/aesdchar/parameters/. Once the history
+// is full pool_backing_allocs stops growing: every write reuses the block of the entry it evicts.
+module_param_named(pool_allocs, aesd_device.pool.stats.allocs, ulong, S_IRUGO);
+MODULE_PARM_DESC(pool_allocs, "Write command buffers allocated");
+module_param_named(pool_backing_allocs, aesd_device.pool.stats.backing_allocs, ulong, S_IRUGO);
+MODULE_PARM_DESC(pool_backing_allocs, "Write command buffers that had to come from the slab allocator");
+module_param_named(pool_frees, aesd_device.pool.stats.frees, ulong, S_IRUGO);
+MODULE_PARM_DESC(pool_frees, "Write command buffers freed");
+module_param_named(pool_backing_frees, aesd_device.pool.stats.backing_frees, ulong, S_IRUGO);
+MODULE_PARM_DESC(pool_backing_frees, "Write command buffers returned to the slab allocator");
+
+// A write stage left empty keeps its buffer for the next command unless it grew past this
+#define AESD_STAGE_KEEP PAGE_SIZE
+
+/**
+ * Makes room for @param needed bytes in @param stage, at least doubling its capacity.
+ * @return 0 on success or -ENOMEM, in which case the stage is untouched
+ */
+static int aesd_stage_reserve(struct aesd_stage *stage, size_t needed)
+{
+    size_t capacity = stage->capacity ? stage->capacity : 64;
+    char *buffer;
+
+    if (needed <= stage->capacity) {
+        return 0;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    buffer = kvmalloc(capacity, GFP_KERNEL);
+    if (!buffer) {
+        return -ENOMEM;
+    }
+    if (stage->buffer) {
+        memcpy(buffer, stage->buffer, stage->size);
+        kvfree(stage->buffer);
+    }
+    stage->buffer = buffer;
+    stage->capacity = capacity;
+    return 0;
+}
+
+static void aesd_stage_free(struct aesd_stage *stage)
+{
+    kvfree(stage->buffer);
+    stage->buffer = NULL;
+    stage->size = 0;
+    stage->capacity = 0;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
     struct aesd_dev *dev;
     PDEBUG("Opening aesdchar module");
 
     // DONE: handle open
+    // Each open file gets its own read cursor next to the device pointer
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
     // "Use inode->i_cdev with container_of to locate within aesd_dev"
     dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    // "Set filp->private_data with our aesd_dev device struct"
-    filp->private_data = dev;
+    file->dev = dev;
+    mutex_init(&file->read_lock);
+    mutex_init(&file->write_lock);
+    // Set filp->private_data with the per open file state, which points at our aesd_dev device struct
+    filp->private_data = file;
+
+    // Carry on the partial command a writer closed without finishing
+    if ((filp->f_mode & FMODE_WRITE) && READ_ONCE(dev->orphan.size)) {
+        if (down_write_killable(&dev->lock) != 0) {
+            kfree(file);
+            return -ERESTARTSYS;
+        }
+        file->stage = dev->orphan;
+        memset(&dev->orphan, 0, sizeof(dev->orphan));
+        up_write(&dev->lock);
+    }
 
     // Check for device errors or other hardware problems if necessary
 
@@ -46,82 +140,203 @@ int aesd_open(struct inode *inode, struct file *filp)
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
     PDEBUG("Releasing aesdchar module");
     // DONE: handle release
-    // Do nothing like scull does since filp->private_data was allocated in module_init().
-    // Will be freed in module_exit().
+    // The device itself was allocated in module_init() and is freed in module_exit(), only the
+    // per open file state goes here.
+
+    // An unfinished command outlives the file, for the next writer to complete
+    if (file->stage.size) {
+        down_write(&dev->lock);
+        if (dev->orphan.size == 0) {
+            aesd_stage_free(&dev->orphan);
+            dev->orphan = file->stage;
+            memset(&file->stage, 0, sizeof(file->stage));
+        }
+        else if (aesd_stage_reserve(&dev->orphan, dev->orphan.size + file->stage.size) == 0) {
+            memcpy(dev->orphan.buffer + dev->orphan.size, file->stage.buffer, file->stage.size);
+            dev->orphan.size += file->stage.size;
+        }
+        else {
+            PDEBUG("Dropping %zu bytes of an unfinished command", file->stage.size);
+        }
+        up_write(&dev->lock);
+    }
+    aesd_stage_free(&file->stage);
+    mutex_destroy(&file->read_lock);
+    mutex_destroy(&file->write_lock);
+    kfree(file);
     return 0;
 }
 
+/**
+ * @return true once a command the tailing reader of @param file hasn't read yet is in the history.
+ * Checked without dev->lock by wait_event_interruptible(), the read re-checks under it.
+ */
+static bool aesd_tail_ready(struct aesd_dev *dev, struct aesd_file *file)
+{
+    return READ_ONCE(dev->circ_buffer.end) != READ_ONCE(file->tail_pos);
+}
+
 /*
  b. Return the content (or partial content) related to the most recent 10 write commands,
  in the order they were received, on any read attempt.
     1. You should use the position specified in the read to determine the location and number of bytes to return.
     2. You should honor the count argument by sending only up to the first “count” bytes
     back of the available bytes remaining.
-        *** I do this indirectly because even though I only send 1 byte back per read, the calling fuction will
-        *** call aesd_read() multiple times to get the full count.
+        *** Copies as much of count as the circular buffer holds, one copy_to_user() per entry,
+        *** so a reader gets the whole history in a single call when its buffer is big enough.
 */
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
     ssize_t retval = 0;
     struct aesd_buffer_entry *entry;
-    struct aesd_dev *dev = filp->private_data;
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
     size_t offset_byte_rtn = 0;
+    size_t copied = 0;
+    size_t chunk;
+    size_t pos;
+    bool tail;
 
     PDEBUG("Reading up to 0x%zx bytes at offset %lld", count, *f_pos);
     // DONE: handle read
     /*
-    Private_data member from filp can be used to get aesd_dev
-    buff is the buffer to fill
-        Need to use copy_to_user to access this buffer directly
-    count is the max number of bytes to buf. May want/need less than this.
-        The number of bytes to read back into userspace using buff
-    f_pos is the pointer to the read offset
+    Private_data member from iocb->ki_filp can be used to get aesd_dev
+    to describes the buffer(s) to fill, one for read() or several for readv()
+        Need to use copy_to_iter to access them directly
+    iov_iter_count(to) is the max number of bytes to return. May want/need less than this.
+    iocb->ki_pos is the read offset
         References a location in your virtual device
         A specific byte of the circular buffer (char_offset)
         Start the read at this offset
-        Update the pointer to point to the next offset
+        Update it to point to the next offset
 
     Return:
     If retval == count, the requested number of bytes were transferred
-    If 0 < retval < count, only a portion has been returned (partial read). Encouraged.
-        "Read one command at a time from your driver.""
-    If 0, end of file
+    If 0 < retval < count, only a portion has been returned (partial read).
+    If 0, end of file. In tail mode (AESDCHAR_IOCTAIL) the read waits for the next command
+        instead, or fails with -EAGAIN when the file is O_NONBLOCK.
     If negative, error occurred
     */
 
-    // Need to make sure that filp and buf are defined
-    if ((!filp) || (!buf)) {
-        return -EINVAL;
+    if (count == 0) {
+        return 0;
     }
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        PDEBUG("Mutex not acquired");
-        // restart because mutex interrupted and we shouldn't continue
-        return -ERESTARTSYS;
-    }
+    for (;;) {
+        // Readers share the lock, so concurrent reads of the history run in parallel. Only writers
+        // exclude them. The cursor and tail position belong to the open file, so its read_lock
+        // serializes reads through one descriptor, such as concurrent pread() calls.
+        if (mutex_lock_interruptible(&file->read_lock)) {
+            return -ERESTARTSYS;
+        }
+        if (down_read_interruptible(&dev->lock)) {
+            PDEBUG("Lock not acquired");
+            mutex_unlock(&file->read_lock);
+            // restart because lock interrupted and we shouldn't continue
+            return -ERESTARTSYS;
+        }
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->circ_buffer, *f_pos, &offset_byte_rtn);
+        tail = file->tail;
+        if (tail) {
+            // A tailing reader follows the running byte count, so commands evicted before it got
+            // to them shift nothing. If they were evicted unread, skip to the oldest one left.
+            if (dev->circ_buffer.end - file->tail_pos > aesd_circular_buffer_size(&dev->circ_buffer)) {
+                file->tail_pos = dev->circ_buffer.base;
+            }
+            pos = file->tail_pos - dev->circ_buffer.base;
+        }
+        else {
+            pos = *f_pos;
+        }
 
-    if (entry) {
-        if (copy_to_user(buf, entry->buffptr+offset_byte_rtn, 1)) {
-            // something bad occurred during copy to user
-            retval = -EFAULT;
+        // Walk forward entry by entry until count is satisfied or the history runs out.
+        // The cursor makes each step, and the first one of a sequential read, O(1).
+        while (copied < count) {
+            size_t done;
+            entry = aesd_circular_buffer_find_entry_cursor(&dev->circ_buffer, pos, &offset_byte_rtn, &file->cursor);
+            if (!entry) {
+                // reached end of the circular buffer
+                break;
+            }
+
+            chunk = min(entry->size - offset_byte_rtn, count - copied);
+            done = copy_to_iter(entry->buffptr + offset_byte_rtn, chunk, to);
+
+            // advance the byte offset pointer value to be used the next time aesd_read_iter() is called
+            copied += done;
+            pos += done;
+            if (done != chunk) {
+                // something bad occurred during copy to user. Report what was copied before the fault, if anything.
+                if (copied == 0) {
+                    retval = -EFAULT;
+                }
+                break;
+            }
+        }
+        *f_pos = pos;
+        if (tail) {
+            file->tail_pos += copied;
+        }
+
+        up_read(&dev->lock);
+        mutex_unlock(&file->read_lock);
+
+        // End of the history: only a tailing reader waits for the next command
+        if (copied || retval || !tail) {
+            break;
         }
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(dev->readq, aesd_tail_ready(dev, file))) {
+            return -ERESTARTSYS;
+        }
+    }
 
-        // increment the byte offset pointer value to be used the next time aesd_read() is called
-        (*f_pos)++;
-        retval = 1;
+    if (retval == 0) {
+        retval = copied;
     }
-    // else no entry found and reached end of the circular buffer
 
-    mutex_unlock(&dev->lock);
     return retval;
 }
 
 
+/**
+ * Adds @param command, @param size bytes allocated from dev->pool, as the newest entry and
+ * recycles the entries it evicts, by count or to keep dev->buff_size within max_bytes.
+ * Caller holds dev->lock for writing.
+ */
+static void aesd_add_command(struct aesd_dev *dev, const char *command, size_t size)
+{
+    struct aesd_buffer_entry new_entry;
+    const char *lost_entry;
+    size_t lost_size = 0;
+
+    while ((lost_entry = aesd_circular_buffer_make_room(&dev->circ_buffer, size, &lost_size)) != NULL) {
+        dev->buff_size -= lost_size;
+        aesd_pool_free(&dev->pool, lost_entry, lost_size);
+    }
+
+    new_entry.buffptr = command;
+    new_entry.size = size;
+    lost_entry = aesd_circular_buffer_add_entry(&dev->circ_buffer, &new_entry, &lost_size);
+
+    dev->buff_size += size;
+
+    if (lost_entry) {
+        PDEBUG("Recycling one entry from circular buffer because it was overwritten.");
+        dev->buff_size -= lost_size;
+        aesd_pool_free(&dev->pool, lost_entry, lost_size);
+    }
+}
+
 /*
   a. Allocate memory for each write command as it is received,
   supporting any length of write request (up to the length of memory which can be allocated through kmalloc),
@@ -136,136 +351,133 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     v. For the purpose of this assignment you can use kmalloc for all allocations
     regardless of size, and assume writes will be small enough to work with kmalloc.
 */
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     ssize_t retval = -EAGAIN;
-    const char *lost_entry = NULL;
-    struct aesd_dev *dev = filp->private_data;
-    // The data to write needs to be dynamically allocated to work with copy_from_user()
-    // FIXME: Using count+1 to account for the newline character. IS THIS NECESSARY??
-    char *temp_write_data = kmalloc(count+1, GFP_KERNEL);
-    // char *temp_write_data = kmalloc(count, GFP_KERNEL);
-    struct aesd_buffer_entry new_entry;
-    size_t lost_size = 0;
-
-    // Have to put this after kmalloc to satisfy the compiler.
-    // This is to account for the null terminator.
-    // The code works without this, but this just helps to make sure the null terminator is included in the input buffer.
-    // count += 1;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_stage *stage = &file->stage;
+    size_t count = iov_iter_count(from);
+    char *newline;
+    size_t partial_size;
+    size_t complete;
+    size_t total;
+    size_t copied;
+    size_t scan;
+    size_t command_start = 0;
 
     PDEBUG("----------------->");
-    PDEBUG("Writing %zu bytes at offset of %lld", count, *f_pos);
-    PDEBUG("buf: %s", buf);
-    PDEBUG("dev->incomplete_write_buffer: %s", dev->incomplete_write_buffer);
-    PDEBUG("dev->incomplete_write_buffer_size: %zu", dev->incomplete_write_buffer_size);
+    PDEBUG("Writing %zu bytes at offset of %lld", count, iocb->ki_pos);
+    PDEBUG("file->stage.size: %zu", stage->size);
     PDEBUG("-----------------.");
 
     // DONE: handle write
     /*
-    fpos - will either append to the command being written when no newline received or
+    from describes the data, one buffer for write() or several for writev(). It may carry
+        any number of newline terminated commands, each becoming its own entry, and/or
+        the start or continuation of a command still waiting for its newline.
+    ki_pos - will either append to the command being written when no newline received or
         write to the command buffer when newline received.
 
     Return:
     If retval == count, success number of bytes written
-    If less than count, only part written (may be written into incomplete_write_buffer only). May retry.
+    If less than count, only part written (may be written into the file's stage only). May retry.
     If 0, nothing written, may retry.
     If neg, error occurred.
     */
 
-    if ((!filp) || (!buf)) {
-     return -EINVAL;
+    if (count == 0) {
+        return 0;
     }
 
-    if (!temp_write_data) {
-        PDEBUG("Write data not kmalloc'd");
-        retval = -ENOMEM; // signifies that memory was not malloc'd
-        return retval;
+    // Partial commands are private to the open file, so writers on different files only meet
+    // on dev->lock when they complete a command, and their commands can't run into each other.
+    if (mutex_lock_killable(&file->write_lock) != 0) {
+        PDEBUG("Couldn't take the file's write lock");
+        return -ERESTARTSYS;
     }
 
-    if (copy_from_user(temp_write_data, buf, count)) {
-        kfree(temp_write_data);
-        PDEBUG("Copy from user didn't work");
-        retval = -EFAULT;
-        return retval;
+    // Copy straight into the end of the stage, which grows geometrically. A fault here no
+    // longer holds up every other writer.
+    partial_size = stage->size;
+    if (aesd_stage_reserve(stage, partial_size + count) != 0) {
+        PDEBUG("Couldn't grow the stage to %zu bytes", partial_size + count);
+        mutex_unlock(&file->write_lock);
+        return -ENOMEM;
     }
 
-    if (mutex_lock_interruptible(&dev->lock) != 0) {
-        PDEBUG("Couldn't lock mutex");
-        return -ERESTARTSYS;
+    // A fault part way through is a short write of what was copied
+    copied = copy_from_iter(stage->buffer + partial_size, count, from);
+    if (copied == 0) {
+        PDEBUG("Copy from user didn't work");
+        mutex_unlock(&file->write_lock);
+        return -EFAULT;
     }
+    total = partial_size + copied;
 
-    // Write all dev->incomplete_write_buffer_size + count bytes to circular buffer if a \n was found.
-    if (temp_write_data != NULL && memchr(temp_write_data, '\n', count)) {
-        PDEBUG("Found a newline in the write data");
+    // Everything up to the last newline is complete, the staged bytes before this call have none
+    complete = total;
+    while (complete > partial_size && stage->buffer[complete - 1] != '\n') {
+        complete--;
+    }
 
-        // If haven't yet started to fill in the write buffer
-        if (dev->incomplete_write_buffer == NULL) {
-            PDEBUG("Started a new_entry");
-            new_entry.buffptr = temp_write_data;
-            new_entry.size = count;
+    if (complete > partial_size) {
+        // The only exclusive path on the device: it changes the ring and the pool.
+        // Taken once however many commands the call carries.
+        if (down_write_killable(&dev->lock) != 0) {
+            PDEBUG("Couldn't take the lock");
+            stage->size = partial_size;
+            mutex_unlock(&file->write_lock);
+            return -ERESTARTSYS;
         }
-        else { // append the \n data to previous data
-            PDEBUG("Appending \\n data to previous data");
-            // if (temp_write_data != NULL) { // to satisfy the compiler warnings. Didn't work.
-                dev->incomplete_write_buffer = krealloc(dev->incomplete_write_buffer, dev->incomplete_write_buffer_size + count, GFP_KERNEL);
-
-                if (!dev->incomplete_write_buffer) {
-                    PDEBUG("Realloc didn't work for %s", dev->incomplete_write_buffer);
-                    kfree(dev->incomplete_write_buffer);
-                    mutex_unlock(&dev->lock);
-                    return -ENOMEM;
-                }
 
-                // copy temp_write_data to the end of the incomplete_write_buffer
-                memcpy(dev->incomplete_write_buffer + dev->incomplete_write_buffer_size, temp_write_data, count);
-                new_entry.buffptr = dev->incomplete_write_buffer;
-                new_entry.size = dev->incomplete_write_buffer_size + count;
-            // }
-            // else {
-            //     PDEBUG("temp_write_data is NULL");
-            //     mutex_unlock(&dev->lock);
-            //     return -ENOMEM;
-            // }
+        // Split at every newline, each command into a block of its own from the pool
+        scan = partial_size;
+        while (command_start < complete) {
+            size_t command_end;
+            size_t capacity;
+            char *command;
+
+            newline = memchr(stage->buffer + scan, '\n', complete - scan);
+            command_end = newline + 1 - stage->buffer;
+            command = aesd_pool_alloc(&dev->pool, command_end - command_start, &capacity);
+            if (!command) {
+                // A short write of the commands added so far. Bytes that were already staged
+                // before this call stay the partial command, the rest of this call is not taken.
+                copied = command_start > partial_size ? command_start - partial_size : 0;
+                total = command_start > partial_size ? command_start : partial_size;
+                break;
+            }
+            memcpy(command, stage->buffer + command_start, command_end - command_start);
+
+            PDEBUG("Adding entry to circular buffer");
+            aesd_add_command(dev, command, command_end - command_start);
+            command_start = scan = command_end;
         }
 
-        PDEBUG("Adding entry to circular buffer");
-        lost_entry = aesd_circular_buffer_add_entry(&dev->circ_buffer, &new_entry, &lost_size);
-
-        dev->buff_size += new_entry.size;
-
-        if (lost_entry) {
-            PDEBUG("Freeing one entry from circular buffer because it was overwritten.");
-            dev->buff_size -= lost_size; // FIXME: Will this work??
-            kfree(lost_entry); // FIXME: Will this work??
-            lost_entry = NULL;
+        up_write(&dev->lock);
+        if (command_start > 0) {
+            // Once per call however many commands it completed
+            wake_up_interruptible_poll(&dev->readq, EPOLLIN | EPOLLRDNORM);
         }
-        // clear out incomplete_write_buffer and incomplete_write_size
-        dev->incomplete_write_buffer = NULL;
-        dev->incomplete_write_buffer_size = 0;
-
-        retval = count;
     }
-    else { // append to incomplete_write_buffer because a \n was not yet found.
-        PDEBUG("Appending to incomplete_write_buffer, but not writing to circular buffer.");
-        dev->incomplete_write_buffer = krealloc(dev->incomplete_write_buffer, dev->incomplete_write_buffer_size + count, GFP_KERNEL);
 
-        if (!dev->incomplete_write_buffer) {
-            PDEBUG("Realloc didn't work for %s", dev->incomplete_write_buffer);
-            kfree(dev->incomplete_write_buffer);
-            mutex_unlock(&dev->lock);
-            return -ENOMEM;
-        }
-
-        // copy temp_write_data to the end of the incomplete_write_buffer
-        memcpy(dev->incomplete_write_buffer + dev->incomplete_write_buffer_size, temp_write_data, count);
-        dev->incomplete_write_buffer_size += count;
-
-        retval = count; // NEEDS to return count even if not writing to circular buffer
+    // Whatever follows the last newline is the new partial command
+    stage->size = total - command_start;
+    if (stage->size == 0 && stage->capacity > AESD_STAGE_KEEP) {
+        aesd_stage_free(stage);
     }
+    else if (command_start > 0) {
+        PDEBUG("Keeping %zu bytes staged, not writing them to circular buffer.", stage->size);
+        memmove(stage->buffer, stage->buffer + command_start, stage->size);
+    }
+    mutex_unlock(&file->write_lock);
 
-    mutex_unlock(&dev->lock);
-    *f_pos += retval;
+    // NEEDS to return the bytes taken even if they only went into the stage
+    retval = copied ? copied : -ENOMEM;
+    if (retval > 0) {
+        iocb->ki_pos += retval;
+    }
     return retval;
 }
 
@@ -279,10 +491,10 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 loff_t aesd_llseek(struct file *file, loff_t offset, int whence)
 {
 	loff_t retval;
-	struct aesd_dev *dev = file->private_data;
+	struct aesd_dev *dev = ((struct aesd_file *)file->private_data)->dev;
 
-	// Lock the mutex, but it can be interrupted
-	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	// Only reads the history size, so it shares the lock with readers
+	if (down_read_interruptible(&dev->lock)) {
 		return -ERESTARTSYS;
 	}
 
@@ -292,7 +504,7 @@ loff_t aesd_llseek(struct file *file, loff_t offset, int whence)
         PDEBUG("Error in fixed_size_llseek(): %lld\n", retval);
 	}
 
-	mutex_unlock(&aesd_device.lock);
+	up_read(&dev->lock);
 	return retval;
 }
 
@@ -300,44 +512,304 @@ loff_t aesd_llseek(struct file *file, loff_t offset, int whence)
  * Adjust the file offset (f_pos) parameter in @param filp based on the location specified by
  * @param write_cmd (referenced command to locate) and @param write_cmd_offset (the zero-referenced offset into the command).
  * @return 0 if successful, negative value if error occurred:
- * - ERESTARTSYS if mutex could not be obtained
+ * - ERESTARTSYS if the lock could not be obtained
  * - EINVAL if write_cmd or write_cmd_offset was out of range
  */
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
 {
-	struct aesd_dev *dev = filp->private_data;
-	loff_t updated_fpos_offset = 0;
-    int i = 0;
+	struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+	size_t updated_fpos = 0;
 
-	// Lock the mutex, but it can be interrupted
-	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	// Only reads the ring, so it shares the lock with readers. f_pos belongs to this file.
+	if (down_read_interruptible(&dev->lock)) {
 		return -ERESTARTSYS;
 	}
 
-	// Check for valid write_cmd and write_cmd_offset
-	if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED || write_cmd_offset >= dev->circ_buffer.entry[write_cmd].size) {
-		mutex_unlock(&aesd_device.lock);
+	// write_cmd counts from the oldest command, not from the start of the array, and the
+	// cumulative offset index gives its position without summing the sizes before it
+	if (!aesd_circular_buffer_find_fpos_for_entry_offset(&dev->circ_buffer, write_cmd, write_cmd_offset,
+	                                                     &updated_fpos)) {
+		up_read(&dev->lock);
 	    return -EINVAL;
 	}
 
-	// Calculate the updated file position offset
-	for (i = 0; i < write_cmd; i++) {
-		updated_fpos_offset += dev->circ_buffer.entry[i].size;
-	}
-
 	// Update the file pointer to the new offset
-	filp->f_pos = updated_fpos_offset + write_cmd_offset;
+	filp->f_pos = updated_fpos;
+
+	up_read(&dev->lock);
+	return 0;
+}
+
+/**
+ * @brief Turns tail mode for @param filp on or off, see AESDCHAR_IOCTAIL
+ * @return 0, or -ERESTARTSYS if the lock could not be obtained
+ */
+static long aesd_set_tail(struct file *filp, bool tail)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
 
-	mutex_unlock(&aesd_device.lock);
+	if (mutex_lock_interruptible(&file->read_lock)) {
+		return -ERESTARTSYS;
+	}
+	if (down_read_interruptible(&dev->lock)) {
+		mutex_unlock(&file->read_lock);
+		return -ERESTARTSYS;
+	}
+	if (tail && !file->tail) {
+		// Carry on from the current file position, in running byte count terms
+		file->tail_pos = dev->circ_buffer.base +
+			min_t(size_t, filp->f_pos, aesd_circular_buffer_size(&dev->circ_buffer));
+	}
+	file->tail = tail;
+	up_read(&dev->lock);
+	mutex_unlock(&file->read_lock);
 	return 0;
 }
 
 /**
- * @brief The ioctl function for the AESD char driver for AESDCHAR_IOCSEEKTO
+ * @brief The poll function for the AESD char driver
+ * @return EPOLLIN when there is something to read past the file position, or past the tail
+ * position in tail mode, and always EPOLLOUT: writes never wait
+ */
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+	struct aesd_file *file = filp->private_data;
+	struct aesd_dev *dev = file->dev;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(filp, &dev->readq, wait);
+
+	down_read(&dev->lock);
+	if (file->tail ? aesd_tail_ready(dev, file) :
+	    filp->f_pos < aesd_circular_buffer_size(&dev->circ_buffer)) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	up_read(&dev->lock);
+	return mask;
+}
+
+/**
+ * A history snapshot mapped by aesd_mmap(), freed when its last mapping goes away
+ */
+struct aesd_mmap_snapshot
+{
+    atomic_t refs;
+    void *layout;
+};
+
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_mmap_snapshot *snapshot = vma->vm_private_data;
+    atomic_inc(&snapshot->refs);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+    struct aesd_mmap_snapshot *snapshot = vma->vm_private_data;
+    if (atomic_dec_and_test(&snapshot->refs)) {
+        vfree(snapshot->layout);
+        kfree(snapshot);
+    }
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open = aesd_vma_open,
+    .close = aesd_vma_close,
+};
+
+/**
+ * @brief Maps a read-only snapshot of the history, laid out as described by struct aesd_history_header
+ * @param filp - File structure of the device
+ * @param vma - The mapping being set up. Must start at offset 0 and not be writable.
+ * @return 0 on success or negative on failure
+ *
+ * The entries are separate allocations, so they are copied once, at mmap() time, into pages
+ * that are then mapped straight into the reader. Reading the history after that takes no
+ * system calls. Later writes don't change the mapping; map again for a newer snapshot, and
+ * remap with at least header->layout_size bytes when the first mapping was too short to see it all.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_mmap_snapshot *snapshot;
+    unsigned long map_size = vma->vm_end - vma->vm_start;
+    size_t layout_size;
+    int retval;
+
+    if (vma->vm_pgoff != 0 || (vma->vm_flags & VM_WRITE)) {
+        return -EINVAL;
+    }
+
+    snapshot = kzalloc(sizeof(struct aesd_mmap_snapshot), GFP_KERNEL);
+    if (!snapshot) {
+        return -ENOMEM;
+    }
+
+    if (down_read_interruptible(&dev->lock)) {
+        kfree(snapshot);
+        return -ERESTARTSYS;
+    }
+    // The pages are zeroed, so whatever the mapping covers past the layout reads as zeros
+    layout_size = aesd_circular_buffer_layout_size(&dev->circ_buffer);
+    snapshot->layout = vmalloc_user(max_t(unsigned long, PAGE_ALIGN(layout_size), map_size));
+    if (snapshot->layout) {
+        aesd_circular_buffer_layout(&dev->circ_buffer, snapshot->layout);
+    }
+    up_read(&dev->lock);
+
+    if (!snapshot->layout) {
+        kfree(snapshot);
+        return -ENOMEM;
+    }
+
+    retval = remap_vmalloc_range(vma, snapshot->layout, 0);
+    if (retval) {
+        vfree(snapshot->layout);
+        kfree(snapshot);
+        return retval;
+    }
+
+    // Read-only for good, and not carried into children across fork()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTCOPY, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTCOPY;
+#endif
+    atomic_set(&snapshot->refs, 1);
+    vma->vm_private_data = snapshot;
+    vma->vm_ops = &aesd_vm_ops;
+    return 0;
+}
+
+/**
+ * @return the entry for logical write command @param index, counted from the oldest
+ */
+static struct aesd_buffer_entry *aesd_history_entry(struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return &buffer->entry[(buffer->out_offs + index) & buffer->mask];
+}
+
+/**
+ * Implements AESDCHAR_IOCREADCMDS: copies every piece described in @param arg into its buffer
+ * under one hold of the lock, so they all come from the same history.
+ * @return the bytes copied, -EINVAL for a descriptor outside the history, -EFAULT or -ENOMEM
+ */
+static long aesd_read_commands(struct file *filp, struct aesd_read_cmds __user *arg)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_read_cmds request;
+    struct aesd_read_desc *descs;
+    char __user *buffer;
+    uint32_t entry_count;
+    size_t copied = 0;
+    long retval = 0;
+    uint32_t i;
+
+    if (copy_from_user(&request, arg, sizeof(request)) != 0) {
+        return -EFAULT;
+    }
+    if (request.count == 0 || request.count > AESDCHAR_READ_CMDS_MAX) {
+        return -EINVAL;
+    }
+    descs = kvmalloc_array(request.count, sizeof(*descs), GFP_KERNEL);
+    if (!descs) {
+        return -ENOMEM;
+    }
+    if (copy_from_user(descs, u64_to_user_ptr(request.descs), request.count * sizeof(*descs)) != 0) {
+        kvfree(descs);
+        return -EFAULT;
+    }
+    buffer = u64_to_user_ptr(request.buffer);
+
+    if (down_read_interruptible(&dev->lock)) {
+        kvfree(descs);
+        return -ERESTARTSYS;
+    }
+
+    // Check them all first, so a bad descriptor fails the call before anything is copied
+    entry_count = aesd_circular_buffer_count(&dev->circ_buffer);
+    for (i = 0; i < request.count; i++) {
+        if (descs[i].write_cmd >= entry_count ||
+                descs[i].write_cmd_offset >= aesd_history_entry(&dev->circ_buffer, descs[i].write_cmd)->size) {
+            PDEBUG("Descriptor %u is outside the history", i);
+            retval = -EINVAL;
+            break;
+        }
+    }
+
+    for (i = 0; retval == 0 && i < request.count; i++) {
+        struct aesd_buffer_entry *entry = aesd_history_entry(&dev->circ_buffer, descs[i].write_cmd);
+        size_t length = min_t(size_t, descs[i].length, entry->size - descs[i].write_cmd_offset);
+
+        length = min_t(size_t, length, request.buffer_size - copied);
+        if (copy_to_user(buffer + copied, entry->buffptr + descs[i].write_cmd_offset, length) != 0) {
+            retval = -EFAULT;
+            break;
+        }
+        descs[i].length = length;
+        copied += length;
+    }
+    request.generation = dev->circ_buffer.generation;
+    up_read(&dev->lock);
+
+    if (retval == 0 &&
+            (copy_to_user(u64_to_user_ptr(request.descs), descs, request.count * sizeof(*descs)) != 0 ||
+             copy_to_user(arg, &request, sizeof(request)) != 0)) {
+        retval = -EFAULT;
+    }
+    kvfree(descs);
+    return retval ? retval : (long)copied;
+}
+
+/**
+ * Implements AESDCHAR_IOCQUERY: the entry count, total size, generation and running byte counts
+ * of the history, and as many entry sizes as @param arg has room for.
+ * @return 0, -EFAULT or -ERESTARTSYS
+ */
+static long aesd_query_history(struct file *filp, struct aesd_history_info __user *arg)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_history_info info;
+    uint64_t __user *sizes;
+    long retval = 0;
+    uint32_t i;
+
+    if (copy_from_user(&info, arg, sizeof(info)) != 0) {
+        return -EFAULT;
+    }
+    sizes = u64_to_user_ptr(info.sizes);
+
+    if (down_read_interruptible(&dev->lock)) {
+        return -ERESTARTSYS;
+    }
+    info.entry_count = aesd_circular_buffer_count(&dev->circ_buffer);
+    info.total_size = aesd_circular_buffer_size(&dev->circ_buffer);
+    info.generation = dev->circ_buffer.generation;
+    info.base = dev->circ_buffer.base;
+    info.end = dev->circ_buffer.end;
+    for (i = 0; i < info.entry_count && i < info.sizes_count; i++) {
+        if (put_user((uint64_t)aesd_history_entry(&dev->circ_buffer, i)->size, &sizes[i]) != 0) {
+            retval = -EFAULT;
+            break;
+        }
+    }
+    up_read(&dev->lock);
+
+    if (retval == 0 && copy_to_user(arg, &info, sizeof(info)) != 0) {
+        retval = -EFAULT;
+    }
+    return retval;
+}
+
+/**
+ * @brief The ioctl function for the AESD char driver for AESDCHAR_IOCSEEKTO, AESDCHAR_IOCTAIL,
+ * AESDCHAR_IOCREADCMDS and AESDCHAR_IOCQUERY
  * @param filp - Pointer to the file structure.
  * @param cmd - The ioctl command
  * @param arg - User-space struct pointer to be copied to kernel
- * @return Returns 0 on success or negative on failure:
+ * @return Returns 0 on success or negative on failure, or for AESDCHAR_IOCREADCMDS the bytes copied
  */
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -363,11 +835,23 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 				    PDEBUG("aesd_adjust_file_offset failed with out of range error.\n");
 				}
                 else if (retval == -ERESTARTSYS) {
-                    PDEBUG("aesd_adjust_file_offset failed to obtain mutex.\n");
+                    PDEBUG("aesd_adjust_file_offset failed to obtain the lock.\n");
                 }
 			}
 			break;
 
+		case AESDCHAR_IOCTAIL:
+			retval = aesd_set_tail(filp, arg != 0);
+			break;
+
+		case AESDCHAR_IOCREADCMDS:
+			retval = aesd_read_commands(filp, (struct aesd_read_cmds __user *)arg);
+			break;
+
+		case AESDCHAR_IOCQUERY:
+			retval = aesd_query_history(filp, (struct aesd_history_info __user *)arg);
+			break;
+
 		default:
 			retval = -ENOTTY; /* redundant, as cmd was checked against MAXNR */
 			break;
@@ -379,12 +863,14 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter =  aesd_read_iter,
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -417,13 +903,27 @@ int aesd_init_module(void)
 
     // DONE: initialize the AESD specific portion of the device
     // Initializing the locking primitive here for example
-    aesd_circular_buffer_init(&aesd_device.circ_buffer);
-    mutex_init(&aesd_device.lock);
-    aesd_device.incomplete_write_buffer = NULL;
-    aesd_device.incomplete_write_buffer_size = 0;
+    result = aesd_circular_buffer_init_capacity(&aesd_device.circ_buffer, max_entries);
+    if (result) {
+        printk(KERN_WARNING "Can't allocate a history of %u entries\n", max_entries);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+    aesd_device.circ_buffer.byte_budget = max_bytes;
+    result = aesd_pool_init(&aesd_device.pool);
+    if (result) {
+        printk(KERN_WARNING "Can't create the write command caches\n");
+        aesd_circular_buffer_free(&aesd_device.circ_buffer);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+    init_rwsem(&aesd_device.lock);
+    init_waitqueue_head(&aesd_device.readq);
     result = aesd_setup_cdev(&aesd_device);
 
     if (result) {
+        aesd_pool_destroy(&aesd_device.pool);
+        aesd_circular_buffer_free(&aesd_device.circ_buffer);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -433,7 +933,7 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     struct aesd_buffer_entry *entry;
-    int i = 0;
+    uint32_t i = 0;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
@@ -442,10 +942,12 @@ void aesd_cleanup_module(void)
     // Balance what I initialized in the aesd_init_module. ie Free memory, stop using locking primitiives.
     // Remove all members of buffer
     AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.circ_buffer, i) {
-        kfree(entry->buffptr);
+        aesd_pool_free(&aesd_device.pool, entry->buffptr, entry->size);
     }
+    aesd_circular_buffer_free(&aesd_device.circ_buffer);
+    aesd_stage_free(&aesd_device.orphan);
+    aesd_pool_destroy(&aesd_device.pool);
 
-    mutex_destroy(&aesd_device.lock);
     unregister_chrdev_region(devno, 1);
     PDEBUG("Clean up the aesd module");
 }
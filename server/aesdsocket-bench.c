@@ -0,0 +1,465 @@
+/*
+ * aesdsocket-bench.c
+ *
+ * Load generator for aesdsocket. Opens many short-lived client connections against a
+ * running server, each sending one newline terminated packet and reading the history
+ * back until the server closes the connection.
+ *
+ * Reports connections/sec and the p50/p99/max connect-to-close latency.
+ *
+ * -k sends every client's packets over one keep-alive connection instead, for a server run
+ *    with -K, with up to the given number of packets in flight (1 waits for each response).
+ *    -n then counts packets, and the latency reported is from sending a packet to the end of
+ *    its response. Every packet is unique, so a response ends where its own packet does.
+ * -w makes every client pause between connecting and sending, to model slow peers.
+ * -S sweeps the client count 1, 2, 4, ... up to -c to show how throughput scales.
+ * -P samples the server's user+system CPU time from /proc/<pid>/stat around each round
+ *    and reports it per request, with the server's resident memory and thread count after it.
+ *    It also counts the server's open descriptors every millisecond during the round and
+ *    reports the peak next to the counts before and after, which differ if requests leak.
+ *
+ * Usage: aesdsocket-bench [-H host] [-p port] [-c clients] [-n connections] [-s packet_size]
+ *                         [-k pipeline_depth] [-w think_usec] [-S] [-P server_pid]
+ */
+#define _GNU_SOURCE // for memmem()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    int clients;
+    long connections;
+    size_t packet_size;
+    useconds_t think_usec;
+    pid_t server_pid;
+    // Packets in flight on each keep-alive connection, 0 for a connection per packet
+    int pipeline;
+};
+
+struct bench_client {
+    pthread_t thread_id;
+    const struct bench_config *config;
+    int index;
+    long connections;
+    double *latencies_us;
+    long completed;
+    long failed;
+};
+
+static struct addrinfo *server_addr;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * One request: connect, wait @param think_usec, send @param packet, read until the server closes.
+ * @return 0 on success, -1 on any socket error or if the server closed without answering
+ */
+static int run_one(const char *packet, size_t len, useconds_t think_usec) {
+    char readbuf[4096];
+    ssize_t num_read;
+    size_t received = 0;
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (think_usec > 0) {
+        usleep(think_usec);
+    }
+    if (send_all(fd, packet, len) == -1) {
+        close(fd);
+        return -1;
+    }
+    do {
+        num_read = recv(fd, readbuf, sizeof(readbuf), 0);
+        if (num_read > 0) {
+            received += num_read;
+        }
+    } while (num_read > 0 || (num_read == -1 && errno == EINTR));
+    close(fd);
+    // The history always holds the packet just sent, a rejected connection gets nothing
+    return (num_read == 0 && received > 0) ? 0 : -1;
+}
+
+/**
+ * Keep-alive requests: sends all of @param client's packets over one connection, keeping up to
+ * config->pipeline of them in flight, and matches the responses to them in order.
+ * Latencies are recorded per packet; a connection error fails every packet not answered yet.
+ */
+static void run_persistent(struct bench_client *client) {
+    const struct bench_config *config = client->config;
+    long count = client->connections;
+    size_t len = config->packet_size;
+    // Unique packets need room for "<client>.<sequence>." and the newline
+    size_t packet_max = (len > 48) ? len : 48;
+    char *packets = malloc(count * packet_max);
+    size_t *packet_lens = malloc(count * sizeof(size_t));
+    double *sent_at = malloc(count * sizeof(double));
+    // A response can end anywhere in a chunk, keep enough of the previous one to match across
+    char *window = malloc(4096 + packet_max);
+    size_t window_len = 0;
+    long sent = 0;
+    long answered = 0;
+    int fd = -1;
+
+    if (packets == NULL || packet_lens == NULL || sent_at == NULL || window == NULL) {
+        goto fail;
+    }
+    for (long i = 0; i < count; i++) {
+        char *packet = packets + i * packet_max;
+        int prefix = snprintf(packet, packet_max, "%d.%ld.", client->index, i);
+        size_t packet_len = ((size_t)prefix + 1 > len) ? (size_t)prefix + 1 : len;
+        memset(packet + prefix, 'a' + client->index % 26, packet_len - 1 - prefix);
+        packet[packet_len - 1] = '\n';
+        packet_lens[i] = packet_len;
+    }
+
+    fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    if (fd == -1 || connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        goto fail;
+    }
+    while (answered < count) {
+        while (sent < count && sent - answered < config->pipeline) {
+            sent_at[sent] = now_us();
+            if (send_all(fd, packets + sent * packet_max, packet_lens[sent]) == -1) {
+                goto fail;
+            }
+            sent++;
+        }
+
+        ssize_t num_read = recv(fd, window + window_len, 4096, 0);
+        if (num_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (num_read <= 0) {
+            goto fail;
+        }
+        window_len += num_read;
+
+        // Each response is the history up to its packet, which appears nowhere before that
+        char *found;
+        while (answered < sent &&
+               (found = memmem(window, window_len, packets + answered * packet_max, packet_lens[answered])) != NULL) {
+            size_t consumed = found - window + packet_lens[answered];
+            client->latencies_us[client->completed++] = now_us() - sent_at[answered];
+            answered++;
+            memmove(window, window + consumed, window_len - consumed);
+            window_len -= consumed;
+        }
+        if (window_len > packet_max) {
+            memmove(window, window + window_len - packet_max, packet_max);
+            window_len = packet_max;
+        }
+    }
+    close(fd);
+    fd = -1;
+
+fail:
+    if (fd != -1) {
+        close(fd);
+    }
+    client->failed += count - answered;
+    free(window);
+    free(sent_at);
+    free(packet_lens);
+    free(packets);
+}
+
+static void* client_thread(void *arg) {
+    struct bench_client *client = arg;
+    size_t len = client->config->packet_size;
+    char *packet;
+
+    if (client->config->pipeline > 0) {
+        run_persistent(client);
+        return NULL;
+    }
+    packet = malloc(len);
+    if (packet == NULL) {
+        return NULL;
+    }
+    for (long i = 0; i < client->connections; i++) {
+        // Printable payload, unique per client so interleaving is visible in the history
+        memset(packet, 'a' + client->index % 26, len - 1);
+        packet[len - 1] = '\n';
+
+        double start = now_us();
+        if (run_one(packet, len, client->config->think_usec) == 0) {
+            client->latencies_us[client->completed++] = now_us() - start;
+        }
+        else {
+            client->failed++;
+        }
+    }
+    free(packet);
+    return NULL;
+}
+
+/**
+ * @return the user + system CPU seconds used so far by @param pid, or -1 if unavailable
+ */
+static double process_cpu_sec(pid_t pid) {
+    char path[64];
+    char stat[1024];
+    unsigned long utime;
+    unsigned long stime;
+    FILE *file;
+    char *fields;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fgets(stat, sizeof(stat), file) == NULL) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    // The command name in field 2 may contain spaces, so count fields from its closing paren
+    fields = strrchr(stat, ')');
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @return the value of the @param field line ("VmRSS:", "Threads:") of /proc/<pid>/status, or -1
+ */
+static long process_status_field(pid_t pid, const char *field) {
+    char path[64];
+    char line[256];
+    long value = -1;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            value = strtol(line + strlen(field), NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * @return the number of open descriptors of @param pid, or -1 if unavailable
+ */
+static long process_fd_count(pid_t pid) {
+    char path[64];
+    long count = 0;
+    struct dirent *entry;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+struct fd_sampler {
+    pthread_t thread_id;
+    pid_t pid;
+    volatile bool stop;
+    long peak;
+};
+
+static void* fd_sampler_thread(void *arg) {
+    struct fd_sampler *sampler = arg;
+
+    while (!sampler->stop) {
+        long count = process_fd_count(sampler->pid);
+        if (count > sampler->peak) {
+            sampler->peak = count;
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs @param config->connections requests split across @param config->clients threads
+ * and prints the results.
+ * @return the number of failed requests
+ */
+static long run_round(const struct bench_config *config) {
+    struct bench_client *clients = calloc(config->clients, sizeof(struct bench_client));
+    double *latencies_us = calloc(config->connections, sizeof(double));
+    if (clients == NULL || latencies_us == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    double cpu_start = config->server_pid ? process_cpu_sec(config->server_pid) : -1;
+    long fds_before = config->server_pid ? process_fd_count(config->server_pid) : -1;
+    struct fd_sampler sampler = { .pid = config->server_pid, .stop = false, .peak = fds_before };
+    if (config->server_pid) {
+        pthread_create(&sampler.thread_id, NULL, fd_sampler_thread, &sampler);
+    }
+    double start = now_us();
+    long offset = 0;
+    for (int i = 0; i < config->clients; i++) {
+        clients[i].config = config;
+        clients[i].index = i;
+        clients[i].connections = config->connections / config->clients + (i < config->connections % config->clients);
+        clients[i].latencies_us = latencies_us + offset;
+        offset += clients[i].connections;
+        pthread_create(&clients[i].thread_id, NULL, client_thread, &clients[i]);
+    }
+
+    long completed = 0;
+    long failed = 0;
+    for (int i = 0; i < config->clients; i++) {
+        pthread_join(clients[i].thread_id, NULL);
+        // Pack the per-client latencies together for sorting
+        memmove(latencies_us + completed, clients[i].latencies_us, clients[i].completed * sizeof(double));
+        completed += clients[i].completed;
+        failed += clients[i].failed;
+    }
+    double elapsed_s = (now_us() - start) / 1e6;
+    if (config->server_pid) {
+        sampler.stop = true;
+        pthread_join(sampler.thread_id, NULL);
+    }
+
+    qsort(latencies_us, completed, sizeof(double), compare_double);
+    printf("clients=%d %s=%ld failed=%ld elapsed=%.3fs\n", config->clients,
+           config->pipeline ? "packets" : "connections", completed, failed, elapsed_s);
+    if (completed > 0) {
+        printf("%s=%.1f p50=%.1fus p99=%.1fus max=%.1fus\n",
+               config->pipeline ? "packets/s" : "conn/s", completed / elapsed_s,
+               latencies_us[completed / 2],
+               latencies_us[(completed * 99) / 100],
+               latencies_us[completed - 1]);
+    }
+    if (cpu_start >= 0 && completed > 0) {
+        double cpu_used = process_cpu_sec(config->server_pid) - cpu_start;
+        printf("server cpu=%.3fs cpu/request=%.1fus\n", cpu_used, cpu_used * 1e6 / completed);
+    }
+    if (config->server_pid) {
+        printf("server rss=%ldKB peak=%ldKB threads=%ld\n",
+               process_status_field(config->server_pid, "VmRSS:"),
+               process_status_field(config->server_pid, "VmHWM:"),
+               process_status_field(config->server_pid, "Threads:"));
+        printf("server fds before=%ld peak=%ld after=%ld\n",
+               fds_before, sampler.peak, process_fd_count(config->server_pid));
+    }
+
+    free(latencies_us);
+    free(clients);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config config = {
+        .host = "localhost",
+        .port = "9000",
+        .clients = 8,
+        .connections = 2000,
+        .packet_size = 16,
+        .think_usec = 0,
+        .server_pid = 0,
+        .pipeline = 0,
+    };
+    bool sweep = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:n:s:k:w:SP:")) != -1) {
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = optarg; break;
+        case 'c': config.clients = atoi(optarg); break;
+        case 'n': config.connections = atol(optarg); break;
+        case 's': config.packet_size = strtoul(optarg, NULL, 10); break;
+        case 'k': config.pipeline = atoi(optarg); break;
+        case 'w': config.think_usec = strtoul(optarg, NULL, 10); break;
+        case 'S': sweep = true; break;
+        case 'P': config.server_pid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-p port] [-c clients] [-n connections] [-s packet_size] [-k pipeline_depth] "
+                    "[-w think_usec] [-S] [-P server_pid]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.clients < 1 || config.connections < config.clients || config.packet_size < 2 || config.pipeline < 0) {
+        fprintf(stderr, "Need at least one client, one connection per client and a 2 byte packet\n");
+        return 1;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", config.host, config.port);
+        return 1;
+    }
+
+    if (sweep) {
+        int max_clients = config.clients;
+        long failed = 0;
+        for (config.clients = 1; config.clients <= max_clients; config.clients *= 2) {
+            failed += run_round(&config);
+        }
+        freeaddrinfo(server_addr);
+        return failed ? 1 : 0;
+    }
+
+    long failed = run_round(&config);
+    freeaddrinfo(server_addr);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,228 @@
+#!/bin/sh
+# Benchmarks aesdsocket with aesdsocket-bench.
+# Builds /var/tmp/aesdsocketdata (USE_AESD_CHAR_DEVICE=0) servers so it runs without the driver loaded.
+#
+# Usage: ./aesdsocket-bench.sh [clients] [connections]
+#   Compares the connection engines, with the server's CPU time, memory and open descriptors,
+#   then runs threads and the worker pool on the segment log (-l).
+#   Extra aesdsocket-bench options can be passed in BENCH_ARGS, e.g.
+#     BENCH_ARGS="-S -w 2000" ./aesdsocket-bench.sh 16 400
+#   sweeps 1..16 clients that each stall 2ms before sending, to show throughput scaling with slow peers.
+#
+# Usage: ./aesdsocket-bench.sh sendfile [history_mb] [requests]
+#   Compares server CPU time per request for sendfile() and buffered readback of a large history.
+#
+# Usage: ./aesdsocket-bench.sh log [clients] [connections] [log_dir]
+#   Compares the data file with the segment log (-l) at several group commit windows (-g).
+#
+# Usage: ./aesdsocket-bench.sh commit [max_clients] [connections]
+#   Sweeps 1..max_clients clients against fsync() per packet and the data file's commit queue.
+#
+# Usage: ./aesdsocket-bench.sh pool [clients] [connections] [workers]
+#   Floods thread per connection and the worker pool (-w), waiting or rejecting (-R) when its
+#   queue is full, with clients that stall 2ms before sending. Reports server memory and threads.
+#
+# Usage: ./aesdsocket-bench.sh uring [clients] [connections]
+#   Compares thread per connection, one epoll event loop and io_uring (-u) on requests/sec, then
+#   runs each again under syscall-count for the server's system calls per request.
+#
+# Usage: ./aesdsocket-bench.sh keepalive [packets] [pipeline_depth]
+#   Sends packets from one client over a connection per packet, over one keep-alive connection
+#   (-K) waiting for each response, and over one keep-alive connection with pipeline_depth
+#   packets in flight, for each connection engine. Reports packets/sec and latency.
+
+DATA_FILE=/var/tmp/aesdsocketdata
+
+cd `dirname $0`
+make bench || exit 1
+
+# build_server <output> [extra CFLAGS...]
+build_server() {
+    output=$1
+    shift
+    ${CROSS_COMPILE}gcc -O2 -DUSE_AESD_CHAR_DEVICE=0 "$@" aesdsocket.c packet-framer.c segment-log.c commit-queue.c work-queue.c mpsc-ring.c uring.c -o ${output} -lpthread -lrt || exit 1
+}
+
+# start_server <binary> [aesdsocket args...]
+# The server's stdout goes to ${SERVER_OUT}, /dev/null by default
+start_server() {
+    binary=$1
+    shift
+    ${binary} "$@" > ${SERVER_OUT:-/dev/null} &
+    server_pid=$!
+    sleep 1
+}
+
+stop_server() {
+    kill -TERM ${server_pid}
+    wait ${server_pid}
+}
+
+if [ "$1" = "sendfile" ]; then
+    HISTORY_MB=${2:-4}
+    REQUESTS=${3:-200}
+    build_server ./aesdsocket-filemode
+    build_server ./aesdsocket-buffered -DUSE_SENDFILE=0
+
+    for server in ./aesdsocket-filemode ./aesdsocket-buffered; do
+        start_server ${server}
+        # Preload the history directly, 100 byte packets, so every request returns HISTORY_MB megabytes
+        yes "$(printf '%099d' 0)" | head -c ${HISTORY_MB}M >> ${DATA_FILE}
+        echo "--- ${server}, ${HISTORY_MB}MB history"
+        ./aesdsocket-bench -c 1 -n ${REQUESTS} -P ${server_pid} ${BENCH_ARGS}
+        stop_server
+    done
+    exit 0
+fi
+
+if [ "$1" = "pool" ]; then
+    CLIENTS=${2:-256}
+    CONNECTIONS=${3:-4000}
+    WORKERS=${4:-16}
+    SERVER_OUT=/tmp/aesdsocket-bench.out
+    build_server ./aesdsocket-filemode
+
+    # run_pool <label> [aesdsocket args...]
+    run_pool() {
+        label=$1
+        shift
+        start_server ./aesdsocket-filemode "$@"
+        echo "--- ${label}"
+        ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} -w 2000 -P ${server_pid} ${BENCH_ARGS}
+        stop_server
+        grep "Work queue" ${SERVER_OUT}
+    }
+    run_pool "thread per connection"
+    run_pool "${WORKERS} workers, queue 64, wait when full" -w ${WORKERS} -q 64
+    run_pool "${WORKERS} workers, queue 64, reject when full" -w ${WORKERS} -q 64 -R
+    rm -f ${SERVER_OUT}
+    exit 0
+fi
+
+if [ "$1" = "uring" ]; then
+    CLIENTS=${2:-8}
+    CONNECTIONS=${3:-2000}
+    COUNTS=/tmp/aesdsocket-syscalls.out
+    build_server ./aesdsocket-filemode
+
+    # run_uring <label> [aesdsocket args...]
+    run_uring() {
+        label=$1
+        shift
+        start_server ./aesdsocket-filemode "$@"
+        echo "--- ${label}"
+        ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS}
+        stop_server
+        # Traced runs are far slower, they only count. The first report covers startup.
+        ./syscall-count ./aesdsocket-filemode "$@" > /dev/null 2> ${COUNTS} &
+        server_pid=$!
+        sleep 1
+        kill -USR1 ${server_pid}
+        ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS} > /dev/null
+        kill -USR1 ${server_pid}
+        sleep 1
+        stop_server
+        sed -n 2p ${COUNTS}
+        sed -n 2p ${COUNTS} | awk -v n=${CONNECTIONS} '{ split($1, total, "="); printf "syscalls/request=%.1f\n", total[2] / n }'
+    }
+    run_uring "thread per connection"
+    run_uring "epoll, 1 event loop" -e 1
+    run_uring "io_uring" -u
+    rm -f ${COUNTS}
+    exit 0
+fi
+
+if [ "$1" = "keepalive" ]; then
+    PACKETS=${2:-2000}
+    DEPTH=${3:-16}
+    build_server ./aesdsocket-filemode
+
+    # run_keepalive <label> [aesdsocket args...]
+    run_keepalive() {
+        label=$1
+        shift
+        start_server ./aesdsocket-filemode "$@"
+        echo "--- ${label}, a connection per packet"
+        ./aesdsocket-bench -c 1 -n ${PACKETS} ${BENCH_ARGS}
+        stop_server
+        start_server ./aesdsocket-filemode -K 5000 "$@"
+        echo "--- ${label}, one keep-alive connection"
+        ./aesdsocket-bench -c 1 -n ${PACKETS} -k 1 ${BENCH_ARGS}
+        stop_server
+        start_server ./aesdsocket-filemode -K 5000 "$@"
+        echo "--- ${label}, one keep-alive connection, ${DEPTH} packets in flight"
+        ./aesdsocket-bench -c 1 -n ${PACKETS} -k ${DEPTH} ${BENCH_ARGS}
+        stop_server
+    }
+    run_keepalive "thread per connection"
+    run_keepalive "epoll, 1 event loop" -e 1
+    run_keepalive "io_uring" -u
+    exit 0
+fi
+
+if [ "$1" = "commit" ]; then
+    CLIENTS=${2:-64}
+    CONNECTIONS=${3:-4000}
+    build_server ./aesdsocket-filemode
+    build_server ./aesdsocket-fsync -DUSE_GROUP_COMMIT=0
+
+    start_server ./aesdsocket-fsync
+    echo "--- fsync() per packet"
+    ./aesdsocket-bench -S -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS}
+    stop_server
+    for window in 0 500; do
+        start_server ./aesdsocket-filemode -g ${window}
+        echo "--- commit queue, ${window}us max delay"
+        ./aesdsocket-bench -S -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS}
+        stop_server
+    done
+    exit 0
+fi
+
+if [ "$1" = "log" ]; then
+    CLIENTS=${2:-16}
+    CONNECTIONS=${3:-4000}
+    LOG_DIR=${4:-/var/tmp/aesdsocket-log}
+    build_server ./aesdsocket-filemode
+
+    start_server ./aesdsocket-filemode
+    echo "--- data file"
+    ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS}
+    stop_server
+    for window in 0 100 500 2000; do
+        # Start each window from an empty log so every run returns the same history
+        rm -rf ${LOG_DIR}
+        start_server ./aesdsocket-filemode -l ${LOG_DIR} -g ${window}
+        echo "--- segment log, ${window}us commit window"
+        ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} ${BENCH_ARGS}
+        stop_server
+    done
+    rm -rf ${LOG_DIR}
+    exit 0
+fi
+
+CLIENTS=${1:-8}
+CONNECTIONS=${2:-2000}
+build_server ./aesdsocket-filemode
+
+# run_engine <label> [aesdsocket args...]
+run_engine() {
+    label=$1
+    shift
+    start_server ./aesdsocket-filemode "$@"
+    echo "--- ${label}"
+    ./aesdsocket-bench -c ${CLIENTS} -n ${CONNECTIONS} -P ${server_pid} ${BENCH_ARGS}
+    stop_server
+}
+
+run_engine "thread per connection"
+run_engine "epoll, 1 event loop" -e 1
+run_engine "epoll, $(nproc) event loops" -e $(nproc)
+
+# The segment log has no descriptors on the data file, run it under the engines that share them
+LOG_DIR=/var/tmp/aesdsocket-log
+rm -rf ${LOG_DIR}
+run_engine "thread per connection, segment log" -l ${LOG_DIR}
+rm -rf ${LOG_DIR}
+run_engine "4 workers, segment log" -w 4 -l ${LOG_DIR}
+rm -rf ${LOG_DIR}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for accept4() and memrchr()
 #include "syslog.h"
 #include <stdio.h>
 #include <stdlib.h>     // for exit()
@@ -12,7 +13,9 @@
 #include <sys/stat.h>   // for S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IROTH
 // extras
 #include <netinet/in.h>
+#include <netinet/tcp.h> // for TCP_NODELAY
 #include <fcntl.h> // also for lseek()
+#include <sys/sendfile.h> // for sendfile()
 
 // Assignment 6
 #include <sys/queue.h>
@@ -20,6 +23,13 @@
 #include <time.h>
 #include <stdbool.h>
 
+// Event-driven connection engine (-e)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+
 // Assignment 8
 // 1 = for assignment 8
 // 0 = for prior assignments
@@ -27,9 +37,68 @@
 #define USE_AESD_CHAR_DEVICE 1
 #endif
 
+#if USE_AESD_CHAR_DEVICE
+#define AESD_DATA_PATH "/dev/aesdchar"
+#else
+#define AESD_DATA_PATH "/var/tmp/aesdsocketdata"
+#endif
+
+// History is returned to clients in chunks of this size, however large it is
+#define READBACK_CHUNK_SIZE 4096
+
+// 1 = return /var/tmp/aesdsocketdata with sendfile(), letting the kernel move page cache pages
+//     straight to the socket instead of copying them through a userspace buffer
+// 0 = always use the buffered READBACK_CHUNK_SIZE path
+// The char device can't be a sendfile() source, so this only defaults on for the data file.
+#ifndef USE_SENDFILE
+#define USE_SENDFILE (!USE_AESD_CHAR_DEVICE)
+#endif
+
+// 1 = writers to /var/tmp/aesdsocketdata share fdatasync() calls made by a flusher thread
+//     (commit-queue.c), each one still answered only once its packet is durable
+// 0 = fsync() after every packet, inside the global mutex
+// The char device has no fsync(), its writes are complete once the driver holds them.
+#ifndef USE_GROUP_COMMIT
+#define USE_GROUP_COMMIT (!USE_AESD_CHAR_DEVICE)
+#endif
+
+// 1 = the writer thread (-W) and the io_uring engine (-u) store all the packets they have ready
+//     with one writev(), and work out each response from the history after it
+// 0 = they store one packet per write
+// The char device evicts old commands as it takes new ones, so after a batch the responses of
+// its earlier packets can't be worked out anymore.
+#ifndef USE_BATCHED_APPENDS
+#define USE_BATCHED_APPENDS (!USE_AESD_CHAR_DEVICE)
+#endif
+
 // Assignment 9
 #include "../aesd-char-driver/aesd_ioctl.h"
 
+#include "packet-framer.h"
+#include "segment-log.h"
+#include "commit-queue.h"
+#include "work-queue.h"
+#include "mpsc-ring.h"
+#include "uring.h"
+
+// Packets longer than this (newline included) are discarded, see -m
+#define DEFAULT_MAX_PACKET_SIZE (1024 * 1024)
+
+// Pending connections the worker pool queues by default, see -q
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_WORKERS 1024
+
+// Packets in flight to the single writer thread, and the most it writes with one writev(), see -W
+#define WRITER_RING_SIZE 1024
+#define WRITER_BATCH_MAX 64
+
+// Longest a blocked connection thread waits before checking for an exit signal, with -K
+#define KEEPALIVE_POLL_MS 1000
+
+// Segment log defaults, see -s and -k: up to 64 MiB of history on disk
+#define DEFAULT_SEGMENT_SIZE (8 * 1024 * 1024)
+#define DEFAULT_SEGMENTS_KEPT 8
+
 // const struct {
 //     sa_family_t sa_family;
 //     char        sa_data[14];
@@ -51,6 +120,84 @@ struct addrinfo *servinfo; // res
 int sockfd;
 
 const char *ioctl_str = "AESDCHAR_IOCSEEKTO:";
+size_t max_packet_size = DEFAULT_MAX_PACKET_SIZE;
+
+// With -l, packets go to a segment log in this directory instead of AESD_DATA_PATH
+const char *log_dir = NULL;
+struct segment_log packet_log;
+
+#if USE_GROUP_COMMIT
+struct commit_queue data_commits;
+#endif
+
+// With -K, a connection stays open for more packets until it has been idle this long.
+// 0 closes it once a packet has been answered, which is what the assignment tests expect.
+long idle_timeout_ms = 0;
+
+// With -w, accepted connections are queued for this many worker threads instead of getting a thread each
+int worker_count = 0;
+pthread_t *workers;
+struct work_queue connection_queue;
+
+/**
+ * The history a request returns, from start up to end, read back after the append outside of
+ * any lock. For the data file they are file offsets. The char device evicts its oldest command to
+ * make room for a new one, which moves every offset, so for it they are the driver's running byte
+ * counts, which don't move: bytes evicted before they were sent are skipped.
+ */
+struct history_snapshot {
+    off_t start;
+    off_t end;
+};
+
+/**
+ * A packet handed to the writer thread (-W, and always with -e). It lives on the submitting
+ * thread's stack, or in an event loop's connection, until the writer posts done, or calls
+ * stored() if it is set, after filling in the results.
+ */
+struct write_request {
+    const char *packet;
+    size_t len;
+    // end is -1 if the packet could not be stored
+    struct history_snapshot history;
+#if USE_GROUP_COMMIT
+    uint64_t ticket;
+#endif
+    sem_t done;
+    // Set by an event loop, which must not wait on done. Runs on the writer thread.
+    void (*stored)(struct write_request *request);
+    void *owner;
+};
+
+// With -W, and always with -e, one writer thread owns every write to AESD_DATA_PATH and the
+// global mutex isn't used
+bool use_writer_thread = false;
+struct mpsc_ring writer_ring;
+pthread_t writer_thread_id;
+
+/*
+ * Descriptors on AESD_DATA_PATH, opened once at startup instead of per request. Every append,
+ * SEEKTO ioctl and sync goes through data_append_fd. Histories are read back with positioned
+ * reads (pread(), sendfile() with an offset), which never move a file position, so each pool
+ * worker or event loop has a read descriptor of its own and connection threads share the first.
+ * The char device gets no read descriptors: each open one holds a struct aesd_file in the driver,
+ * and its reads go through data_append_fd.
+ */
+int data_append_fd = -1;
+int *data_read_fds;
+int data_read_fd_count;
+
+/**
+ * @return the read descriptor for pool worker or event loop @param index, data_append_fd for the
+ * char device, or -1 with -l, where histories come from the segment log and no descriptors are
+ * open on AESD_DATA_PATH
+ */
+static int data_read_fd(int index) {
+    if (log_dir != NULL) {
+        return -1;
+    }
+    return (data_read_fd_count > 0) ? data_read_fds[index] : data_append_fd;
+}
 
 void close_all_things() {
 // Asy8: "Ensure you do not remove the  /dev/aesdchar endpoint after exiting the aesdsocket application."
@@ -79,234 +226,2067 @@ static void signal_handler(int signal_num) {
         printf("***We got a SIGTERM***\n");
     }
 
-    printf("Wait 2 seconds for threads to close.\n");
-    sleep(2);
-    close_all_things();
+    printf("Wait 2 seconds for threads to close.\n");
+    sleep(2);
+    close_all_things();
+}
+
+// the recursive "entries" member is necessary to use the linked lists from sys/queue.h
+struct Node {
+    pthread_t thread_id;
+    bool is_complete;
+    SLIST_ENTRY(Node) entries;
+    struct Node *next;
+};
+SLIST_HEAD(ListHead, Node);
+
+struct threadArgs {
+    char ipaddr[INET_ADDRSTRLEN];
+    int acceptfd;
+    struct Node *thread_node;
+};
+
+pthread_mutex_t mutex;
+// pthread_mutex_t timer_pause_mutex;
+
+/**
+ * Joins, unlinks and frees the nodes of finished connection threads in @param head.
+ * With @param wait_all set, waits for every thread instead of only the completed ones.
+ * Each node is joined exactly once; joining a thread twice is undefined behavior.
+ */
+static void join_connection_threads(struct ListHead *head, bool wait_all) {
+    struct Node *prev = NULL;
+    struct Node *node = SLIST_FIRST(head);
+
+    while (node != NULL) {
+        struct Node *next = SLIST_NEXT(node, entries);
+        if (wait_all || node->is_complete) {
+            pthread_join(node->thread_id, NULL);
+            if (prev == NULL) {
+                SLIST_REMOVE_HEAD(head, entries);
+            }
+            else {
+                SLIST_NEXT(prev, entries) = next;
+            }
+            free(node);
+        }
+        else {
+            prev = node;
+        }
+        node = next;
+    }
+}
+
+void closeThread(struct threadArgs *args) {
+    // Set a global boolean to signal the end of the thread
+    args->thread_node->is_complete = true;
+
+    free(args);
+    args = NULL; // to prevent further use of args
+
+    pthread_exit(NULL);
+}
+
+/**
+ * @return true if @param packet is an "AESDCHAR_IOCSEEKTO:X,Y" command rather than data to append
+ */
+static bool is_seekto_packet(const char *packet, size_t len) {
+#if USE_AESD_CHAR_DEVICE
+    return len > strlen(ioctl_str) && strncmp(packet, ioctl_str, strlen(ioctl_str)) == 0;
+#else
+    return false;
+#endif
+}
+
+#if USE_AESD_CHAR_DEVICE
+/**
+ * @return the char device's running byte count at the oldest byte of its history, through
+ * @param fd, or -1 on error
+ */
+static off_t aesd_history_base(int fd) {
+    struct aesd_history_info info = { .sizes = 0, .sizes_count = 0 };
+
+    if (ioctl(fd, AESDCHAR_IOCQUERY, &info) != 0) {
+        return -1;
+    }
+    return info.base;
+}
+#endif
+
+/**
+ * Completes @param history, whose start and end offsets were just taken, before anything else is
+ * appended: turns the char device's offsets into running byte counts. Nothing to do for the data file.
+ * @return 0 on success, -1 on error
+ */
+static int history_snapshot_take(struct history_snapshot *history) {
+#if USE_AESD_CHAR_DEVICE
+    off_t base = aesd_history_base(data_append_fd);
+
+    if (base == -1) {
+        syslog(LOG_ERR, "AESDCHAR_IOCQUERY failed: %s", strerror(errno));
+        return -1;
+    }
+    history->start += base;
+    history->end += base;
+#endif
+    return 0;
+}
+
+/**
+ * Reads up to @param len bytes of @param history from @param position into @param buf with a
+ * positioned read of @param readfd. For the char device @param position first moves past any
+ * bytes evicted since the snapshot was taken, a read that an eviction overlapped is retried, and
+ * the read stops after the last newline it got.
+ * @return the number of bytes read at @param position, 0 at the end of the snapshot, or -1 with
+ * errno set
+ */
+static ssize_t history_snapshot_read(const struct history_snapshot *history, int readfd, char *buf, size_t len, off_t *position) {
+#if USE_AESD_CHAR_DEVICE
+    off_t base = aesd_history_base(readfd);
+
+    while (base != -1) {
+        ssize_t num_read;
+        off_t base_after;
+
+        if (*position < base) {
+            *position = base;
+        }
+        if (*position >= history->end) {
+            return 0;
+        }
+        if ((off_t)len > history->end - *position) {
+            len = history->end - *position;
+        }
+        num_read = pread(readfd, buf, len, *position - base);
+        if (num_read == -1) {
+            return -1;
+        }
+        // Evictions only ever raise the base, so an unchanged one means nothing moved under the read
+        base_after = aesd_history_base(readfd);
+        if (base_after == base) {
+            // End on a whole command, so skipping evicted bytes later can't splice a command the
+            // client got part of onto the next one. Only a command longer than len is split.
+            char *last_newline = memrchr(buf, '\n', num_read);
+            return (last_newline != NULL) ? last_newline + 1 - buf : num_read;
+        }
+        base = base_after;
+    }
+    return -1;
+#else
+    if (*position >= history->end) {
+        return 0;
+    }
+    if ((off_t)len > history->end - *position) {
+        len = history->end - *position;
+    }
+    return pread(readfd, buf, len, *position);
+#endif
+}
+
+/**
+ * Applies the "AESDCHAR_IOCSEEKTO:X,Y" command in @param packet through data_append_fd and
+ * snapshots the history from the offset the ioctl chose into @param history.
+ * Must be ordered with the writes, like an append.
+ * @return 0 on success, -1 on error
+ */
+static int apply_seekto(const char *packet, struct history_snapshot *history) {
+    history->end = -1;
+#if USE_AESD_CHAR_DEVICE
+    struct aesd_seekto aesd_seekto_data;
+    syslog(LOG_INFO, "Received ioctl string");
+
+    if (sscanf(packet, "AESDCHAR_IOCSEEKTO:%u,%u", &aesd_seekto_data.write_cmd, &aesd_seekto_data.write_cmd_offset) != 2 ||
+        ioctl(data_append_fd, AESDCHAR_IOCSEEKTO, &aesd_seekto_data) != 0) {
+        syslog(LOG_ERR, "ioctl() failed");
+    }
+    else {
+        // Appends ignore the position of an O_APPEND descriptor, so it can be left where it is
+        history->start = lseek(data_append_fd, 0, SEEK_CUR);
+        history->end = (history->start == -1) ? -1 : lseek(data_append_fd, 0, SEEK_END);
+        if (history->end != -1 && history_snapshot_take(history) == -1) {
+            history->end = -1;
+        }
+    }
+#endif
+    return (history->end == -1) ? -1 : 0;
+}
+
+/**
+ * Writes all of @param iov, @param iovcnt buffers, retrying partial writes.
+ * @return 0 on success, -1 on a write error
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Hands @param request back to its submitter, which may reuse or free it from then on.
+ */
+static void write_request_done(struct write_request *request) {
+    if (request->stored != NULL) {
+        request->stored(request);
+    }
+    else {
+        sem_post(&request->done);
+    }
+}
+
+/**
+ * Appends the data packets of @param count requests with one writev() and answers them.
+ * Each request's history ends with its own packet: the end after the whole run, less the bytes
+ * of the packets written after it. Without USE_BATCHED_APPENDS the run is a single packet.
+ */
+static void writer_append_run(struct write_request **requests, size_t count) {
+    struct iovec iov[WRITER_BATCH_MAX];
+    off_t history_end = -1;
+    off_t after = 0;
+#if USE_GROUP_COMMIT
+    uint64_t ticket = 0;
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)requests[i]->packet;
+        iov[i].iov_len = requests[i]->len;
+    }
+    if (writev_all(data_append_fd, iov, count) == -1) {
+        syslog(LOG_ERR, "Write to file failed: %s", strerror(errno));
+    }
+    else {
+        syslog(LOG_INFO, "Wrote %zu packets to file", count);
+#if USE_GROUP_COMMIT
+        ticket = commit_queue_submit(&data_commits);
+#elif USE_AESD_CHAR_DEVICE == 0
+        fsync(data_append_fd);
+#endif
+        history_end = lseek(data_append_fd, 0, SEEK_END);
+    }
+
+    for (size_t i = count; i-- > 0; ) {
+        struct write_request *request = requests[i];
+        request->history.start = 0;
+        request->history.end = (history_end == -1) ? -1 : history_end - after;
+        if (request->history.end != -1 && history_snapshot_take(&request->history) == -1) {
+            request->history.end = -1;
+        }
+#if USE_GROUP_COMMIT
+        request->ticket = ticket;
+#endif
+        after += request->len;
+        // The request may be gone as soon as this returns
+        write_request_done(request);
+    }
+}
+
+/**
+ * The writer thread: drains the ring @param arg in batches, in the order the packets were pushed.
+ * A NULL request stops it.
+ */
+void* writer_thread(void * arg) {
+    struct mpsc_ring *ring = (struct mpsc_ring *)arg;
+    void *batch[WRITER_BATCH_MAX];
+    bool stopping = false;
+
+    while (!stopping) {
+        size_t count = mpsc_ring_pop_batch(ring, batch, WRITER_BATCH_MAX);
+        struct write_request **requests = (struct write_request **)batch;
+        size_t i = 0;
+
+        while (i < count) {
+            size_t run = 0;
+
+            if (requests[i] == NULL) {
+                stopping = true;
+                break;
+            }
+            if (is_seekto_packet(requests[i]->packet, requests[i]->len)) {
+                apply_seekto(requests[i]->packet, &requests[i]->history);
+#if USE_GROUP_COMMIT
+                requests[i]->ticket = 0;
+#endif
+                write_request_done(requests[i]);
+                i++;
+                continue;
+            }
+            // Gather the data packets up to the next command or the end of the batch
+            while (i + run < count && requests[i + run] != NULL && (USE_BATCHED_APPENDS || run == 0) &&
+                   !is_seekto_packet(requests[i + run]->packet, requests[i + run]->len)) {
+                run++;
+            }
+            writer_append_run(requests + i, run);
+            i += run;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the writer thread, which then is the only user of data_append_fd.
+ * @return 0 on success, -1 on error
+ */
+static int start_writer(void) {
+    if (mpsc_ring_init(&writer_ring, WRITER_RING_SIZE) == -1) {
+        return -1;
+    }
+    if (pthread_create(&writer_thread_id, NULL, writer_thread, &writer_ring) != 0) {
+        mpsc_ring_destroy(&writer_ring);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stops the writer thread once nothing can submit anymore. Everything pushed before is written.
+ */
+static void stop_writer(void) {
+    if (!use_writer_thread) {
+        return;
+    }
+    mpsc_ring_push(&writer_ring, NULL);
+    pthread_join(writer_thread_id, NULL);
+    mpsc_ring_destroy(&writer_ring);
+}
+
+/**
+ * append_packet() for -W: queues the packet for the writer thread and waits for its answer.
+ */
+static int submit_packet(const char *packet, size_t len, struct history_snapshot *history) {
+    struct write_request request = { .packet = packet, .len = len, .history = { .start = 0, .end = -1 } };
+
+    sem_init(&request.done, 0, 0);
+    mpsc_ring_push(&writer_ring, &request);
+    while (sem_wait(&request.done) == -1 && errno == EINTR) {
+    }
+    sem_destroy(&request.done);
+
+#if USE_GROUP_COMMIT
+    if (request.ticket != 0 && commit_queue_wait(&data_commits, request.ticket) == -1) {
+        syslog(LOG_ERR, "Sync of data file failed");
+        return -1;
+    }
+#endif
+    *history = request.history;
+    return (history->end == -1) ? -1 : 0;
+}
+
+/**
+ * Appends @param packet to the history, or applies it as an "AESDCHAR_IOCSEEKTO:X,Y" command,
+ * and snapshots the history to return into @param history, to be released by the caller.
+ * This is the only part of a request that is serialized by the global mutex, or by the writer
+ * thread with -W; receiving, reading the data file back and sending it all happen outside of it.
+ * @return 0 on success, -1 on error
+ */
+static int append_packet(const char *packet, size_t len, struct history_snapshot *history) {
+    int rc;
+#if USE_GROUP_COMMIT
+    uint64_t ticket = 0;
+#endif
+
+    if (use_writer_thread) {
+        return submit_packet(packet, len, history);
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    // Received "AESDCHAR_IOCSEEKTO:X,Y"
+    if (is_seekto_packet(packet, len)) {
+        rc = apply_seekto(packet, history);
+        pthread_mutex_unlock(&mutex);
+        return rc;
+    }
+
+    history->start = 0;
+    history->end = -1;
+
+    if (write(data_append_fd, packet, len) != (ssize_t)len) {
+        syslog(LOG_ERR, "Write to file failed: %s", strerror(errno));
+    }
+    else {
+        syslog(LOG_INFO, "Wrote to file: %.*s", (int)len, packet);
+#if USE_GROUP_COMMIT
+        // The flusher syncs it together with everything else written meanwhile, see the wait below
+        ticket = commit_queue_submit(&data_commits);
+#elif USE_AESD_CHAR_DEVICE == 0
+        fsync(data_append_fd); //  write() needs to be flushed after it's called to immediately write to the file
+#endif
+
+        // In a normal write, the whole history is returned
+        history->end = lseek(data_append_fd, 0, SEEK_END);
+        if (history->end != -1 && history_snapshot_take(history) == -1) {
+            history->end = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&mutex);
+    rc = (history->end == -1) ? -1 : 0;
+
+#if USE_GROUP_COMMIT
+    // Don't answer until the packet is on disk, but wait without holding up the other writers
+    if (ticket != 0 && commit_queue_wait(&data_commits, ticket) == -1) {
+        syslog(LOG_ERR, "Sync of data file failed");
+        rc = -1;
+    }
+#endif
+    return rc;
+}
+
+/**
+ * Sends all @param len bytes of @param buf, retrying partial sends.
+ * @return 0 on success, -1 on a socket error
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t num_sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (num_sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += num_sent;
+        len -= num_sent;
+    }
+    return 0;
+}
+
+#if USE_SENDFILE
+/**
+ * Zero-copy transfer of up to @param remaining bytes from offset @param position of @param readfd
+ * to @param clientfd. Advances @param position by the amount sent, not the file position.
+ * @return the number of bytes sent, 0 at end of file or -1 with errno set
+ */
+static ssize_t sendfile_history(int clientfd, int readfd, off_t *position, off_t remaining) {
+    // sendfile() transfers at most 0x7ffff000 bytes per call
+    size_t count = (remaining > 0x7ffff000) ? 0x7ffff000 : (size_t)remaining;
+    return sendfile(clientfd, readfd, position, count);
+}
+
+/**
+ * @return true if sendfile() failed with @param err because the source or target doesn't support it,
+ * in which case the caller should fall back to read() + send()
+ */
+static bool sendfile_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+#endif
+
+/**
+ * Streams @param history from @param readfd to @param clientfd. With USE_SENDFILE the kernel
+ * copies the file directly with sendfile(); otherwise, or if the descriptors don't support that,
+ * one READBACK_CHUNK_SIZE pread() at a time. Memory use is constant no matter how big the history
+ * is, and @param readfd may be shared.
+ * @return 0 on success, -1 on a read or socket error
+ */
+static int send_history(int clientfd, int readfd, const struct history_snapshot *history) {
+    char readbuf[READBACK_CHUNK_SIZE];
+    off_t position = history->start;
+    off_t remaining = (history->end > position) ? history->end - position : 0;
+    off_t total_sent = 0;
+
+#if USE_SENDFILE
+    while (remaining > 0) {
+        ssize_t num_sent = sendfile_history(clientfd, readfd, &position, remaining);
+        if (num_sent == 0) {
+            remaining = 0;
+            break;
+        }
+        if (num_sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (sendfile_unsupported(errno)) {
+                // Nothing was consumed by the failed call, carry on with the buffered path below
+                break;
+            }
+            return -1;
+        }
+        remaining -= num_sent;
+        total_sent += num_sent;
+    }
+#endif
+
+    while (remaining > 0) {
+        ssize_t num_read = history_snapshot_read(history, readfd, readbuf, sizeof(readbuf), &position);
+        if (num_read == 0) {
+            // The char device ends early when the rest was evicted, the data file only if
+            // something else truncated it
+            break;
+        }
+        if (num_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (send_all(clientfd, readbuf, num_read) == -1) {
+            return -1;
+        }
+        position += num_read;
+        remaining = history->end - position;
+        total_sent += num_read;
+    }
+
+    syslog(LOG_INFO, "Sent %lld bytes of history back to socket", (long long)total_sent);
+    return 0;
+}
+
+void* timer_thread(void * arg) {
+    // Same aesdsocketdata file always.
+    // Needs to dereference the pointer that is passed in.
+    FILE **argfile = (FILE **)arg;
+    FILE* file = *argfile;
+
+    time_t rawtime;
+    struct tm *timeinfo;
+    char timestamp[30] ={0};
+
+    // pthread_mutex_lock(&timer_pause_mutex);
+
+    // Wait for 5 seconds to allow the other tests to finish before adding timestamps to the output file.
+    sleep(5);
+
+    while (received_exit_signal == 0) {
+        // Check every second for an exit signal
+        for (int sec = 0; sec < 10; sec++) {
+            if (received_exit_signal == 0) {sleep(1);}
+            else {break;}
+        }
+
+        time(&rawtime);
+        timeinfo = localtime(&rawtime);
+        strftime(timestamp, sizeof(timestamp), "timestamp:%Y-%m-%d %H:%M:%S\n", timeinfo);
+
+        fwrite(&timestamp, sizeof(char), 30, file);
+        pthread_mutex_lock(&mutex);
+        fflush(file); // push the data to the file
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // pthread_mutex_unlock(&timer_pause_mutex);
+
+    // DON'T free the file here!
+    pthread_exit(NULL);
+}
+
+/**
+ * Answers one complete packet on a blocking client socket: stores it, then streams the
+ * resulting history snapshot back through @param readfd.
+ * @return 0 on success, -1 if the packet could not be stored or the client went away
+ */
+static int handle_packet(int clientfd, int readfd, const char *packet, size_t len) {
+    syslog(LOG_INFO, "Received data: %.*s", (int)len, packet);
+
+    if (log_dir != NULL) {
+        // The append returns once the packet is durable, then the history up to it is streamed
+        struct segment_log_position end;
+        if (segment_log_append(&packet_log, packet, len, &end) == -1) {
+            syslog(LOG_ERR, "Log append failed: %s", strerror(errno));
+            return -1;
+        }
+        if (segment_log_send_history(&packet_log, clientfd, &end) == -1) {
+            syslog(LOG_ERR, "Send failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    struct history_snapshot history;
+    if (append_packet(packet, len, &history) == -1) {
+        return -1;
+    }
+
+    // 5f. Returns the full content of /var/tmp/aesdsocketdata to the client as soon as the received data packet completes.
+    /* You may assume the total size of all packets sent
+    (and therefore size of /var/tmp/aesdsocketdata) will be less than the size
+    of the root filesystem, however you may not assume this total size of all
+    packets sent will be less than the size of the available RAM for the process heap.
+    */
+    // Stream the history snapshot without holding the mutex.
+    // Packets appended by other clients after our snapshot end are not part of this response.
+    int rc = send_history(clientfd, readfd, &history);
+    if (rc == -1) {
+        syslog(LOG_ERR, "Send failed");
+    }
+    return rc;
+}
+
+/**
+ * With -K, sends responses on @param fd as soon as they are written. Otherwise Nagle holds the
+ * small tail of a response written in several parts until the client ACKs the rest, which it
+ * delays while it has nothing to send, stalling every request on a keep-alive connection.
+ */
+static void set_keepalive_nodelay(int fd) {
+    int nodelay = 1;
+
+    if (idle_timeout_ms > 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+}
+
+static long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Receives from the client in @param conn_args until a packet has been answered, then closes
+ * the connection. With -K it keeps answering packets, in order, until the client closes or has
+ * been idle for idle_timeout_ms. Runs on a connection thread or on a pool worker, reading
+ * histories through @param readfd.
+ */
+static void serve_connection(const struct threadArgs *conn_args, int readfd) {
+    // 5e. Receives data over the connection and appends to file /var/tmp/aesdsocketdata, creating this file if it doesn’t exist.
+    /*
+    Your implementation should use a newline to separate data packets received.
+    In other words a packet is considered complete when a newline character is found in the input receive stream,
+    and each newline should result in an append to the /var/tmp/aesdsocketdata file.
+    You may assume the data stream does not include null characters (therefore can be processed using string handling functions).
+    You may assume the length of the packet will be shorter than the available heap size.
+    In other words, as long as you handle malloc() associated failures with error messages you may discard associated over-length packets.
+    */
+    struct packet_framer framer;
+    const char *packet;
+    size_t packet_len;
+    bool answered = false;
+    bool failed = false;
+    long long last_active_ms = monotonic_ms();
+
+    packet_framer_init(&framer, max_packet_size);
+    set_keepalive_nodelay(conn_args->acceptfd);
+
+    if (idle_timeout_ms > 0) {
+        // Wake up from recv() in time for the idle timeout or an exit signal, whichever is first
+        long poll_ms = (idle_timeout_ms < KEEPALIVE_POLL_MS) ? idle_timeout_ms : KEEPALIVE_POLL_MS;
+        struct timeval timeout = { .tv_sec = poll_ms / 1000, .tv_usec = (poll_ms % 1000) * 1000 };
+        setsockopt(conn_args->acceptfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    // Receive outside of the mutex so a slow client only stalls its own thread.
+    // Keep receiving until at least one whole packet has been answered; every packet in the
+    // same segment is answered too. With -K, keep receiving until the client is done.
+    while ((!answered || idle_timeout_ms > 0) && !failed) {
+        size_t space;
+        char *recvbuf = packet_framer_recv_space(&framer, &space);
+        if (recvbuf == NULL) {
+            syslog(LOG_ERR, "Receive buffer malloc failed");
+            break;
+        }
+
+        ssize_t numrecv = recv(conn_args->acceptfd, recvbuf, space, 0);
+        if (numrecv == -1 && errno == EINTR) {
+            continue;
+        }
+        if (numrecv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && idle_timeout_ms > 0) {
+            if (received_exit_signal == 0 && monotonic_ms() - last_active_ms < idle_timeout_ms) {
+                continue;
+            }
+            syslog(LOG_INFO, "Closing idle connection from %s", conn_args->ipaddr);
+            break;
+        }
+        if (numrecv == 0 && answered) {
+            // A keep-alive client that is done
+            break;
+        }
+        if (numrecv == 0 || numrecv == -1) {
+            syslog(LOG_ERR, "Socket recv() received an error: %i", (int)numrecv);
+            break;
+        }
+        packet_framer_commit(&framer, numrecv);
+
+        while (packet_framer_next(&framer, &packet, &packet_len)) {
+            if (handle_packet(conn_args->acceptfd, readfd, packet, packet_len) == -1) {
+                failed = true;
+                break;
+            }
+            answered = true;
+        }
+        last_active_ms = monotonic_ms();
+    }
+
+    if (framer.discarded > 0) {
+        syslog(LOG_WARNING, "Discarded %lu packets longer than %zu bytes from %s", framer.discarded, max_packet_size, conn_args->ipaddr);
+    }
+    packet_framer_free(&framer);
+
+    // The client waits for the connection to close before it knows the whole history was sent
+    close(conn_args->acceptfd);
+
+    // 5g. Logs message to the syslog “Closed connection from XXX” where XXX is the IP address of the connected client.
+    syslog(LOG_NOTICE, "Closed connection from %s\n", conn_args->ipaddr);
+}
+
+void* connection_thread(void * arg) {
+
+    // Unpack the conn_args
+    struct threadArgs *conn_args = (struct threadArgs *)arg;
+    syslog(LOG_DEBUG, "Connection thread started for %s\n", conn_args->ipaddr);
+
+    serve_connection(conn_args, data_read_fd(0));
+    closeThread(conn_args);
+
+    return NULL; // will not get here.
+}
+
+/**
+ * Pool worker: serves queued connections one at a time until the queue is closed and drained.
+ */
+void* worker_thread(void * arg) {
+    int readfd = data_read_fd((intptr_t)arg);
+    struct threadArgs *conn_args;
+
+    while ((conn_args = work_queue_pop(&connection_queue)) != NULL) {
+        serve_connection(conn_args, readfd);
+        free(conn_args);
+    }
+    return NULL;
+}
+
+/**
+ * Starts @param count workers fed by a queue of @param depth connections.
+ * @return 0 on success, -1 if the queue or any worker could not be set up
+ */
+static int start_workers(int count, unsigned int depth) {
+    workers = calloc(count, sizeof(pthread_t));
+    if (workers == NULL || work_queue_init(&connection_queue, depth) == -1) {
+        free(workers);
+        return -1;
+    }
+    for (worker_count = 0; worker_count < count; worker_count++) {
+        if (pthread_create(&workers[worker_count], NULL, worker_thread, (void *)(intptr_t)worker_count) != 0) {
+            syslog(LOG_ERR, "Worker %i creation failed", worker_count);
+            return (worker_count > 0) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Lets the workers finish every queued connection, joins them and reports the queue metrics.
+ */
+static void stop_workers(void) {
+    const struct work_queue_stats *stats = &connection_queue.stats;
+
+    work_queue_close(&connection_queue);
+    for (int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // Also on stdout, so a benchmark can collect it
+    printf("Work queue: %lu queued, %lu rejected, max depth %u, wait p50<=%lluus p99<=%lluus max=%lluus mean=%.1fus\n",
+           stats->pushed, stats->rejected, stats->max_depth,
+           work_queue_wait_percentile(stats, 50), work_queue_wait_percentile(stats, 99), stats->wait_max_us,
+           stats->pushed ? (double)stats->wait_total_us / stats->pushed : 0.0);
+    syslog(LOG_NOTICE, "Work queue: %lu queued, %lu rejected, max depth %u, wait max %lluus",
+           stats->pushed, stats->rejected, stats->max_depth, stats->wait_max_us);
+    work_queue_destroy(&connection_queue);
+}
+
+/*
+ * Event-driven connection engine, selected with "-e <threads>".
+ * Instead of one pthread per accepted client, a fixed number of event-loop threads
+ * each own an epoll instance and multiplex all of their client sockets on it.
+ * Every loop registers the (non-blocking) listening socket with EPOLLEXCLUSIVE so the
+ * kernel hands each new connection to only one loop. A connection never changes loops,
+ * so its state below is only ever touched by the thread that owns it.
+ * A loop doesn't wait to store a packet either. It pushes the packet to the writer thread, which
+ * -e always starts, and parks the connection. Once the packet is stored, and in file builds once
+ * the commit queue's flusher has made it durable, that thread queues the connection on the loop's
+ * completed list and wakes the loop through an eventfd in its epoll set. The loop then streams
+ * the history back and carries on with the connection's next packet.
+ */
+#define REACTOR_MAX_THREADS 64
+#define REACTOR_MAX_EVENTS 64
+
+struct reactor_loop;
+
+struct reactor_conn {
+    int fd;
+    char ipaddr[INET_ADDRSTRLEN];
+    struct reactor_loop *loop;
+    // Bytes received but not yet handled as a complete packet
+    struct packet_framer framer;
+    // History being streamed back to the client: the loop's read descriptor while a response
+    // is in progress, otherwise -1
+    int histfd;
+    struct history_snapshot history;
+    off_t hist_pos;
+    bool zero_copy;
+    char chunk[READBACK_CHUNK_SIZE];
+    size_t chunk_len;
+    size_t chunk_sent;
+    // Set while the writer thread or the flusher has the packet in request. Nothing more is
+    // received until it completes, and a hangup meanwhile only sets closing.
+    bool storing;
+    bool closing;
+    struct write_request request;
+#if USE_GROUP_COMMIT
+    struct commit_waiter commit;
+#endif
+    struct reactor_conn *completed_next;
+    // With -K, the loop's connections are kept least recently active first
+    long long last_active_ms;
+    TAILQ_ENTRY(reactor_conn) entries;
+    // On the loop's stalled list while the writer ring has no room for request
+    TAILQ_ENTRY(reactor_conn) stalled_entries;
+};
+TAILQ_HEAD(reactor_conn_list, reactor_conn);
+
+struct reactor_loop {
+    pthread_t thread_id;
+    int epollfd;
+    int readfd;
+    struct reactor_conn_list conns;
+    // Connections whose packets were stored, pushed by the writer or the flusher, and the
+    // eventfd that wakes the loop for them
+    pthread_mutex_t completed_lock;
+    struct reactor_conn *completed;
+    int eventfd;
+    // Connections with a packet being stored, and those among them still waiting for ring room
+    unsigned int storing;
+    struct reactor_conn_list stalled;
+};
+
+static void reactor_close_conn(struct reactor_loop *loop, struct reactor_conn *conn) {
+    TAILQ_REMOVE(&loop->conns, conn, entries);
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if (conn->framer.discarded > 0) {
+        syslog(LOG_WARNING, "Discarded %lu packets longer than %zu bytes from %s", conn->framer.discarded, max_packet_size, conn->ipaddr);
+    }
+    syslog(LOG_NOTICE, "Closed connection from %s\n", conn->ipaddr);
+    packet_framer_free(&conn->framer);
+    free(conn);
+}
+
+/**
+ * Runs on the writer thread or the flusher once @param conn's packet is stored, or has failed to
+ * be: queues the connection for its loop and wakes the loop.
+ */
+static void reactor_complete(struct reactor_conn *conn) {
+    struct reactor_loop *loop = conn->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->completed_lock);
+    conn->completed_next = loop->completed;
+    loop->completed = conn;
+    pthread_mutex_unlock(&loop->completed_lock);
+    if (write(loop->eventfd, &one, sizeof(one)) != sizeof(one)) {
+        syslog(LOG_ERR, "Event loop wakeup failed: %s", strerror(errno));
+    }
+}
+
+#if USE_GROUP_COMMIT
+static void reactor_commit_done(struct commit_waiter *waiter) {
+    struct reactor_conn *conn = waiter->arg;
+
+    if (waiter->rc == -1) {
+        syslog(LOG_ERR, "Sync of data file failed");
+        conn->request.history.end = -1;
+    }
+    reactor_complete(conn);
+}
+#endif
+
+/**
+ * The writer thread's answer to an event loop's packet. A stored packet's sync goes on to the
+ * flusher, anything else goes straight back to the loop.
+ */
+static void reactor_request_stored(struct write_request *request) {
+    struct reactor_conn *conn = request->owner;
+
+#if USE_GROUP_COMMIT
+    if (request->ticket != 0) {
+        commit_queue_wait_async(&data_commits, request->ticket, &conn->commit);
+        return;
+    }
+#endif
+    reactor_complete(conn);
+}
+
+/**
+ * Hands one complete packet to the writer thread and parks @param conn until it is stored.
+ * The packet stays in conn->framer, which receives nothing more until then.
+ */
+static void reactor_start_packet(struct reactor_loop *loop, struct reactor_conn *conn, const char *packet, size_t len) {
+    conn->request.packet = packet;
+    conn->request.len = len;
+    conn->request.history = (struct history_snapshot){ .start = 0, .end = -1 };
+    conn->storing = true;
+    loop->storing++;
+    if (!mpsc_ring_try_push(&writer_ring, &conn->request)) {
+        // The writer is behind, push it again from the loop rather than wait for room here
+        TAILQ_INSERT_TAIL(&loop->stalled, conn, stalled_entries);
+    }
+}
+
+/**
+ * Pushes the packets that found the writer ring full, in the order they arrived.
+ */
+static void reactor_retry_stalled(struct reactor_loop *loop) {
+    struct reactor_conn *conn;
+
+    while ((conn = TAILQ_FIRST(&loop->stalled)) != NULL && mpsc_ring_try_push(&writer_ring, &conn->request)) {
+        TAILQ_REMOVE(&loop->stalled, conn, stalled_entries);
+    }
+}
+
+/**
+ * Streams the history from conn->histfd to the client without blocking.
+ * @return 0 when the whole history was sent, 1 if the socket is full and EPOLLOUT is needed,
+ * -1 on error
+ */
+static int reactor_pump_response(struct reactor_conn *conn) {
+    while (1) {
+#if USE_SENDFILE
+        if (conn->zero_copy && conn->chunk_sent == conn->chunk_len) {
+            off_t remaining = conn->history.end - conn->hist_pos;
+            ssize_t num_sent = (remaining > 0) ? sendfile_history(conn->fd, conn->histfd, &conn->hist_pos, remaining) : 0;
+            if (num_sent == 0) {
+                conn->histfd = -1;
+                return 0;
+            }
+            if (num_sent > 0) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!sendfile_unsupported(errno)) {
+                return -1;
+            }
+            conn->zero_copy = false;
+        }
+#endif
+        if (conn->chunk_sent == conn->chunk_len) {
+            ssize_t num_read = history_snapshot_read(&conn->history, conn->histfd, conn->chunk, sizeof(conn->chunk), &conn->hist_pos);
+            if (num_read == 0) {
+                conn->histfd = -1;
+                return 0;
+            }
+            if (num_read == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            conn->chunk_len = num_read;
+            conn->chunk_sent = 0;
+            conn->hist_pos += num_read;
+        }
+
+        ssize_t num_sent = send(conn->fd, conn->chunk + conn->chunk_sent, conn->chunk_len - conn->chunk_sent, MSG_NOSIGNAL);
+        if (num_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        conn->chunk_sent += num_sent;
+    }
+}
+
+/**
+ * Handles every complete packet waiting in conn->framer, one response at a time.
+ * @return 0 to keep waiting for input, 1 when waiting on EPOLLOUT, 2 when the connection is finished,
+ * 3 when a packet is being stored, -1 on error
+ */
+static int reactor_drive_conn(struct reactor_loop *loop, struct reactor_conn *conn) {
+    int handled = 0;
+
+    while (1) {
+        if (conn->histfd != -1) {
+            int rc = reactor_pump_response(conn);
+            if (rc != 0) {
+                return rc;
+            }
+            handled = 1;
+        }
+
+        const char *packet;
+        size_t packet_len;
+        if (!packet_framer_next(&conn->framer, &packet, &packet_len)) {
+            // Like the thread engine, a connection answers what it was sent and is then closed,
+            // unless -K keeps it open for more
+            return (handled && idle_timeout_ms == 0) ? 2 : 0;
+        }
+
+        syslog(LOG_INFO, "Received data: %.*s", (int)packet_len, packet);
+        reactor_start_packet(loop, conn, packet, packet_len);
+        return 3;
+    }
+}
+
+/**
+ * Closes @param conn, or waits for what reactor_drive_conn() said it needs next, @param rc.
+ */
+static void reactor_wait_for(struct reactor_loop *loop, struct reactor_conn *conn, int rc) {
+    struct epoll_event event = { .events = (rc == 1) ? EPOLLOUT : EPOLLIN, .data.ptr = conn };
+
+    if (rc == -1 || rc == 2) {
+        reactor_close_conn(loop, conn);
+        return;
+    }
+    if (rc == 3) {
+        // Nothing is received meanwhile. A hangup is still reported, once.
+        event.events = EPOLLONESHOT;
+    }
+    epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * Picks @param conn up again once its packet is stored: streams the history to return from the
+ * loop's read descriptor, then goes on with the next packet. Closes it instead if the packet
+ * could not be stored or the client hung up meanwhile.
+ */
+static void reactor_resume_conn(struct reactor_loop *loop, struct reactor_conn *conn) {
+    conn->storing = false;
+    loop->storing--;
+    if (conn->closing || conn->request.history.end == -1) {
+        reactor_close_conn(loop, conn);
+        return;
+    }
+
+    conn->history = conn->request.history;
+    conn->histfd = loop->readfd;
+    conn->hist_pos = conn->history.start;
+    conn->zero_copy = USE_SENDFILE;
+    conn->chunk_len = 0;
+    conn->chunk_sent = 0;
+    reactor_wait_for(loop, conn, reactor_drive_conn(loop, conn));
+}
+
+/**
+ * Takes the connections the writer or the flusher completed since the last wakeup. The eventfd
+ * is read first, so a completion queued after the list is taken wakes the loop again.
+ * @return the connections, linked through completed_next in the order they completed: the
+ * oldest history snapshot is the first the char device evicts
+ */
+static struct reactor_conn *reactor_take_completed(struct reactor_loop *loop) {
+    struct reactor_conn *completed = NULL;
+    struct reactor_conn *conn;
+    uint64_t count;
+
+    if (read(loop->eventfd, &count, sizeof(count)) != sizeof(count)) {
+        syslog(LOG_ERR, "Event loop wakeup read failed: %s", strerror(errno));
+    }
+    pthread_mutex_lock(&loop->completed_lock);
+    conn = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->completed_lock);
+
+    // They were pushed newest first
+    while (conn != NULL) {
+        struct reactor_conn *next = conn->completed_next;
+        conn->completed_next = completed;
+        completed = conn;
+        conn = next;
+    }
+    return completed;
+}
+
+static void reactor_accept(struct reactor_loop *loop) {
+    while (1) {
+        struct sockaddr_storage clientinfo;
+        socklen_t client_addr_size = sizeof(clientinfo);
+        int acceptfd = accept4(sockfd, (struct sockaddr*)&clientinfo, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (acceptfd == -1) {
+            // EAGAIN: another loop took it or the backlog is drained
+            return;
+        }
+
+        struct reactor_conn *conn = calloc(1, sizeof(struct reactor_conn));
+        if (conn == NULL) {
+            syslog(LOG_ERR, "Connection malloc failed");
+            close(acceptfd);
+            continue;
+        }
+        conn->fd = acceptfd;
+        conn->loop = loop;
+        conn->histfd = -1;
+        conn->request.stored = reactor_request_stored;
+        conn->request.owner = conn;
+#if USE_GROUP_COMMIT
+        conn->commit.done = reactor_commit_done;
+        conn->commit.arg = conn;
+#endif
+        packet_framer_init(&conn->framer, max_packet_size);
+        if (clientinfo.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&clientinfo)->sin_addr, conn->ipaddr, sizeof(conn->ipaddr));
+        }
+        else {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&clientinfo)->sin6_addr, conn->ipaddr, sizeof(conn->ipaddr));
+        }
+        syslog(LOG_NOTICE, "Accepted connection from %s\n", conn->ipaddr);
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, acceptfd, &event) == -1) {
+            syslog(LOG_ERR, "epoll_ctl() add failed: %s", strerror(errno));
+            close(acceptfd);
+            free(conn);
+            continue;
+        }
+        conn->last_active_ms = monotonic_ms();
+        TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+        set_keepalive_nodelay(acceptfd);
+    }
+}
+
+/**
+ * With -K, closes the connections of @param loop that have been idle for idle_timeout_ms.
+ * They are kept least recently active first, so only the expired ones are looked at.
+ */
+static void reactor_close_idle(struct reactor_loop *loop) {
+    long long now_ms = monotonic_ms();
+    struct reactor_conn *conn;
+
+    while ((conn = TAILQ_FIRST(&loop->conns)) != NULL && now_ms - conn->last_active_ms >= idle_timeout_ms) {
+        if (conn->storing) {
+            // Waiting for its packet to be stored isn't idle, and the writer still has it
+            conn->last_active_ms = now_ms;
+            TAILQ_REMOVE(&loop->conns, conn, entries);
+            TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+            continue;
+        }
+        syslog(LOG_INFO, "Closing idle connection from %s", conn->ipaddr);
+        reactor_close_conn(loop, conn);
+    }
+}
+
+static void reactor_handle_conn(struct reactor_loop *loop, struct reactor_conn *conn, uint32_t events) {
+    int rc;
+
+    if (idle_timeout_ms > 0) {
+        conn->last_active_ms = monotonic_ms();
+        TAILQ_REMOVE(&loop->conns, conn, entries);
+        TAILQ_INSERT_TAIL(&loop->conns, conn, entries);
+    }
+
+    if (conn->storing) {
+        // The writer or the flusher still has the packet, the connection goes once it's back
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            conn->closing = true;
+        }
+        return;
+    }
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        reactor_close_conn(loop, conn);
+        return;
+    }
+
+    if ((events & EPOLLIN) && conn->histfd == -1) {
+        while (1) {
+            size_t space;
+            char *recvbuf = packet_framer_recv_space(&conn->framer, &space);
+            if (recvbuf == NULL) {
+                syslog(LOG_ERR, "Receive buffer realloc failed");
+                reactor_close_conn(loop, conn);
+                return;
+            }
+
+            ssize_t numrecv = recv(conn->fd, recvbuf, space, 0);
+            if (numrecv == 0) {
+                reactor_close_conn(loop, conn);
+                return;
+            }
+            if (numrecv == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                reactor_close_conn(loop, conn);
+                return;
+            }
+            packet_framer_commit(&conn->framer, numrecv);
+            if (memchr(recvbuf, '\n', numrecv) != NULL) {
+                break;
+            }
+        }
+    }
+
+    rc = reactor_drive_conn(loop, conn);
+    reactor_wait_for(loop, conn, rc);
+}
+
+void* reactor_thread(void * arg) {
+    struct reactor_loop *loop = (struct reactor_loop *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    struct reactor_conn *conn;
+    // Wake up every second to notice an exit signal, or sooner for a shorter idle timeout
+    int wait_ms = (idle_timeout_ms > 0 && idle_timeout_ms < 1000) ? (int)idle_timeout_ms : 1000;
+
+    while (received_exit_signal == 0) {
+        // Packets left out of a full writer ring are pushed again after a millisecond
+        int nevents = epoll_wait(loop->epollfd, events, REACTOR_MAX_EVENTS, TAILQ_EMPTY(&loop->stalled) ? wait_ms : 1);
+        for (int i = 0; i < nevents; i++) {
+            if (events[i].data.ptr == NULL) {
+                reactor_accept(loop);
+            }
+            else if (events[i].data.ptr == loop) {
+                conn = reactor_take_completed(loop);
+                while (conn != NULL) {
+                    struct reactor_conn *next = conn->completed_next;
+                    reactor_resume_conn(loop, conn);
+                    conn = next;
+                }
+            }
+            else {
+                reactor_handle_conn(loop, events[i].data.ptr, events[i].events);
+            }
+        }
+        reactor_retry_stalled(loop);
+        if (idle_timeout_ms > 0) {
+            reactor_close_idle(loop);
+        }
+    }
+
+    // The writer and the flusher may still hold packets of this loop's connections, and would
+    // wake it through its eventfd once done. Wait for them before it goes, dropping the packets
+    // that were never pushed. Blocking is fine now that nothing is served.
+    while ((conn = TAILQ_FIRST(&loop->stalled)) != NULL) {
+        TAILQ_REMOVE(&loop->stalled, conn, stalled_entries);
+        loop->storing--;
+    }
+    while (loop->storing > 0) {
+        for (conn = reactor_take_completed(loop); conn != NULL; conn = conn->completed_next) {
+            loop->storing--;
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+/**
+ * Runs the event-driven engine with @param nthreads event loops until SIGINT or SIGTERM.
+ * @return 0 on a clean exit, 1 on setup failure
+ */
+int run_reactor(int nthreads) {
+    struct reactor_loop loops[REACTOR_MAX_THREADS];
+    int started = 0;
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
+    for (started = 0; started < nthreads; started++) {
+        struct reactor_loop *loop = &loops[started];
+        loop->readfd = data_read_fd(started);
+        TAILQ_INIT(&loop->conns);
+        TAILQ_INIT(&loop->stalled);
+        loop->completed = NULL;
+        loop->storing = 0;
+        loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollfd == -1) {
+            syslog(LOG_ERR, "epoll_create1() failed: %s", strerror(errno));
+            break;
+        }
+        // Blocking, the loop only reads it once epoll says it's readable, or when exiting
+        loop->eventfd = eventfd(0, EFD_CLOEXEC);
+        if (loop->eventfd == -1) {
+            syslog(LOG_ERR, "eventfd() failed: %s", strerror(errno));
+            close(loop->epollfd);
+            break;
+        }
+        pthread_mutex_init(&loop->completed_lock, NULL);
+
+        // data.ptr == NULL marks the listening socket, the loop itself its eventfd
+        struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        struct epoll_event wakeup = { .events = EPOLLIN, .data.ptr = loop };
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, sockfd, &event) == -1 ||
+            epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->eventfd, &wakeup) == -1 ||
+            pthread_create(&loop->thread_id, NULL, reactor_thread, loop) != 0) {
+            syslog(LOG_ERR, "Event loop %i setup failed", started);
+            close(loop->epollfd);
+            close(loop->eventfd);
+            pthread_mutex_destroy(&loop->completed_lock);
+            break;
+        }
+    }
+
+    // Connections still open at exit are reclaimed with the process
+    for (int i = 0; i < started; i++) {
+        pthread_join(loops[i].thread_id, NULL);
+        close(loops[i].epollfd);
+        close(loops[i].eventfd);
+        pthread_mutex_destroy(&loops[i].completed_lock);
+    }
+
+    return (started == nthreads) ? 0 : 1;
 }
 
-// the recursive "entries" member is necessary to use the linked lists from sys/queue.h
-struct Node {
-    pthread_t thread_id;
-    bool is_complete;
-    SLIST_ENTRY(Node) entries;
-    struct Node *next;
+/*
+ * io_uring connection engine, selected with "-u".
+ * One thread drives every connection through a single ring: a multishot accept on the listening
+ * socket, recvs into a group of provided buffers, one writev() of all the packets ready to be
+ * stored, linked to its fdatasync() for the data file, and each history chunk as a read linked
+ * to the send of the same buffer. The char device's packets are stored one at a time, and each
+ * history chunk is read with pread() before its send is queued, so eviction can be checked around
+ * it. Otherwise the loop only enters the kernel through io_uring_enter(), which submits everything
+ * queued and reaps completions in the same call.
+ * Writes are issued one batch at a time, so a history read never overtakes a packet stored
+ * before it, and each batch shares one sync. SEEKTO commands wait in the same queue and are
+ * applied between batches. With -K every recv is linked to a timeout of
+ * idle_timeout_ms, which cancels it when the client stays idle.
+ */
+#define URING_ENTRIES 256
+#define URING_RECV_BUFFERS 64
+#define URING_BUFFER_GROUP 0
+#define URING_BATCH_MAX 64
+
+// user_data is a connection pointer with the operation in its low bits, or just the operation
+enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_PROVIDE,
+    URING_OP_WRITE,
+    URING_OP_FSYNC,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_TIMEOUT,
+    URING_OP_RECV_TIMEOUT,
 };
+#define URING_OP_MASK 15
 
-struct threadArgs {
+struct uring_conn {
+    // Aligned so the operation fits in the low bits of the pointer
+    _Alignas(URING_OP_MASK + 1) int fd;
     char ipaddr[INET_ADDRSTRLEN];
-    int acceptfd;
-    struct Node *thread_node;
+    struct packet_framer framer;
+    // Packet waiting to be stored, it stays valid in the framer until the next recv
+    const char *packet;
+    size_t packet_len;
+    // History being streamed back to the client
+    struct history_snapshot history;
+    off_t hist_pos;
+    char chunk[READBACK_CHUNK_SIZE];
+    size_t chunk_len;
+    size_t chunk_sent;
+    bool answered;
+    bool closing;
+    // Operations submitted and not completed yet, the connection is only freed at 0
+    int inflight;
+    TAILQ_ENTRY(uring_conn) entries;
+};
+TAILQ_HEAD(uring_conn_list, uring_conn);
+
+struct uring_engine {
+    struct uring ring;
+    // data_append_fd, which the engine also reads histories from with positioned reads
+    int datafd;
+    // End of the data file, which only this engine writes while it runs
+    off_t data_size;
+    bool multishot_accept;
+    char *recv_buffers;
+    // Connections with a packet to store, and the batch being written
+    struct uring_conn_list pending;
+    struct uring_conn *batch[URING_BATCH_MAX];
+    struct iovec batch_iov[URING_BATCH_MAX];
+    size_t batch_count;
+    size_t batch_bytes;
+    int batch_written;
+    bool writing;
+    struct __kernel_timespec tick;
+    struct __kernel_timespec idle;
 };
 
-pthread_mutex_t mutex;
-// pthread_mutex_t timer_pause_mutex;
-
-void closeThread(struct threadArgs *args, int caller_line) {
-    // NOTE: Closing the accept file descriptor apparently causes a "Bad file descriptor for other threads"
+/**
+ * Makes room for @param count SQEs that have to be submitted together, like a linked chain:
+ * a chain split across two io_uring_enter() calls loses its link.
+ */
+static void uring_engine_reserve(struct uring_engine *engine, unsigned int count) {
+    if (uring_sq_space(&engine->ring) < count) {
+        uring_submit_and_wait(&engine->ring, 0);
+    }
+}
 
-    // 5g. Logs message to the syslog “Closed connection from XXX” where XXX is the IP address of the connected client.
-    syslog(LOG_NOTICE, "Closed connection from %s\n", args->ipaddr);
+static struct io_uring_sqe *uring_engine_sqe(struct uring_engine *engine, struct uring_conn *conn, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
 
-    // Set a global boolean to signal the end of the thread
-    args->thread_node->is_complete = true;
+    if (sqe == NULL) {
+        // Every slot is queued: hand them to the kernel to make room
+        uring_submit_and_wait(&engine->ring, 0);
+        sqe = uring_get_sqe(&engine->ring);
+    }
+    sqe->user_data = (uintptr_t)conn | op;
+    if (conn != NULL) {
+        conn->inflight++;
+    }
+    return sqe;
+}
 
-    free(args);
-    args = NULL; // to prevent further use of args
+static void uring_arm_accept(struct uring_engine *engine) {
+    struct io_uring_sqe *sqe = uring_engine_sqe(engine, NULL, URING_OP_ACCEPT);
 
-    pthread_exit(NULL);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (engine->multishot_accept) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
 }
 
-void* timer_thread(void * arg) {
-    // Same aesdsocketdata file always.
-    // Needs to dereference the pointer that is passed in.
-    FILE **argfile = (FILE **)arg;
-    FILE* file = *argfile;
+static void uring_arm_timeout(struct uring_engine *engine) {
+    struct io_uring_sqe *sqe = uring_engine_sqe(engine, NULL, URING_OP_TIMEOUT);
 
-    time_t rawtime;
-    struct tm *timeinfo;
-    char timestamp[30] ={0};
+    // Wake up every second to notice an exit signal, which may be delivered to another thread
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&engine->tick;
+    sqe->len = 1;
+}
 
-    // pthread_mutex_lock(&timer_pause_mutex);
+/**
+ * Hands @param count receive buffers from @param bid on back to the kernel
+ */
+static void uring_provide_buffers(struct uring_engine *engine, int bid, int count) {
+    struct io_uring_sqe *sqe = uring_engine_sqe(engine, NULL, URING_OP_PROVIDE);
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t)(engine->recv_buffers + (size_t)bid * READBACK_CHUNK_SIZE);
+    sqe->len = READBACK_CHUNK_SIZE;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->off = bid;
+}
 
-    // Wait for 5 seconds to allow the other tests to finish before adding timestamps to the output file.
-    sleep(5);
+static void uring_arm_recv(struct uring_engine *engine, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe;
+
+    uring_engine_reserve(engine, 2);
+    sqe = uring_engine_sqe(engine, conn, URING_OP_RECV);
+    // The kernel picks a buffer from the group once data is there, idle connections hold none
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = READBACK_CHUNK_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    if (idle_timeout_ms > 0) {
+        // The recv completes with -ECANCELED if nothing arrives in time
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_engine_sqe(engine, conn, URING_OP_RECV_TIMEOUT);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (uintptr_t)&engine->idle;
+        sqe->len = 1;
+    }
+}
 
-    while (received_exit_signal == 0) {
-        // Check every second for an exit signal
-        for (int sec = 0; sec < 10; sec++) {
-            if (received_exit_signal == 0) {sleep(1);}
-            else {break;}
+static void uring_close_conn(struct uring_conn *conn) {
+    if (!conn->closing) {
+        conn->closing = true;
+        close(conn->fd);
+        if (conn->framer.discarded > 0) {
+            syslog(LOG_WARNING, "Discarded %lu packets longer than %zu bytes from %s", conn->framer.discarded, max_packet_size, conn->ipaddr);
         }
-
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
-        strftime(timestamp, sizeof(timestamp), "timestamp:%Y-%m-%d %H:%M:%S\n", timeinfo);
-
-        fwrite(&timestamp, sizeof(char), 30, file);
-        pthread_mutex_lock(&mutex);
-        fflush(file); // push the data to the file
-        pthread_mutex_unlock(&mutex);
+        syslog(LOG_NOTICE, "Closed connection from %s\n", conn->ipaddr);
+    }
+    if (conn->inflight == 0) {
+        packet_framer_free(&conn->framer);
+        free(conn);
     }
+}
 
-    // pthread_mutex_unlock(&timer_pause_mutex);
+static void uring_drive_conn(struct uring_engine *engine, struct uring_conn *conn);
 
-    // DON'T free the file here!
-    pthread_exit(NULL);
+static void uring_send_rest(struct uring_engine *engine, struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_engine_sqe(engine, conn, URING_OP_SEND);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->chunk + conn->chunk_sent);
+    sqe->len = conn->chunk_len - conn->chunk_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
 }
 
-void* connection_thread(void * arg) {
+/**
+ * Sends the next chunk of conn's history: a read linked to the send of the same buffer for the
+ * data file, whose reads below its end are always whole. The char device is read in place first,
+ * skipping what was evicted, and only the send is submitted.
+ */
+static void uring_pump_response(struct uring_engine *engine, struct uring_conn *conn) {
+    size_t want = sizeof(conn->chunk);
+
+#if USE_AESD_CHAR_DEVICE
+    ssize_t num_read = history_snapshot_read(&conn->history, engine->datafd, conn->chunk, want, &conn->hist_pos);
+    if (num_read == -1) {
+        uring_close_conn(conn);
+        return;
+    }
+    if (num_read > 0) {
+        conn->chunk_len = num_read;
+        conn->chunk_sent = 0;
+        uring_send_rest(engine, conn);
+        return;
+    }
+#endif
+    if (conn->hist_pos >= conn->history.end) {
+        conn->answered = true;
+        uring_drive_conn(engine, conn);
+        return;
+    }
+    if ((off_t)want > conn->history.end - conn->hist_pos) {
+        want = conn->history.end - conn->hist_pos;
+    }
 
-    // Unpack the conn_args
-    struct threadArgs *conn_args = (struct threadArgs *)arg;
-    syslog(LOG_DEBUG, "Connection thread started for %s\n", conn_args->ipaddr);
-    // 5e. Receives data over the connection and appends to file /var/tmp/aesdsocketdata, creating this file if it doesn’t exist.
-    /*
-    Your implementation should use a newline to separate data packets received.
-    In other words a packet is considered complete when a newline character is found in the input receive stream,
-    and each newline should result in an append to the /var/tmp/aesdsocketdata file.
-    You may assume the data stream does not include null characters (therefore can be processed using string handling functions).
-    You may assume the length of the packet will be shorter than the available heap size.
-    In other words, as long as you handle malloc() associated failures with error messages you may discard associated over-length packets.
-    */
-    // char sockbuf[MAX_BUF_LEN];
-    char sockbuffull[1024]; // 1024 is the max size of the buffer
-    char newlinechar;
-    memcpy(&newlinechar, "\n", 1);
-    ssize_t numrecv;
-    int openfd = 0;
-
-    // Write to /var/tmp/aesdsocketdata under protection of the mutex
-    pthread_mutex_lock(&mutex);
+#if !USE_AESD_CHAR_DEVICE
+    struct io_uring_sqe *sqe;
+
+    uring_engine_reserve(engine, 2);
+    sqe = uring_engine_sqe(engine, conn, URING_OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = engine->datafd;
+    sqe->addr = (uintptr_t)conn->chunk;
+    sqe->len = want;
+    sqe->off = conn->hist_pos;
+    conn->chunk_len = want;
+    conn->chunk_sent = 0;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_engine_sqe(engine, conn, URING_OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn->chunk;
+    sqe->len = want;
+    sqe->msg_flags = MSG_NOSIGNAL;
+#endif
+}
 
-    // Try receiving all at once to handle when receving AESDCHAR_IOCSEEKTO string
-    numrecv = recv(conn_args->acceptfd, sockbuffull, 1024, 0);
-    if (numrecv == 0 || numrecv == -1) {
-        syslog(LOG_ERR, "Socket recv() received an error: %i", (int)numrecv);
-        perror("Recv Error");
-        closeThread(conn_args, __LINE__);
+/**
+ * Applies the "AESDCHAR_IOCSEEKTO:X,Y" command of pending @param conn and starts its response.
+ * Only called with no write in flight: the ioctl moves data_append_fd's file position, which an
+ * IORING_OP_WRITEV at offset -1 moves too, and the history snapshot has to follow the writes
+ * queued before the command.
+ */
+static void uring_apply_seekto(struct uring_engine *engine, struct uring_conn *conn) {
+    TAILQ_REMOVE(&engine->pending, conn, entries);
+    if (apply_seekto(conn->packet, &conn->history) == -1) {
+        uring_close_conn(conn);
+        return;
+    }
+    conn->hist_pos = conn->history.start;
+    uring_pump_response(engine, conn);
+}
+
+/**
+ * Writes the packets of up to URING_BATCH_MAX pending connections with one writev(),
+ * followed by one fdatasync() for the data file. Without USE_BATCHED_APPENDS only the first.
+ * Commands queued ahead of them are applied first, and a batch stops at the next one.
+ */
+static void uring_submit_batch(struct uring_engine *engine) {
+    struct io_uring_sqe *sqe;
+    struct uring_conn *conn;
+
+    // A command's response may start the next batch itself, through uring_drive_conn()
+    while ((conn = TAILQ_FIRST(&engine->pending)) != NULL && !engine->writing &&
+           is_seekto_packet(conn->packet, conn->packet_len)) {
+        uring_apply_seekto(engine, conn);
+    }
+    if (conn == NULL || engine->writing) {
+        return;
     }
-    // sockbuffull[numrecv] = '\0'; // null terminate the string
-    // numrecv += 1;
-    syslog(LOG_INFO, "Received data: %s", sockbuffull);
 
-#ifdef USE_AESD_CHAR_DEVICE
-    openfd = open("/dev/aesdchar",  O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IROTH);
+    engine->batch_count = 0;
+    engine->batch_bytes = 0;
+    while (engine->batch_count < (USE_BATCHED_APPENDS ? URING_BATCH_MAX : 1) &&
+           (conn = TAILQ_FIRST(&engine->pending)) != NULL && !is_seekto_packet(conn->packet, conn->packet_len)) {
+        TAILQ_REMOVE(&engine->pending, conn, entries);
+        engine->batch_iov[engine->batch_count].iov_base = (void *)conn->packet;
+        engine->batch_iov[engine->batch_count].iov_len = conn->packet_len;
+        engine->batch[engine->batch_count++] = conn;
+        engine->batch_bytes += conn->packet_len;
+        // The batch holds a reference until it completes
+        conn->inflight++;
+    }
+    engine->writing = true;
+
+    uring_engine_reserve(engine, 2);
+    sqe = uring_engine_sqe(engine, NULL, URING_OP_WRITE);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = engine->datafd;
+    sqe->addr = (uintptr_t)engine->batch_iov;
+    sqe->len = engine->batch_count;
+#if USE_AESD_CHAR_DEVICE
+    // The driver appends whatever the offset, -1 uses the file position
+    sqe->off = (uint64_t)-1;
 #else
-    file = fopen("/var/tmp/aesdsocketdata", "a+");
+    sqe->off = engine->data_size;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_engine_sqe(engine, NULL, URING_OP_FSYNC);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = engine->datafd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
 #endif
+}
 
-    if (!openfd || openfd == -1) {
-        syslog(LOG_ERR, "File didn't open\n");
-        printf("File didn't open\n\n");
-        exit(1);
+/**
+ * Answers the connections of the batch just written, or closes them if @param ok is false,
+ * and starts the next batch. Each history ends with the connection's own packet.
+ */
+static void uring_finish_batch(struct uring_engine *engine, bool ok) {
+    off_t history_end = -1;
+    off_t after = 0;
+
+    if (engine->batch_written > 0) {
+#if USE_AESD_CHAR_DEVICE
+        history_end = lseek(engine->datafd, 0, SEEK_END);
+#else
+        // Keep the offset in step with the file even after a short write
+        engine->data_size += engine->batch_written;
+        history_end = engine->data_size;
+#endif
+    }
+    if (!ok || history_end == -1) {
+        syslog(LOG_ERR, "Write to file failed: %s", strerror(engine->batch_written < 0 ? -engine->batch_written : EIO));
+    }
+    else {
+        syslog(LOG_INFO, "Wrote %zu packets to file", engine->batch_count);
     }
 
-    // Received "AESDCHAR_IOCSEEKTO:X,Y"
-    if (strncmp(sockbuffull, ioctl_str, strlen(ioctl_str)) == 0) {
-        syslog(LOG_INFO, "Received ioctl string");
+    for (size_t i = engine->batch_count; i-- > 0; ) {
+        struct uring_conn *conn = engine->batch[i];
+        conn->inflight--;
+        if (!ok || history_end == -1 || conn->closing) {
+            uring_close_conn(conn);
+            continue;
+        }
+        conn->history.start = 0;
+        conn->history.end = history_end - after;
+        after += conn->packet_len;
+        if (history_snapshot_take(&conn->history) == -1) {
+            uring_close_conn(conn);
+            continue;
+        }
+        conn->hist_pos = conn->history.start;
+        uring_pump_response(engine, conn);
+    }
 
-        struct aesd_seekto aesd_seekto_data;
-        sscanf(sockbuffull, "AESDCHAR_IOCSEEKTO:%d,%d", &aesd_seekto_data.write_cmd, &aesd_seekto_data.write_cmd_offset);
+    engine->writing = false;
+    if (!TAILQ_EMPTY(&engine->pending)) {
+        uring_submit_batch(engine);
+    }
+}
 
-        if(ioctl(openfd, AESDCHAR_IOCSEEKTO, &aesd_seekto_data) != 0) {
-            perror("ioctl() failed");
-            syslog(LOG_ERR, "ioctl() failed");
-            exit(1);
+/**
+ * Handles the next complete packet in conn's framer: queues it to be stored, or to be applied as
+ * an "AESDCHAR_IOCSEEKTO:X,Y" command, in order with the other writes. Without one, waits for
+ * more input, or closes the connection once it has been answered, like the other engines.
+ */
+static void uring_drive_conn(struct uring_engine *engine, struct uring_conn *conn) {
+    const char *packet;
+    size_t packet_len;
+
+    if (!packet_framer_next(&conn->framer, &packet, &packet_len)) {
+        if (conn->answered && idle_timeout_ms == 0) {
+            uring_close_conn(conn);
         }
-    }
-    else {
-        // Write to the file
-        // if (fwrite(&sockbuf1byte, sizeof(char), 1, conn_args->file) == 0) {
-        if (write(openfd, &sockbuffull, numrecv) == -1) {
-            syslog(LOG_ERR, "Write to file failed.");
-            perror("Write Error");
-            closeThread(conn_args, __LINE__);
+        else {
+            uring_arm_recv(engine, conn);
         }
-        syslog(LOG_INFO, "Wrote to file: %s", sockbuffull);
-
-        // fflush(conn_args->file); // fwrite() needs to be flushed after it's called to immediately write to the file
-        fsync(openfd); //  write() needs to be flushed after it's called to immediately write to the file
+        return;
+    }
+    syslog(LOG_INFO, "Received data: %.*s", (int)packet_len, packet);
 
-        // In a normal write, can move file position to the beginning since not calling ioctl
-        off_t current_position = lseek(openfd, 0, SEEK_SET);
-        syslog(LOG_INFO, "Moved file position to the beginning: %lld\n", (long long) current_position);
+    conn->packet = packet;
+    conn->packet_len = packet_len;
+    TAILQ_INSERT_TAIL(&engine->pending, conn, entries);
+    if (!engine->writing) {
+        uring_submit_batch(engine);
     }
+}
 
-    // 5f. Returns the full content of /var/tmp/aesdsocketdata to the client as soon as the received data packet completes.
-    /* You may assume the total size of all packets sent
-    (and therefore size of /var/tmp/aesdsocketdata) will be less than the size
-    of the root filesystem, however you may not assume this total size of all
-    packets sent will be less than the size of the available RAM for the process heap.
-    */
+static void uring_accepted(struct uring_engine *engine, int acceptfd) {
+    struct sockaddr_storage clientinfo;
+    socklen_t client_addr_size = sizeof(clientinfo);
+    struct uring_conn *conn = calloc(1, sizeof(struct uring_conn));
 
-    char readbuf[100] = {0}; // the sockettest.sh for asy6.1 works better with this as 30 chars
-    ssize_t num_read;
-    ssize_t total_read = 0;
-    int i = 0;
+    if (conn == NULL) {
+        syslog(LOG_ERR, "Connection malloc failed");
+        close(acceptfd);
+        return;
+    }
+    conn->fd = acceptfd;
+    packet_framer_init(&conn->framer, max_packet_size);
+    // A multishot accept shares no address buffer between connections, ask for it instead
+    if (getpeername(acceptfd, (struct sockaddr *)&clientinfo, &client_addr_size) == 0) {
+        if (clientinfo.ss_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&clientinfo)->sin_addr, conn->ipaddr, sizeof(conn->ipaddr));
+        }
+        else {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&clientinfo)->sin6_addr, conn->ipaddr, sizeof(conn->ipaddr));
+        }
+    }
+    syslog(LOG_NOTICE, "Accepted connection from %s\n", conn->ipaddr);
+    set_keepalive_nodelay(acceptfd);
+    uring_arm_recv(engine, conn);
+}
 
-    // LSEEK always returns -1 with my character device. Will not work!
-    // int lseekerr = lseek(openfd, 0, SEEK_SET);
-    // if (lseekerr == -1 || lseekerr) { // has to respond with 0 since I'm moving to the beginning of the file
-    //     perror("lseek error");
-    //     exit(1);
-    // }
+static void uring_received(struct uring_engine *engine, struct uring_conn *conn, int res, unsigned int flags) {
+    if (res == -ENOBUFS) {
+        // Every buffer is being copied out, they are provided again in this same submission
+        uring_arm_recv(engine, conn);
+        return;
+    }
+    if (res == -ECANCELED) {
+        syslog(LOG_INFO, "Closing idle connection from %s", conn->ipaddr);
+    }
+    if (res <= 0) {
+        uring_close_conn(conn);
+        return;
+    }
 
-    // /dev/aesdchar cannot use lseek() to move to the beginning of the file. So need to close and reopen the file instead
-    // to reset the file pointer to the beginning of the file.
-    // FIXME: Asy9 says I can't do this
-    // close(openfd);
-    // syslog(LOG_INFO, "_______________Closed file: %i", openfd);
-    // openfd = open("/dev/aesdchar", O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IROTH);
-    // if (openfd == -1)
-    // {
-    //     perror("Open failed");
-    // }
-    // syslog(LOG_INFO, "_______________Opened file: %i", openfd);
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    size_t space;
+    char *recvbuf = packet_framer_recv_space(&conn->framer, &space);
+    if (recvbuf == NULL) {
+        syslog(LOG_ERR, "Receive buffer realloc failed");
+        uring_provide_buffers(engine, bid, 1);
+        uring_close_conn(conn);
+        return;
+    }
+    // The framer always has room for READBACK_CHUNK_SIZE bytes, a whole provided buffer
+    memcpy(recvbuf, engine->recv_buffers + (size_t)bid * READBACK_CHUNK_SIZE, res);
+    packet_framer_commit(&conn->framer, res);
+    uring_provide_buffers(engine, bid, 1);
+    uring_drive_conn(engine, conn);
+}
 
-    // Read from the full file (based off current file pointer position)
-    syslog(LOG_INFO, "Start read");
-    off_t current_position = lseek(openfd, 0, SEEK_CUR);
-    if (current_position == (off_t) -1) {
-        perror("lseek error");
-        exit(1);
-    } else {
-        syslog(LOG_INFO, "The current file position is %lld\n", (long long) current_position);
+static void uring_handle_completion(struct uring_engine *engine, uint64_t user_data, int res, unsigned int flags) {
+    enum uring_op op = user_data & URING_OP_MASK;
+    struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+    if (conn != NULL) {
+        conn->inflight--;
+        if (conn->closing) {
+            uring_close_conn(conn);
+            return;
+        }
     }
 
-    do {
-        // num_read = fread(&readbuf, sizeof(char), 1, conn_args->file);
-        num_read = read(openfd, &readbuf[i], 1);
-        // if (feof(conn_args->file)) {
-        if (num_read == 0) {
-            syslog(LOG_INFO, "End of file reached");
+    switch (op) {
+    case URING_OP_ACCEPT:
+        if (res >= 0) {
+            uring_accepted(engine, res);
+        }
+        else if (res == -EINVAL && engine->multishot_accept) {
+            // Kernels before 5.19 have no multishot accept
+            engine->multishot_accept = false;
+        }
+        if (!(flags & IORING_CQE_F_MORE) && received_exit_signal == 0) {
+            uring_arm_accept(engine);
+        }
+        break;
+    case URING_OP_RECV:
+        uring_received(engine, conn, res, flags);
+        break;
+    case URING_OP_PROVIDE:
+        if (res < 0) {
+            syslog(LOG_ERR, "Providing receive buffers failed: %s", strerror(-res));
+        }
+        break;
+    case URING_OP_WRITE:
+        engine->batch_written = res;
+#if USE_AESD_CHAR_DEVICE
+        uring_finish_batch(engine, res == (int)engine->batch_bytes);
+#endif
+        break;
+    case URING_OP_FSYNC:
+        // Cancelled when the linked write failed or was short
+        uring_finish_batch(engine, res == 0 && engine->batch_written == (int)engine->batch_bytes);
+        break;
+    case URING_OP_READ:
+        // Only the data file is read, and the linked send reports the outcome
+        break;
+    case URING_OP_SEND:
+        if (res < 0) {
+            // Also -ECANCELED when the linked read came back short
+            uring_close_conn(conn);
+            break;
+        }
+        conn->chunk_sent += res;
+        if (conn->chunk_sent < conn->chunk_len) {
+            uring_send_rest(engine, conn);
             break;
         }
-        total_read += num_read;
-        i++;
-    } while (num_read > 0);
+        conn->hist_pos += conn->chunk_len;
+        uring_pump_response(engine, conn);
+        break;
+    case URING_OP_TIMEOUT:
+        if (received_exit_signal == 0) {
+            uring_arm_timeout(engine);
+        }
+        break;
+    case URING_OP_RECV_TIMEOUT:
+        // -ETIME when it cancelled the idle recv, which closes the connection
+        break;
+    }
+}
 
-    // Send the data back across the socket
-    if (send(conn_args->acceptfd, readbuf, total_read, 0) == -1) {
-        syslog(LOG_ERR, "Send failed");
-        closeThread(conn_args, __LINE__);
+/**
+ * Runs the io_uring engine until SIGINT or SIGTERM.
+ * @return 0 on a clean exit, 1 on an error while serving, or -1 if io_uring is unavailable here
+ * and nothing was started, so the caller can fall back to another engine
+ */
+int run_uring(void) {
+    static const int needed_ops[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_WRITEV,
+        IORING_OP_FSYNC, IORING_OP_PROVIDE_BUFFERS, IORING_OP_TIMEOUT, IORING_OP_LINK_TIMEOUT,
+    };
+    struct uring_engine engine;
+    struct io_uring_cqe *cqe;
+    int rc = 0;
+
+    memset(&engine, 0, sizeof(engine));
+    TAILQ_INIT(&engine.pending);
+    engine.multishot_accept = true;
+    engine.tick.tv_sec = 1;
+    engine.idle.tv_sec = idle_timeout_ms / 1000;
+    engine.idle.tv_nsec = (idle_timeout_ms % 1000) * 1000000;
+    if (uring_init(&engine.ring, URING_ENTRIES) == -1) {
+        syslog(LOG_WARNING, "io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+    if (!uring_supports(&engine.ring, needed_ops, sizeof(needed_ops) / sizeof(needed_ops[0])) ||
+        !(engine.ring.features & IORING_FEAT_RW_CUR_POS)) {
+        syslog(LOG_WARNING, "io_uring lacks the operations needed");
+        uring_exit(&engine.ring);
+        return -1;
     }
-    syslog(LOG_INFO, "Sent back to socket: %s", readbuf);
+    engine.recv_buffers = malloc((size_t)URING_RECV_BUFFERS * READBACK_CHUNK_SIZE);
+    engine.datafd = data_append_fd;
+    if (engine.recv_buffers == NULL) {
+        syslog(LOG_ERR, "io_uring engine setup failed: %s", strerror(errno));
+        free(engine.recv_buffers);
+        uring_exit(&engine.ring);
+        return 1;
+    }
+#if USE_AESD_CHAR_DEVICE == 0
+    engine.data_size = lseek(engine.datafd, 0, SEEK_END);
+#endif
+
+    uring_provide_buffers(&engine, 0, URING_RECV_BUFFERS);
+    uring_arm_accept(&engine);
+    uring_arm_timeout(&engine);
 
-    pthread_mutex_unlock(&mutex); // Don't put mutex functions in do-while loops
+    while (received_exit_signal == 0) {
+        if (uring_submit_and_wait(&engine.ring, 1) == -1 && errno != EINTR && errno != EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter() failed: %s", strerror(errno));
+            rc = 1;
+            break;
+        }
+        while ((cqe = uring_peek_cqe(&engine.ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(&engine.ring);
+            uring_handle_completion(&engine, user_data, res, flags);
+        }
+    }
 
-    closeThread(conn_args, __LINE__);
+    syslog(LOG_NOTICE, "io_uring engine: %lu io_uring_enter() calls", engine.ring.enters);
+    // Connections still open at exit are reclaimed with the process, closing the ring cancels their operations
+    uring_exit(&engine.ring);
+    free(engine.recv_buffers);
+    return rc;
+}
 
-    return NULL; // will not get here.
+/**
+ * Stops the data file's commit queue, once no connection can write anymore
+ */
+static void stop_data_commits(void) {
+#if USE_GROUP_COMMIT
+    if (log_dir == NULL) {
+        syslog(LOG_NOTICE, "Data file: %lu commits in %lu syncs, largest batch %lu",
+               data_commits.stats.commits, data_commits.stats.syncs, data_commits.stats.max_batch);
+        commit_queue_stop(&data_commits);
+    }
+#endif
+}
+
+/**
+ * Opens data_append_fd and @param readers read descriptors on AESD_DATA_PATH, which stay open
+ * until close_data_fds(). With none, histories are read through data_append_fd.
+ * @return 0 on success, -1 with errno set
+ */
+static int open_data_fds(int readers) {
+    data_append_fd = open(AESD_DATA_PATH, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IROTH);
+    if (data_append_fd == -1) {
+        return -1;
+    }
+    data_read_fd_count = 0;
+    if (readers == 0) {
+        return 0;
+    }
+    data_read_fds = calloc(readers, sizeof(int));
+    if (data_read_fds == NULL) {
+        return -1;
+    }
+    for (data_read_fd_count = 0; data_read_fd_count < readers; data_read_fd_count++) {
+        data_read_fds[data_read_fd_count] = open(AESD_DATA_PATH, O_RDONLY | O_CLOEXEC);
+        if (data_read_fds[data_read_fd_count] == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_data_fds(void) {
+    for (int i = 0; i < data_read_fd_count; i++) {
+        close(data_read_fds[i]);
+    }
+    free(data_read_fds);
+    data_read_fds = NULL;
+    data_read_fd_count = 0;
+    if (data_append_fd != -1) {
+        close(data_append_fd);
+        data_append_fd = -1;
+    }
 }
 
 int main (int argc, char *argv[]) {
+    bool run_as_daemon = false;
+    int reactor_threads = 0; // 0 = one thread per connection
+    long commit_window_us = 0;
+    size_t segment_size = DEFAULT_SEGMENT_SIZE;
+    unsigned int segments_kept = DEFAULT_SEGMENTS_KEPT;
+    int pool_workers = 0;
+    unsigned int queue_depth = DEFAULT_QUEUE_DEPTH;
+    bool reject_when_full = false;
+    bool use_uring = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "de:m:l:g:s:k:w:q:RWuK:")) != -1) {
+        switch (opt) {
+        case 'd':
+            run_as_daemon = true;
+            break;
+        case 'e':
+            reactor_threads = atoi(optarg);
+            if (reactor_threads < 1 || reactor_threads > REACTOR_MAX_THREADS) {
+                fprintf(stderr, "-e needs between 1 and %d event-loop threads\n", REACTOR_MAX_THREADS);
+                exit(1);
+            }
+            break;
+        case 'm':
+            max_packet_size = strtoul(optarg, NULL, 10);
+            if (max_packet_size < 1) {
+                fprintf(stderr, "-m needs a maximum packet size of at least 1 byte\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            log_dir = optarg;
+            break;
+        case 'g':
+            // Applies to the data file and to the segment log
+            commit_window_us = strtol(optarg, NULL, 10);
+            if (commit_window_us < 0 || commit_window_us > 1000000) {
+                fprintf(stderr, "-g needs a group commit window between 0 and 1000000 usec\n");
+                exit(1);
+            }
+            break;
+        case 's':
+            segment_size = strtoul(optarg, NULL, 10);
+            if (segment_size < 1) {
+                fprintf(stderr, "-s needs a segment size of at least 1 byte\n");
+                exit(1);
+            }
+            break;
+        case 'k':
+            segments_kept = strtoul(optarg, NULL, 10);
+            if (segments_kept < 1) {
+                fprintf(stderr, "-k needs to keep at least 1 segment\n");
+                exit(1);
+            }
+            break;
+        case 'w':
+            pool_workers = atoi(optarg);
+            if (pool_workers < 1 || pool_workers > MAX_WORKERS) {
+                fprintf(stderr, "-w needs between 1 and %d worker threads\n", MAX_WORKERS);
+                exit(1);
+            }
+            break;
+        case 'q':
+            queue_depth = strtoul(optarg, NULL, 10);
+            if (queue_depth < 1) {
+                fprintf(stderr, "-q needs a queue depth of at least 1 connection\n");
+                exit(1);
+            }
+            break;
+        case 'R':
+            reject_when_full = true;
+            break;
+        case 'W':
+            use_writer_thread = true;
+            break;
+        case 'u':
+            use_uring = true;
+            break;
+        case 'K':
+            idle_timeout_ms = strtol(optarg, NULL, 10);
+            if (idle_timeout_ms < 1) {
+                fprintf(stderr, "-K needs an idle timeout of at least 1 msec\n");
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-e event_loop_threads | -w workers [-q queue_depth] [-R] | -u] [-K idle_timeout_msec] "
+                    "[-m max_packet_bytes] [-g commit_window_usec] [-W | -l log_dir [-s segment_bytes] [-k segments_kept]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (pool_workers > 0 && reactor_threads > 0) {
+        fprintf(stderr, "-w can't be combined with -e\n");
+        exit(1);
+    }
+    // The io_uring engine is a connection engine of its own that does its own writes
+    if (use_uring && (reactor_threads > 0 || pool_workers > 0 || use_writer_thread || log_dir != NULL)) {
+        fprintf(stderr, "-u can't be combined with -e, -w, -W or -l\n");
+        exit(1);
+    }
+    // The segment log has its own lock and group commit, the writer thread only feeds AESD_DATA_PATH
+    if (use_writer_thread && log_dir != NULL) {
+        fprintf(stderr, "-W can't be combined with -l\n");
+        exit(1);
+    }
+    // The event loops stream from AESD_DATA_PATH without blocking, the log is only wired into the thread engine
+    if (log_dir != NULL && reactor_threads > 0) {
+        fprintf(stderr, "-l can't be combined with -e\n");
+        exit(1);
+    }
+    // The event loops never wait for a packet to be stored, the writer thread wakes them once it is
+    if (reactor_threads > 0) {
+        use_writer_thread = true;
+    }
+
     // 5. Modify your program to support a -d argument which runs the aesdsocket application as a daemon.
     // When in daemon mode the program should fork after ensuring it can bind to port 9000.
-    if (argc == 2) {
+    if (run_as_daemon) {
         syslog(LOG_ERR, "Start daemon\n");
         // TODO: Fill in the daemon here
 
-        if (strcmp(argv[1], "-d") == 0) {
+        {
             syslog(LOG_NOTICE, "About to fork the process");
             int pid = fork();
             if (pid == -1) {
@@ -342,6 +2322,46 @@ int main (int argc, char *argv[]) {
 
     syslog(LOG_NOTICE, "-------- New log --------");
 
+    // Every connection engine shares these instead of opening the data path per request.
+    // The segment log keeps its own descriptors.
+    if (log_dir == NULL) {
+        int readers = (reactor_threads > pool_workers) ? reactor_threads : pool_workers;
+#if USE_AESD_CHAR_DEVICE
+        // Every open descriptor holds a struct aesd_file in the driver, read through data_append_fd
+        readers = 0;
+#else
+        readers = (readers > 0) ? readers : 1;
+#endif
+        if (open_data_fds(readers) == -1) {
+            syslog(LOG_ERR, "%s didn't open: %s", AESD_DATA_PATH, strerror(errno));
+            exit(1);
+        }
+    }
+
+    // Recover the packets a previous run stored before accepting new ones
+    if (log_dir != NULL) {
+        if (segment_log_open(&packet_log, log_dir, segment_size, segments_kept, commit_window_us) == -1) {
+            syslog(LOG_ERR, "Segment log %s didn't open: %s", log_dir, strerror(errno));
+            exit(1);
+        }
+        syslog(LOG_NOTICE, "Recovered %lu packets (%llu bytes) from %s, cut %llu torn bytes",
+               packet_log.stats.recovered_packets, packet_log.stats.recovered_bytes, log_dir,
+               packet_log.stats.truncated_bytes);
+    }
+#if USE_GROUP_COMMIT
+    else {
+        // The flusher syncs the descriptor every append goes through
+        if (commit_queue_start(&data_commits, data_append_fd, commit_window_us) == -1) {
+            syslog(LOG_ERR, "Commit queue didn't start: %s", strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+    if (use_writer_thread && start_writer() == -1) {
+        syslog(LOG_ERR, "Writer thread didn't start: %s", strerror(errno));
+        exit(1);
+    }
+
     // Set up new_action that points to the signal_handler function (vid3.10)
     struct sigaction new_action;
     memset(&new_action, 0, sizeof(struct sigaction));
@@ -404,9 +2424,39 @@ int main (int argc, char *argv[]) {
     // Prevent the timer thread from running until a connection is accepted.
     // pthread_mutex_lock(&timer_pause_mutex);
 
+    if (use_uring) {
+        printf("Using the io_uring engine\n");
+        int uring_rc = run_uring();
+        if (uring_rc != -1) {
+            stop_data_commits();
+            close_data_fds();
+            printf("Caught signal, exiting\n");
+            return uring_rc;
+        }
+        printf("io_uring is unavailable, using a thread per connection\n");
+    }
+
+    if (reactor_threads > 0) {
+        printf("Using %i event-loop threads\n", reactor_threads);
+        int reactor_rc = run_reactor(reactor_threads);
+        stop_writer();
+        stop_data_commits();
+        close_data_fds();
+        printf("Caught signal, exiting\n");
+        return reactor_rc;
+    }
+
+    if (pool_workers > 0) {
+        if (start_workers(pool_workers, queue_depth) == -1) {
+            syslog(LOG_ERR, "Worker pool didn't start");
+            return 1;
+        }
+        printf("Using %i workers, %u queued connections at most\n", worker_count, queue_depth);
+    }
+
     // Initialize the head of the linked list
     struct Node *myNode = NULL;
-    SLIST_HEAD(ListHead, Node) head = SLIST_HEAD_INITIALIZER(head);
+    struct ListHead head = SLIST_HEAD_INITIALIZER(head);
     SLIST_INIT(&head);
 
     // Starts the timer thread only on the first connection
@@ -419,12 +2469,7 @@ int main (int argc, char *argv[]) {
         if (acceptfd == -1) {
             printf("Failed in attempt to accept client connection\n");
 
-            SLIST_FOREACH(myNode, &head, entries) {
-                if (myNode->is_complete) {
-                    pthread_join(myNode->thread_id, NULL);
-                    syslog(LOG_ERR, "Thread %li joined.", myNode->thread_id);
-                }
-            }
+            join_connection_threads(&head, false);
             continue;
         }
         // printf("--- Connection Accepted. Timer can start now.\n");
@@ -455,11 +2500,6 @@ int main (int argc, char *argv[]) {
         // 5d. Logs message to the syslog “Accepted connection from xxx” where XXXX is the IP address of the connected client.
         syslog(LOG_NOTICE, "Accepted connection from %s\n", ipaddr);
 
-        // malloc memory for each node created. Will be freed with SLIST_REMOVE()
-        myNode = (struct Node *)malloc(sizeof(struct Node));
-        myNode->is_complete = false;
-        myNode->thread_id = 0;
-
         // Set up and malloc the args to pass in to the thread.
         struct threadArgs *args;
         args = (struct threadArgs *)malloc(sizeof(struct threadArgs));
@@ -467,6 +2507,23 @@ int main (int argc, char *argv[]) {
         // Fill in the args with the current context
         strncpy(args->ipaddr, ipaddr, INET_ADDRSTRLEN);
         args->acceptfd = acceptfd;
+        args->thread_node = NULL;
+
+        if (worker_count > 0) {
+            // When the queue is full this waits for a worker, and new clients wait in the listen
+            // backlog, unless -R asked to close them straight away
+            if (work_queue_push(&connection_queue, args, !reject_when_full) == -1) {
+                syslog(LOG_WARNING, "Rejected connection from %s, %u connections already queued", ipaddr, queue_depth);
+                close(acceptfd);
+                free(args);
+            }
+            continue;
+        }
+
+        // malloc memory for each node created. Freed by join_connection_threads() once the thread is joined
+        myNode = (struct Node *)malloc(sizeof(struct Node));
+        myNode->is_complete = false;
+        myNode->thread_id = 0;
         args->thread_node = myNode;
 
         if (pthread_create(&myNode->thread_id, NULL, connection_thread, args) != 0) {
@@ -476,28 +2533,27 @@ int main (int argc, char *argv[]) {
 
         SLIST_INSERT_HEAD(&head, myNode, entries);
 
-        SLIST_FOREACH(myNode, &head, entries) {
-            if (myNode->is_complete) {
-                pthread_join(myNode->thread_id, NULL);
-            }
-        }
+        join_connection_threads(&head, false);
     }
 
     // TODO: free the list of args here
     // free(args);
 
-    struct Node *current_node = SLIST_FIRST(&head);
-    struct Node *next_node;
+    // Wait for the open connections to finish and free all nodes in linked list
+    join_connection_threads(&head, true);
+    if (worker_count > 0) {
+        stop_workers();
+    }
 
-    // Free all nodes in linked list
-    while (current_node != NULL) {
-        next_node = current_node->next; // Save the next node
-        // Remove the element, then free it after. This fixes a myNode Valgrind issue.
-        SLIST_REMOVE(&head, myNode, Node, entries);
+    stop_writer();
+    stop_data_commits();
+    close_data_fds();
 
-        // Free any dynamically allocated members of current_node here
-        free(current_node); // Free the current node
-        current_node = next_node; // Move to the next node
+    // Unlike the data file, the log stays for the next run to recover
+    if (log_dir != NULL) {
+        syslog(LOG_NOTICE, "Segment log: %lu appends, %lu syncs, %lu rotations",
+               packet_log.stats.appends, packet_log.stats.syncs, packet_log.stats.rotations);
+        segment_log_close(&packet_log);
     }
 
     /* 5i. Gracefully exits when SIGINT or SIGTERM is received,
@@ -508,7 +2564,6 @@ int main (int argc, char *argv[]) {
     printf("Caught signal, exiting\n");
     // fclose(file);
     // close(openfd);
-    free(myNode);
     close_all_things();
 
     return 0; // no errors
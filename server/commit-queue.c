@@ -0,0 +1,269 @@
+/**
+ * @file commit-queue.c
+ * @brief Batches the fdatasync() calls of concurrent aesdsocket writers
+ *
+ * Usage, with the writes ordered by the caller's own lock:
+ *
+ *     pthread_mutex_lock(&mutex);
+ *     write(fd, packet, len);
+ *     ticket = commit_queue_submit(&queue);
+ *     pthread_mutex_unlock(&mutex);
+ *     commit_queue_wait(&queue, ticket);   // returns once the packet is on disk
+ *
+ * Or, from a thread that must not block:
+ *
+ *     waiter->done = on_synced;
+ *     commit_queue_wait_async(&queue, ticket, waiter);   // on_synced(waiter) once it is on disk
+ *
+ * Tickets increase in write order, so syncing after ticket N was handed out covers every
+ * write up to N.
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "commit-queue.h"
+
+// Failed syncs remembered before the array grows
+#define COMMIT_QUEUE_FAILURES 8
+
+/**
+ * Records that the sync of tickets @param first to @param last failed. If there is no room for
+ * it, the previous failure is widened to cover it: a durable write reported as failed is better
+ * than the other way around. Caller holds queue->lock.
+ */
+static void commit_queue_record_failure(struct commit_queue *queue, uint64_t first, uint64_t last)
+{
+    struct commit_queue_failure *previous = (queue->failure_count > 0) ? &queue->failures[queue->failure_count - 1] : NULL;
+
+    if (previous != NULL && previous->last + 1 == first) {
+        previous->last = last;
+        return;
+    }
+    if (queue->failure_count == queue->failure_capacity) {
+        struct commit_queue_failure *grown = realloc(queue->failures, 2 * queue->failure_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            previous->last = last;
+            return;
+        }
+        queue->failures = grown;
+        queue->failure_capacity *= 2;
+    }
+    queue->failures[queue->failure_count].first = first;
+    queue->failures[queue->failure_count].last = last;
+    queue->failure_count++;
+}
+
+/**
+ * @return true if the sync of @param ticket failed. Caller holds queue->lock.
+ */
+static bool commit_queue_failed(const struct commit_queue *queue, uint64_t ticket)
+{
+    // Waiters mostly ask about recent tickets, so look from the newest failure back
+    for (size_t i = queue->failure_count; i-- > 0; ) {
+        if (ticket > queue->failures[i].last) {
+            return false;
+        }
+        if (ticket >= queue->failures[i].first) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Calls back every waiter whose ticket the syncs so far have covered. Takes and drops
+ * queue->lock, which the caller holds, to run the callbacks without it.
+ */
+static void commit_queue_call_waiters(struct commit_queue *queue)
+{
+    struct commit_waiter **link = &queue->waiters;
+    struct commit_waiter *ready = NULL;
+
+    while (*link != NULL) {
+        struct commit_waiter *waiter = *link;
+        if (waiter->ticket > queue->completed) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+        waiter->rc = commit_queue_failed(queue, waiter->ticket) ? -1 : 0;
+        waiter->next = ready;
+        ready = waiter;
+    }
+    if (ready == NULL) {
+        return;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    while (ready != NULL) {
+        // done() may reuse the waiter, so step past it first
+        struct commit_waiter *waiter = ready;
+        ready = waiter->next;
+        waiter->done(waiter);
+    }
+    pthread_mutex_lock(&queue->lock);
+}
+
+static void* commit_queue_flusher(void *arg)
+{
+    struct commit_queue *queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        uint64_t first;
+        uint64_t target;
+        int rc;
+
+        while (queue->flushing == queue->submitted && !queue->stopping) {
+            pthread_cond_wait(&queue->pending, &queue->lock);
+        }
+        if (queue->flushing == queue->submitted) {
+            break;
+        }
+
+        // Let the writers that arrive in the meantime join this batch
+        if (queue->max_delay_us > 0 && !queue->stopping) {
+            struct timespec delay = { queue->max_delay_us / 1000000, (queue->max_delay_us % 1000000) * 1000 };
+            pthread_mutex_unlock(&queue->lock);
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&queue->lock);
+        }
+
+        first = queue->flushing + 1;
+        target = queue->submitted;
+        if (target - queue->flushing > queue->stats.max_batch) {
+            queue->stats.max_batch = target - queue->flushing;
+        }
+        queue->flushing = target;
+
+        pthread_mutex_unlock(&queue->lock);
+        rc = fdatasync(queue->fd);
+        pthread_mutex_lock(&queue->lock);
+
+        queue->stats.syncs++;
+        if (rc != 0) {
+            commit_queue_record_failure(queue, first, target);
+        }
+        queue->completed = target;
+        pthread_cond_broadcast(&queue->synced);
+        commit_queue_call_waiters(queue);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/**
+ * Starts the flusher thread for @param fd.
+ * @param max_delay_us how long a batch waits for more writes before its fdatasync(), 0 for none.
+ * Writes that arrive while a sync is in progress are always batched into the next one.
+ * @return 0 on success, -1 if the thread could not be created
+ */
+int commit_queue_start(struct commit_queue *queue, int fd, long max_delay_us)
+{
+    queue->fd = fd;
+    queue->max_delay_us = max_delay_us;
+    queue->submitted = 0;
+    queue->flushing = 0;
+    queue->completed = 0;
+    queue->failures = malloc(COMMIT_QUEUE_FAILURES * sizeof(struct commit_queue_failure));
+    if (queue->failures == NULL) {
+        return -1;
+    }
+    queue->failure_count = 0;
+    queue->failure_capacity = COMMIT_QUEUE_FAILURES;
+    queue->waiters = NULL;
+    queue->stopping = false;
+    queue->stats = (struct commit_queue_stats){ 0 };
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->pending, NULL);
+    pthread_cond_init(&queue->synced, NULL);
+
+    if (pthread_create(&queue->flusher, NULL, commit_queue_flusher, queue) != 0) {
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->pending);
+        pthread_cond_destroy(&queue->synced);
+        free(queue->failures);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queues a sync for the write just made. Call it while the write is still ordered by the
+ * caller's lock, so tickets follow the order of the data in the file.
+ * @return the ticket to wait for
+ */
+uint64_t commit_queue_submit(struct commit_queue *queue)
+{
+    uint64_t ticket;
+
+    pthread_mutex_lock(&queue->lock);
+    ticket = ++queue->submitted;
+    queue->stats.commits++;
+    pthread_cond_signal(&queue->pending);
+    pthread_mutex_unlock(&queue->lock);
+    return ticket;
+}
+
+/**
+ * Waits until the batch holding @param ticket has been synced.
+ * @return 0 once the write is durable, -1 with errno set to EIO if its fdatasync() failed,
+ * even if a later one worked
+ */
+int commit_queue_wait(struct commit_queue *queue, uint64_t ticket)
+{
+    int rc;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->completed < ticket) {
+        pthread_cond_wait(&queue->synced, &queue->lock);
+    }
+    rc = commit_queue_failed(queue, ticket) ? -1 : 0;
+    pthread_mutex_unlock(&queue->lock);
+    if (rc == -1) {
+        errno = EIO;
+    }
+    return rc;
+}
+
+/**
+ * Like commit_queue_wait(), but returns at once: @param waiter->done is called once the batch
+ * holding @param ticket has been synced, with the result in waiter->rc.
+ */
+void commit_queue_wait_async(struct commit_queue *queue, uint64_t ticket, struct commit_waiter *waiter)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->completed < ticket) {
+        waiter->ticket = ticket;
+        waiter->next = queue->waiters;
+        queue->waiters = waiter;
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+    waiter->ticket = ticket;
+    waiter->rc = commit_queue_failed(queue, ticket) ? -1 : 0;
+    pthread_mutex_unlock(&queue->lock);
+    waiter->done(waiter);
+}
+
+/**
+ * Syncs whatever is still queued and stops the flusher, once every async waiter has been
+ * called back. No writer may submit meanwhile.
+ */
+void commit_queue_stop(struct commit_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = true;
+    pthread_cond_signal(&queue->pending);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->flusher, NULL);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->pending);
+    pthread_cond_destroy(&queue->synced);
+    free(queue->failures);
+}
@@ -0,0 +1,91 @@
+/*
+ * commit-queue.h
+ *
+ * Group commit for the aesdsocket data file.
+ *
+ * Writers append their packet as before, then take a ticket from commit_queue_submit() while
+ * their write is still ordered by the caller's lock, and wait for it with commit_queue_wait()
+ * after dropping that lock. One flusher thread makes every ticket handed out so far durable
+ * with a single fdatasync(), waiting up to max_delay_us first for more writes to join the batch.
+ * A thread that must not block, like an event loop, registers a commit_waiter with
+ * commit_queue_wait_async() instead, and the flusher calls it back once the ticket is synced.
+ */
+
+#ifndef COMMIT_QUEUE_H
+#define COMMIT_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+struct commit_queue_stats {
+    unsigned long commits;
+    /**
+     * fdatasync() calls made, commits / syncs is the mean batch
+     */
+    unsigned long syncs;
+    unsigned long max_batch;
+};
+
+/**
+ * Tickets first to last, both included, whose sync failed
+ */
+struct commit_queue_failure {
+    uint64_t first;
+    uint64_t last;
+};
+
+/**
+ * A ticket waited for without blocking. done() is called once its sync has finished, with rc
+ * 0 if the write is durable or -1 if the sync failed, from the flusher or from
+ * commit_queue_wait_async() itself if the sync already finished. The waiter may be reused as
+ * soon as done() is called.
+ */
+struct commit_waiter {
+    uint64_t ticket;
+    int rc;
+    void (*done)(struct commit_waiter *waiter);
+    void *arg;
+    struct commit_waiter *next;
+};
+
+struct commit_queue {
+    int fd;
+    long max_delay_us;
+    /**
+     * Tickets handed out, the last one the flusher started a sync for, and the last one whose
+     * sync has finished, whether it worked or not
+     */
+    uint64_t submitted;
+    uint64_t flushing;
+    uint64_t completed;
+    /**
+     * The syncs that failed, oldest first. A later sync that works doesn't make their writes
+     * durable, the kernel may have dropped them. Consecutive failed batches share one entry.
+     */
+    struct commit_queue_failure *failures;
+    size_t failure_count;
+    size_t failure_capacity;
+    /**
+     * Waiters registered with commit_queue_wait_async() whose sync hasn't finished
+     */
+    struct commit_waiter *waiters;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t pending;
+    pthread_cond_t synced;
+    pthread_t flusher;
+    struct commit_queue_stats stats;
+};
+
+extern int commit_queue_start(struct commit_queue *queue, int fd, long max_delay_us);
+
+extern uint64_t commit_queue_submit(struct commit_queue *queue);
+
+extern int commit_queue_wait(struct commit_queue *queue, uint64_t ticket);
+
+extern void commit_queue_wait_async(struct commit_queue *queue, uint64_t ticket, struct commit_waiter *waiter);
+
+extern void commit_queue_stop(struct commit_queue *queue);
+
+#endif /* COMMIT_QUEUE_H */
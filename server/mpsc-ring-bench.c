@@ -0,0 +1,243 @@
+/*
+ * mpsc-ring-bench.c
+ *
+ * Contention benchmark for aesdsocket's append path without the network. Producer threads
+ * each append packets to one file and wait for the end of the history after their packet,
+ * like append_packet() does:
+ *
+ *   mutex: each producer takes a global mutex, write()s and lseek()s itself
+ *   ring:  each producer pushes a request into the MPSC ring and sleeps until the single
+ *          writer thread has written it, in a writev() batch with whatever else was queued
+ *
+ * Sweeps 1, 2, 4, ... max producers and reports appends/sec, the p50/p99 append latency
+ * and, for the ring, the mean batch. Every history end returned is checked to be consistent.
+ *
+ * Usage: mpsc-ring-bench [-f file] [-p max_producers] [-n appends] [-s packet_size]
+ *   The appends of a round are split across its producers. The file defaults to /dev/null,
+ *   whose offsets stay 0, so it measures the handoff alone.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "mpsc-ring.h"
+
+#define BENCH_RING_SIZE 1024
+#define BENCH_BATCH_MAX 64
+
+struct bench_request {
+    const char *packet;
+    size_t len;
+    off_t history_end;
+    sem_t done;
+};
+
+struct bench_producer {
+    pthread_t thread_id;
+    bool use_ring;
+    long appends;
+    size_t packet_size;
+    double *latencies_us;
+    long inconsistent;
+};
+
+static int data_fd;
+static bool seekable;
+static pthread_mutex_t append_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mpsc_ring ring;
+static unsigned long batches;
+static unsigned long batched;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static off_t append_locked(const char *packet, size_t len) {
+    off_t end = -1;
+
+    pthread_mutex_lock(&append_mutex);
+    if (write(data_fd, packet, len) == (ssize_t)len) {
+        end = lseek(data_fd, 0, SEEK_END);
+    }
+    pthread_mutex_unlock(&append_mutex);
+    return end;
+}
+
+static off_t append_ring(const char *packet, size_t len) {
+    struct bench_request request = { .packet = packet, .len = len, .history_end = -1 };
+
+    sem_init(&request.done, 0, 0);
+    mpsc_ring_push(&ring, &request);
+    while (sem_wait(&request.done) == -1 && errno == EINTR) {
+    }
+    sem_destroy(&request.done);
+    return request.history_end;
+}
+
+/**
+ * The single consumer, the same batching as aesdsocket's writer thread. NULL stops it.
+ */
+static void* writer_thread(void *arg) {
+    void *batch[BENCH_BATCH_MAX];
+    struct iovec iov[BENCH_BATCH_MAX];
+
+    for (;;) {
+        size_t count = mpsc_ring_pop_batch(&ring, batch, BENCH_BATCH_MAX);
+        struct bench_request **requests = (struct bench_request **)batch;
+        size_t run = 0;
+        off_t end = -1;
+        off_t after = 0;
+
+        while (run < count && requests[run] != NULL) {
+            iov[run].iov_base = (void *)requests[run]->packet;
+            iov[run].iov_len = requests[run]->len;
+            run++;
+        }
+        if (run > 0 && writev(data_fd, iov, run) >= 0) {
+            end = lseek(data_fd, 0, SEEK_END);
+        }
+        batches++;
+        batched += run;
+        for (size_t i = run; i-- > 0; ) {
+            requests[i]->history_end = (end == -1) ? -1 : end - after;
+            after += requests[i]->len;
+            sem_post(&requests[i]->done);
+        }
+        if (run < count) {
+            return NULL;
+        }
+    }
+}
+
+static void* producer_thread(void *arg) {
+    struct bench_producer *producer = arg;
+    char *packet = malloc(producer->packet_size);
+    off_t last_end = 0;
+
+    memset(packet, 'p', producer->packet_size - 1);
+    packet[producer->packet_size - 1] = '\n';
+    for (long i = 0; i < producer->appends; i++) {
+        double start = now_us();
+        off_t end = producer->use_ring ? append_ring(packet, producer->packet_size)
+                                       : append_locked(packet, producer->packet_size);
+        producer->latencies_us[i] = now_us() - start;
+        // On a real file the history only grows and includes this packet
+        if (seekable && (end <= last_end || end < (off_t)producer->packet_size)) {
+            producer->inconsistent++;
+        }
+        last_end = end;
+    }
+    free(packet);
+    return NULL;
+}
+
+/**
+ * Runs one round of @param producers threads.
+ * @return the number of appends with an inconsistent history end
+ */
+static long run_round(bool use_ring, int producers, long appends, size_t packet_size) {
+    struct bench_producer *threads = calloc(producers, sizeof(struct bench_producer));
+    double *latencies_us = calloc(producers * appends, sizeof(double));
+    pthread_t writer_id;
+    long inconsistent = 0;
+    long total = producers * appends;
+
+    if (threads == NULL || latencies_us == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    batches = 0;
+    batched = 0;
+    if (use_ring) {
+        mpsc_ring_init(&ring, BENCH_RING_SIZE);
+        pthread_create(&writer_id, NULL, writer_thread, NULL);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < producers; i++) {
+        threads[i].use_ring = use_ring;
+        threads[i].appends = appends;
+        threads[i].packet_size = packet_size;
+        threads[i].latencies_us = latencies_us + i * appends;
+        pthread_create(&threads[i].thread_id, NULL, producer_thread, &threads[i]);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+        inconsistent += threads[i].inconsistent;
+    }
+    double elapsed_s = (now_us() - start) / 1e6;
+
+    if (use_ring) {
+        mpsc_ring_push(&ring, NULL);
+        pthread_join(writer_id, NULL);
+        mpsc_ring_destroy(&ring);
+    }
+
+    qsort(latencies_us, total, sizeof(double), compare_double);
+    printf("%-5s producers=%-3d appends/s=%-9.0f p50=%.1fus p99=%.1fus",
+           use_ring ? "ring" : "mutex", producers, total / elapsed_s,
+           latencies_us[total / 2], latencies_us[(total * 99) / 100]);
+    if (use_ring) {
+        printf(" batch=%.1f", batches ? (double)batched / batches : 0.0);
+    }
+    printf("%s\n", inconsistent ? " INCONSISTENT" : "");
+
+    free(latencies_us);
+    free(threads);
+    return inconsistent;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "/dev/null";
+    int max_producers = 64;
+    long appends = 20000;
+    size_t packet_size = 64;
+    long inconsistent = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:p:n:s:")) != -1) {
+        switch (opt) {
+        case 'f': path = optarg; break;
+        case 'p': max_producers = atoi(optarg); break;
+        case 'n': appends = atol(optarg); break;
+        case 's': packet_size = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f file] [-p max_producers] [-n appends] [-s packet_size]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_producers < 1 || appends < 1 || packet_size < 2) {
+        fprintf(stderr, "Need at least one producer, one append and a 2 byte packet\n");
+        return 1;
+    }
+
+    data_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (data_fd == -1) {
+        perror(path);
+        return 1;
+    }
+    seekable = strcmp(path, "/dev/null") != 0;
+
+    for (int producers = 1; producers <= max_producers; producers *= 2) {
+        inconsistent += run_round(false, producers, appends / producers + 1, packet_size);
+        inconsistent += run_round(true, producers, appends / producers + 1, packet_size);
+    }
+    close(data_fd);
+    return inconsistent ? 1 : 0;
+}
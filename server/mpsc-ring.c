@@ -0,0 +1,144 @@
+/**
+ * @file mpsc-ring.c
+ * @brief Lock-free multi-producer, single-consumer pointer ring
+ *
+ * Usage:
+ *
+ *     // any thread
+ *     mpsc_ring_push(&ring, request);
+ *
+ *     // the one consumer thread
+ *     n = mpsc_ring_pop_batch(&ring, batch, BATCH_MAX);   // sleeps until at least one item
+ *
+ * Slot i is free for position p when its sequence is p, and holds the item for p when its
+ * sequence is p + 1. Consuming sets it to p + capacity, freeing it for the next lap.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "mpsc-ring.h"
+
+/**
+ * Prepares an empty ring of @param capacity slots, rounded up to a power of two.
+ * @return 0 on success, -1 if the slots could not be allocated
+ */
+int mpsc_ring_init(struct mpsc_ring *ring, size_t capacity)
+{
+    size_t size = 2;
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->slots = calloc(size, sizeof(struct mpsc_ring_slot));
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->slots[i].seq, i);
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    if (sem_init(&ring->items, 0, 0) == -1) {
+        free(ring->slots);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Publishes @param item unless the ring is full.
+ * @return true if it was queued
+ */
+bool mpsc_ring_try_push(struct mpsc_ring *ring, void *item)
+{
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct mpsc_ring_slot *slot;
+
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Free for this lap: claim it. On failure pos is reloaded with the current tail.
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (diff < 0) {
+            // Still holds the item from the previous lap
+            return false;
+        }
+        else {
+            // Another producer claimed it first
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->item = item;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    sem_post(&ring->items);
+    return true;
+}
+
+/**
+ * Publishes @param item, yielding to the consumer for as long as the ring is full.
+ */
+void mpsc_ring_push(struct mpsc_ring *ring, void *item)
+{
+    while (!mpsc_ring_try_push(ring, item)) {
+        sched_yield();
+    }
+}
+
+/**
+ * Takes the item at head, which the semaphore says is published or about to be: a producer
+ * that claimed an earlier position may still be storing it.
+ */
+static void *mpsc_ring_take(struct mpsc_ring *ring)
+{
+    struct mpsc_ring_slot *slot = &ring->slots[ring->head & ring->mask];
+    void *item;
+
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring->head + 1) {
+        sched_yield();
+    }
+    item = slot->item;
+    atomic_store_explicit(&slot->seq, ring->head + ring->mask + 1, memory_order_release);
+    ring->head++;
+    return item;
+}
+
+/**
+ * Waits for at least one item, then takes up to @param max published ones, oldest first,
+ * into @param items. Only one thread may call this.
+ * @return the number of items taken
+ */
+size_t mpsc_ring_pop_batch(struct mpsc_ring *ring, void **items, size_t max)
+{
+    size_t count = 0;
+
+    while (sem_wait(&ring->items) == -1 && errno == EINTR) {
+    }
+    items[count++] = mpsc_ring_take(ring);
+    while (count < max && sem_trywait(&ring->items) == 0) {
+        items[count++] = mpsc_ring_take(ring);
+    }
+    return count;
+}
+
+/**
+ * Frees the slots. Nothing may be using the ring.
+ */
+void mpsc_ring_destroy(struct mpsc_ring *ring)
+{
+    sem_destroy(&ring->items);
+    free(ring->slots);
+    ring->slots = NULL;
+}
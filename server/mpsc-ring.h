@@ -0,0 +1,51 @@
+/*
+ * mpsc-ring.h
+ *
+ * Bounded lock-free multi-producer, single-consumer ring of pointers, used to hand packets from
+ * the aesdsocket connection threads to its single writer thread (-W).
+ *
+ * Every slot carries a sequence number (Vyukov's bounded queue): a producer claims a position
+ * with one compare-and-swap on tail and publishes its slot by advancing the slot's sequence, and
+ * the consumer reads slots in order without any atomic read-modify-write. A semaphore counts the
+ * published items so the consumer can sleep while the ring is empty. sem_post() only enters the
+ * kernel when the consumer is actually asleep.
+ */
+
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+struct mpsc_ring_slot {
+    atomic_size_t seq;
+    void *item;
+};
+
+struct mpsc_ring {
+    struct mpsc_ring_slot *slots;
+    size_t mask;
+    /**
+     * Next position producers claim, on its own cache line so the consumer doesn't share it
+     */
+    _Alignas(64) atomic_size_t tail;
+    /**
+     * Next position the consumer reads, only touched by the consumer
+     */
+    _Alignas(64) size_t head;
+    sem_t items;
+};
+
+extern int mpsc_ring_init(struct mpsc_ring *ring, size_t capacity);
+
+extern bool mpsc_ring_try_push(struct mpsc_ring *ring, void *item);
+
+extern void mpsc_ring_push(struct mpsc_ring *ring, void *item);
+
+extern size_t mpsc_ring_pop_batch(struct mpsc_ring *ring, void **items, size_t max);
+
+extern void mpsc_ring_destroy(struct mpsc_ring *ring);
+
+#endif /* MPSC_RING_H */
@@ -0,0 +1,169 @@
+/*
+ * packet-framer-fuzz.c
+ *
+ * Randomized test and throughput benchmark for packet-framer.c.
+ *
+ * Builds a stream of random packets (some longer than the maximum packet size), feeds it
+ * through the framer in randomly sized segments the way recv() would hand it over, and
+ * checks that exactly the in-bounds packets come out, intact and in order.
+ *
+ * Usage: packet-framer-fuzz [rounds] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet-framer.h"
+
+#define FUZZ_MAX_PACKET 3000
+#define THROUGHPUT_BYTES (64 * 1024 * 1024)
+
+struct stream {
+    char *data;
+    size_t len;
+    // The packets the framer should return, as offsets into data
+    size_t *expected_start;
+    size_t *expected_len;
+    size_t expected_count;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fills @param stream with packets of random length up to @param longest bytes. Packets over
+ * @param max_packet are generated but not expected back.
+ */
+static void make_stream(struct stream *stream, size_t target_len, size_t longest, size_t max_packet) {
+    size_t expected_cap = 1024;
+
+    stream->data = malloc(target_len + longest);
+    stream->expected_start = malloc(expected_cap * sizeof(size_t));
+    stream->expected_len = malloc(expected_cap * sizeof(size_t));
+    stream->len = 0;
+    stream->expected_count = 0;
+
+    while (stream->len < target_len) {
+        if (stream->expected_count == expected_cap) {
+            expected_cap *= 2;
+            stream->expected_start = realloc(stream->expected_start, expected_cap * sizeof(size_t));
+            stream->expected_len = realloc(stream->expected_len, expected_cap * sizeof(size_t));
+        }
+        // Mostly short packets, like aesdsocket sees, with the occasional long one
+        size_t len = (rand() % 8 == 0) ? 1 + rand() % longest : 1 + rand() % 64;
+        for (size_t i = 0; i < len - 1; i++) {
+            stream->data[stream->len + i] = 'a' + rand() % 26;
+        }
+        stream->data[stream->len + len - 1] = '\n';
+        if (len <= max_packet) {
+            stream->expected_start[stream->expected_count] = stream->len;
+            stream->expected_len[stream->expected_count] = len;
+            stream->expected_count++;
+        }
+        stream->len += len;
+    }
+}
+
+static void free_stream(struct stream *stream) {
+    free(stream->data);
+    free(stream->expected_start);
+    free(stream->expected_len);
+}
+
+/**
+ * Feeds @param stream through a framer in random segments of 1..@param max_segment bytes.
+ * @return 0 if every expected packet came back in order and nothing else did
+ */
+static int feed_stream(const struct stream *stream, size_t max_packet, size_t max_segment) {
+    struct packet_framer framer;
+    size_t offset = 0;
+    size_t next_expected = 0;
+    const char *packet;
+    size_t len;
+    int rc = 0;
+
+    packet_framer_init(&framer, max_packet);
+    // A framer that hasn't received anything has no buffer yet and no packet
+    if (packet_framer_next(&framer, &packet, &len)) {
+        fprintf(stderr, "packet from an empty framer\n");
+        rc = -1;
+    }
+    while (offset < stream->len && rc == 0) {
+        size_t space;
+        char *recvbuf = packet_framer_recv_space(&framer, &space);
+        size_t segment = 1 + rand() % max_segment;
+
+        if (recvbuf == NULL) {
+            fprintf(stderr, "recv space allocation failed\n");
+            rc = -1;
+            break;
+        }
+        if (segment > space) {
+            segment = space;
+        }
+        if (segment > stream->len - offset) {
+            segment = stream->len - offset;
+        }
+        memcpy(recvbuf, stream->data + offset, segment);
+        packet_framer_commit(&framer, segment);
+        offset += segment;
+
+        while (packet_framer_next(&framer, &packet, &len)) {
+            if (next_expected >= stream->expected_count ||
+                len != stream->expected_len[next_expected] ||
+                memcmp(packet, stream->data + stream->expected_start[next_expected], len) != 0) {
+                fprintf(stderr, "packet %zu mismatch (got %zu bytes)\n", next_expected, len);
+                rc = -1;
+                break;
+            }
+            next_expected++;
+        }
+    }
+
+    if (rc == 0 && (next_expected != stream->expected_count || packet_framer_has_partial(&framer))) {
+        fprintf(stderr, "got %zu of %zu packets\n", next_expected, stream->expected_count);
+        rc = -1;
+    }
+    packet_framer_free(&framer);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = (argc > 1) ? atoi(argv[1]) : 200;
+    unsigned int seed = (argc > 2) ? strtoul(argv[2], NULL, 10) : (unsigned int)time(NULL);
+    struct stream stream;
+    double start;
+    double elapsed;
+
+    printf("seed %u\n", seed);
+    srand(seed);
+
+    for (int round = 0; round < rounds; round++) {
+        // Segments from a single byte up to several packets' worth
+        size_t max_segment = (round % 3 == 0) ? 1 + rand() % 8 : 1 + rand() % 10000;
+        make_stream(&stream, 64 * 1024, 2 * FUZZ_MAX_PACKET, FUZZ_MAX_PACKET);
+        if (feed_stream(&stream, FUZZ_MAX_PACKET, max_segment) != 0) {
+            fprintf(stderr, "round %d failed (max_segment %zu)\n", round, max_segment);
+            free_stream(&stream);
+            return 1;
+        }
+        free_stream(&stream);
+    }
+    printf("%d randomized rounds passed\n", rounds);
+
+    make_stream(&stream, THROUGHPUT_BYTES, 2 * FUZZ_MAX_PACKET, FUZZ_MAX_PACKET);
+    start = now_sec();
+    if (feed_stream(&stream, FUZZ_MAX_PACKET, 16384) != 0) {
+        free_stream(&stream);
+        return 1;
+    }
+    elapsed = now_sec() - start;
+    printf("throughput: %.1f MB/s, %.1f Mpackets/s\n",
+           stream.len / elapsed / 1e6, stream.expected_count / elapsed / 1e6);
+    free_stream(&stream);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file packet-framer.c
+ * @brief Incremental newline framing for aesdsocket connections
+ *
+ * Usage from a receive loop:
+ *
+ *     char *space = packet_framer_recv_space(&framer, &room);
+ *     n = recv(fd, space, room, 0);
+ *     packet_framer_commit(&framer, n);
+ *     while (packet_framer_next(&framer, &packet, &len)) {
+ *         // packet stays valid until the next packet_framer_recv_space()
+ *     }
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet-framer.h"
+
+// Room guaranteed for every recv(), and the first allocation
+#define FRAMER_MIN_RECV 4096
+
+/**
+ * Prepares an empty framer. Nothing is allocated until the first packet_framer_recv_space().
+ * @param max_packet the largest packet, newline included, to return. Longer ones are discarded.
+ */
+void packet_framer_init(struct packet_framer *framer, size_t max_packet)
+{
+    memset(framer, 0, sizeof(*framer));
+    framer->max_packet = max_packet;
+}
+
+void packet_framer_free(struct packet_framer *framer)
+{
+    free(framer->buf);
+    framer->buf = NULL;
+    framer->head = framer->len = framer->cap = framer->scanned = 0;
+}
+
+/**
+ * @return a pointer to at least FRAMER_MIN_RECV bytes to receive into, with the actual room in
+ * @param space, or NULL if the buffer could not grow. Invalidates packets returned earlier.
+ */
+char *packet_framer_recv_space(struct packet_framer *framer, size_t *space)
+{
+    // Move the unreturned tail to the front once, instead of after every packet
+    if (framer->head > 0) {
+        memmove(framer->buf, framer->buf + framer->head, framer->len - framer->head);
+        framer->len -= framer->head;
+        framer->scanned -= framer->head;
+        framer->head = 0;
+    }
+
+    if (framer->cap - framer->len < FRAMER_MIN_RECV) {
+        // Geometric growth keeps a packet built from many small segments linear in its size
+        size_t new_cap = framer->cap ? framer->cap * 2 : FRAMER_MIN_RECV;
+        char *grown;
+        while (new_cap - framer->len < FRAMER_MIN_RECV) {
+            new_cap *= 2;
+        }
+        grown = realloc(framer->buf, new_cap);
+        if (grown == NULL) {
+            return NULL;
+        }
+        framer->buf = grown;
+        framer->cap = new_cap;
+    }
+
+    *space = framer->cap - framer->len;
+    return framer->buf + framer->len;
+}
+
+/**
+ * Accounts for @param received bytes written at the pointer from packet_framer_recv_space()
+ */
+void packet_framer_commit(struct packet_framer *framer, size_t received)
+{
+    framer->len += received;
+}
+
+/**
+ * Returns the next complete packet, newline included, in @param packet and @param len.
+ * Over-length packets are dropped here, counted in framer->discarded.
+ * @return false once no complete packet is buffered
+ */
+bool packet_framer_next(struct packet_framer *framer, const char **packet, size_t *len)
+{
+    // Nothing received yet, buf may still be NULL, which memchr() must not be given
+    if (framer->len == 0) {
+        return false;
+    }
+
+    while (1) {
+        char *newline = memchr(framer->buf + framer->scanned, '\n', framer->len - framer->scanned);
+        size_t end;
+
+        if (newline == NULL) {
+            framer->scanned = framer->len;
+            if (framer->discarding || framer->len - framer->head > framer->max_packet) {
+                // Too long already. Drop what is buffered and skip the rest up to its newline.
+                framer->discarding = true;
+                framer->head = framer->len;
+            }
+            return false;
+        }
+
+        end = newline + 1 - framer->buf;
+        if (framer->discarding || end - framer->head > framer->max_packet) {
+            framer->discarding = false;
+            framer->discarded++;
+            framer->head = framer->scanned = end;
+            continue;
+        }
+
+        *packet = framer->buf + framer->head;
+        *len = end - framer->head;
+        framer->head = framer->scanned = end;
+        return true;
+    }
+}
+
+/**
+ * @return true if bytes of an unterminated packet are buffered (or being discarded)
+ */
+bool packet_framer_has_partial(const struct packet_framer *framer)
+{
+    return framer->len > framer->head || framer->discarding;
+}
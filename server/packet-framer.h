@@ -0,0 +1,57 @@
+/*
+ * packet-framer.h
+ *
+ * Incremental newline framing for aesdsocket connections.
+ *
+ * A packet is complete when a newline arrives. Bytes are received straight into a
+ * per-connection buffer that grows geometrically, each byte is scanned for the newline
+ * exactly once, and any number of packets per recv() as well as packets split across
+ * many recv() calls are handled. Packets longer than max_packet are discarded up to and
+ * including their newline.
+ */
+
+#ifndef PACKET_FRAMER_H
+#define PACKET_FRAMER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct packet_framer {
+    /**
+     * Received bytes. buf[head..len) have not been returned as packets yet.
+     */
+    char *buf;
+    size_t head;
+    size_t len;
+    size_t cap;
+    /**
+     * buf[head..scanned) are known not to contain a newline
+     */
+    size_t scanned;
+    /**
+     * Largest packet, including its newline, that will be returned
+     */
+    size_t max_packet;
+    /**
+     * Set while dropping the rest of an over-length packet
+     */
+    bool discarding;
+    /**
+     * Number of over-length packets dropped so far
+     */
+    unsigned long discarded;
+};
+
+extern void packet_framer_init(struct packet_framer *framer, size_t max_packet);
+
+extern void packet_framer_free(struct packet_framer *framer);
+
+extern char *packet_framer_recv_space(struct packet_framer *framer, size_t *space);
+
+extern void packet_framer_commit(struct packet_framer *framer, size_t received);
+
+extern bool packet_framer_next(struct packet_framer *framer, const char **packet, size_t *len);
+
+extern bool packet_framer_has_partial(const struct packet_framer *framer);
+
+#endif /* PACKET_FRAMER_H */
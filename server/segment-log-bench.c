@@ -0,0 +1,319 @@
+/*
+ * segment-log-bench.c
+ *
+ * Measures the segment log's group commit without the network: threads append packets to a
+ * log in a scratch directory, each waiting for its packet to be durable like aesdsocket -l does,
+ * once for every commit window.
+ *
+ * Reports packets/sec, appends per fdatasync() and the p50/p99 append latency per window.
+ * Then checks recovery: a log with a torn packet at its tail is reopened and must keep exactly
+ * the whole packets, and keep working. Last, a failed fdatasync() must fail both the leader and
+ * the follower waiting on it, not just the leader.
+ *
+ * Usage: segment-log-bench [-d scratch_dir] [-t threads] [-n packets] [-s packet_size]
+ *                          [-g window_usec]
+ *   Without -g, sweeps windows of 0, 100, 500 and 2000 usec.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "segment-log.h"
+
+// Small segments so every round also rotates
+#define BENCH_SEGMENT_SIZE (64 * 1024)
+#define BENCH_SEGMENTS_KEPT 4
+
+struct bench_appender {
+    pthread_t thread_id;
+    struct segment_log *log;
+    const char *packet;
+    size_t packet_size;
+    long packets;
+    double *latencies_us;
+    long failed;
+};
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void* appender_thread(void *arg) {
+    struct bench_appender *appender = arg;
+    struct segment_log_position end;
+
+    for (long i = 0; i < appender->packets; i++) {
+        double start = now_us();
+        if (segment_log_append(appender->log, appender->packet, appender->packet_size, &end) == -1) {
+            appender->failed++;
+        }
+        appender->latencies_us[i] = now_us() - start;
+    }
+    return NULL;
+}
+
+/**
+ * Removes the segments a round left in @param dir
+ */
+static void clear_log_dir(const char *dir) {
+    struct segment_log log;
+
+    if (segment_log_open(&log, dir, 1, 1, 0) == 0) {
+        // Keeping one segment deletes the rest, the one left is emptied by hand
+        struct log_segment *segment = TAILQ_FIRST(&log.segments);
+        if (ftruncate(segment->fd, 0) == -1) {
+            perror("ftruncate");
+        }
+        segment_log_close(&log);
+    }
+}
+
+/**
+ * Appends @param packets packets split across @param threads threads with a commit window
+ * of @param window_us and prints the results.
+ * @return the number of failed appends
+ */
+static long run_round(const char *dir, int threads, long packets, size_t packet_size, long window_us) {
+    struct bench_appender *appenders = calloc(threads, sizeof(struct bench_appender));
+    double *latencies_us = calloc(packets, sizeof(double));
+    char *packet = malloc(packet_size);
+    struct segment_log log;
+    long completed = 0;
+    long failed = 0;
+
+    if (appenders == NULL || latencies_us == NULL || packet == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(packet, 'p', packet_size - 1);
+    packet[packet_size - 1] = '\n';
+
+    clear_log_dir(dir);
+    if (segment_log_open(&log, dir, BENCH_SEGMENT_SIZE, BENCH_SEGMENTS_KEPT, window_us) == -1) {
+        perror(dir);
+        exit(1);
+    }
+
+    double start = now_us();
+    for (int i = 0; i < threads; i++) {
+        appenders[i].log = &log;
+        appenders[i].packet = packet;
+        appenders[i].packet_size = packet_size;
+        appenders[i].packets = packets / threads + (i < packets % threads);
+        appenders[i].latencies_us = latencies_us + completed;
+        completed += appenders[i].packets;
+        pthread_create(&appenders[i].thread_id, NULL, appender_thread, &appenders[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(appenders[i].thread_id, NULL);
+        failed += appenders[i].failed;
+    }
+    double elapsed_s = (now_us() - start) / 1e6;
+
+    qsort(latencies_us, completed, sizeof(double), compare_double);
+    printf("window=%ldus threads=%d packets=%ld failed=%ld packets/s=%.0f appends/sync=%.1f rotations=%lu "
+           "p50=%.1fus p99=%.1fus\n",
+           window_us, threads, completed, failed, completed / elapsed_s,
+           log.stats.syncs ? (double)log.stats.appends / log.stats.syncs : 0.0, log.stats.rotations,
+           latencies_us[completed / 2], latencies_us[(completed * 99) / 100]);
+
+    segment_log_close(&log);
+    free(packet);
+    free(latencies_us);
+    free(appenders);
+    return failed;
+}
+
+/**
+ * Reads what segment_log_send_history() streams up to @param end into @param buf.
+ * @return the bytes read, or -1 on error
+ */
+static ssize_t read_history(struct segment_log *log, const struct segment_log_position *end, char *buf, size_t size) {
+    int fds[2];
+    ssize_t got = 0;
+    ssize_t n;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        return -1;
+    }
+    if (segment_log_send_history(log, fds[0], end) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    close(fds[0]);
+    while ((n = read(fds[1], buf + got, size - got)) > 0) {
+        got += n;
+    }
+    close(fds[1]);
+    return got;
+}
+
+/**
+ * Tears the tail of a log the way a crash mid-write would, reopens it and checks what survived.
+ * @return 0 if recovery kept exactly the whole packets, 1 otherwise
+ */
+static int check_recovery(const char *dir) {
+    static const char torn[] = "torn-packet-with-no-newline\0\0\0\0\0";
+    struct segment_log log;
+    struct segment_log_position end;
+    char packet[32];
+    char history[4096];
+    ssize_t len;
+    int failures = 0;
+
+    clear_log_dir(dir);
+    if (segment_log_open(&log, dir, 256, BENCH_SEGMENTS_KEPT, 0) == -1) {
+        perror(dir);
+        return 1;
+    }
+    for (int i = 0; i < 40; i++) {
+        snprintf(packet, sizeof(packet), "packet%02d\n", i);
+        segment_log_append(&log, packet, strlen(packet), &end);
+    }
+    if (write(TAILQ_LAST(&log.segments, log_segment_list)->fd, torn, sizeof(torn) - 1) != sizeof(torn) - 1) {
+        perror("write");
+    }
+    segment_log_close(&log);
+
+    // 40 packets of 9 bytes fill one 256 byte segment and part of a second, all of them kept
+    if (segment_log_open(&log, dir, 256, BENCH_SEGMENTS_KEPT, 0) == -1) {
+        perror(dir);
+        return 1;
+    }
+    printf("recovery: %lu packets (%llu bytes) kept, %llu torn bytes cut\n",
+           log.stats.recovered_packets, log.stats.recovered_bytes, log.stats.truncated_bytes);
+    if (log.stats.truncated_bytes != sizeof(torn) - 1 || log.stats.recovered_packets != 40 || log.count != 2) {
+        failures++;
+    }
+
+    segment_log_append(&log, "after\n", 6, &end);
+    len = read_history(&log, &end, history, sizeof(history));
+    if (len != (ssize_t)log.stats.recovered_bytes + 6 || memcmp(history + len - 15, "packet39\nafter\n", 15) != 0) {
+        failures++;
+    }
+    segment_log_close(&log);
+    clear_log_dir(dir);
+
+    printf("recovery %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+/**
+ * Fails the commit window's fdatasync() while a follower waits on it, by swapping a pipe in for
+ * the active segment until the leader has returned.
+ * @return 0 if the leader and the follower both failed and the next append worked, 1 otherwise
+ */
+static int check_sync_failure(const char *dir) {
+    struct bench_appender appenders[2];
+    double latencies_us[2];
+    struct segment_log log;
+    struct segment_log_position end;
+    struct timespec step = { 0, 20 * 1000 * 1000 };
+    int pipefd[2];
+    int saved;
+    int fd;
+    int failures = 0;
+
+    clear_log_dir(dir);
+    if (segment_log_open(&log, dir, BENCH_SEGMENT_SIZE, BENCH_SEGMENTS_KEPT, 100 * 1000) == -1) {
+        perror(dir);
+        return 1;
+    }
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        segment_log_close(&log);
+        return 1;
+    }
+
+    // The first appender leads the 100ms window, the second arrives 20ms later and waits on it
+    memset(appenders, 0, sizeof(appenders));
+    for (int i = 0; i < 2; i++) {
+        appenders[i].log = &log;
+        appenders[i].packet = i == 0 ? "leader\n" : "follower\n";
+        appenders[i].packet_size = strlen(appenders[i].packet);
+        appenders[i].packets = 1;
+        appenders[i].latencies_us = &latencies_us[i];
+        pthread_create(&appenders[i].thread_id, NULL, appender_thread, &appenders[i]);
+        nanosleep(&step, NULL);
+    }
+
+    // fdatasync() on a pipe fails with EINVAL
+    fd = TAILQ_LAST(&log.segments, log_segment_list)->fd;
+    saved = dup(fd);
+    dup2(pipefd[1], fd);
+    pthread_join(appenders[0].thread_id, NULL);
+    dup2(saved, fd);
+    close(saved);
+    pthread_join(appenders[1].thread_id, NULL);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    printf("sync failure: leader %s, follower %s\n", appenders[0].failed ? "failed" : "succeeded",
+           appenders[1].failed ? "failed" : "succeeded");
+    if (appenders[0].failed != 1 || appenders[1].failed != 1) {
+        failures++;
+    }
+    if (segment_log_append(&log, "after\n", 6, &end) == -1) {
+        failures++;
+    }
+    segment_log_close(&log);
+    clear_log_dir(dir);
+
+    printf("sync failure %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const long windows_us[] = { 0, 100, 500, 2000 };
+    const char *dir = "/var/tmp/segment-log-bench";
+    int threads = 16;
+    long packets = 4000;
+    size_t packet_size = 100;
+    long window_us = -1;
+    long failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:n:s:g:")) != -1) {
+        switch (opt) {
+        case 'd': dir = optarg; break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': packets = atol(optarg); break;
+        case 's': packet_size = strtoul(optarg, NULL, 10); break;
+        case 'g': window_us = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d scratch_dir] [-t threads] [-n packets] [-s packet_size] [-g window_usec]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1 || packets < threads || packet_size < 2) {
+        fprintf(stderr, "Need at least one thread, one packet per thread and a 2 byte packet\n");
+        return 1;
+    }
+
+    if (window_us >= 0) {
+        failed += run_round(dir, threads, packets, packet_size, window_us);
+    } else {
+        for (size_t i = 0; i < sizeof(windows_us) / sizeof(windows_us[0]); i++) {
+            failed += run_round(dir, threads, packets, packet_size, windows_us[i]);
+        }
+    }
+    failed += check_recovery(dir);
+    failed += check_sync_failure(dir);
+    return failed ? 1 : 0;
+}
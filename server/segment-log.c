@@ -0,0 +1,595 @@
+/**
+ * @file segment-log.c
+ * @brief Append-only, crash recoverable packet store for aesdsocket
+ *
+ * Segments are named segment-<sequence number> in the log directory. Every file is opened
+ * O_APPEND, and readers only use positioned I/O (sendfile() with an offset, pread()), so one
+ * descriptor per segment serves the appender and any number of concurrent streams.
+ *
+ * Locking: log->lock covers the segment list, sizes and commit state. Appends write under it,
+ * then the group commit leader drops it around the window and the fdatasync(), so followers
+ * keep appending to the batch meanwhile.
+ *
+ */
+
+#define _GNU_SOURCE // for O_DIRECTORY and O_CLOEXEC
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "segment-log.h"
+
+#define SEGMENT_NAME_FORMAT "segment-%020llu"
+// Bytes read at a time when replaying a segment, and when sendfile() isn't available
+#define SEGMENT_SCAN_CHUNK 65536
+#define SEGMENT_SEND_CHUNK 4096
+// Failed syncs remembered before the array grows
+#define SEGMENT_LOG_FAILURES 8
+
+static void segment_name(char *name, size_t size, uint64_t seq)
+{
+    snprintf(name, size, SEGMENT_NAME_FORMAT, (unsigned long long)seq);
+}
+
+/**
+ * Opens segment @param seq of @param log, creating it if @param create is set.
+ * @return the segment holding one reference, or NULL with errno set
+ */
+static struct log_segment *segment_open(struct segment_log *log, uint64_t seq, bool create)
+{
+    char name[64];
+    struct log_segment *segment = calloc(1, sizeof(struct log_segment));
+
+    if (segment == NULL) {
+        return NULL;
+    }
+    segment_name(name, sizeof(name), seq);
+    segment->fd = openat(log->dirfd, name, O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (segment->fd == -1) {
+        free(segment);
+        return NULL;
+    }
+    segment->seq = seq;
+    segment->refs = 1;
+    return segment;
+}
+
+/**
+ * Drops a reference to @param segment, closing it with the last one. Caller holds log->lock.
+ */
+static void segment_put(struct log_segment *segment)
+{
+    if (--segment->refs == 0) {
+        close(segment->fd);
+        free(segment);
+    }
+}
+
+/**
+ * Starts segment @param seq as the one appended to, making its directory entry durable.
+ * @return 0 on success, -1 with errno set
+ */
+static int segment_create(struct segment_log *log, uint64_t seq)
+{
+    struct log_segment *segment = segment_open(log, seq, true);
+
+    if (segment == NULL) {
+        return -1;
+    }
+    TAILQ_INSERT_TAIL(&log->segments, segment, entries);
+    log->count++;
+    return fsync(log->dirfd);
+}
+
+/**
+ * Deletes the oldest segment. Streams still reading it keep it open until they finish.
+ */
+static void segment_retire_oldest(struct segment_log *log)
+{
+    struct log_segment *oldest = TAILQ_FIRST(&log->segments);
+    char name[64];
+
+    TAILQ_REMOVE(&log->segments, oldest, entries);
+    log->count--;
+    segment_name(name, sizeof(name), oldest->seq);
+    unlinkat(log->dirfd, name, 0);
+    segment_put(oldest);
+}
+
+/**
+ * Replays @param segment: packets run up to their newline, and a NUL byte means the rest was
+ * never written.
+ * @return the bytes of whole packets at the start of the file, with their count in @param packets
+ */
+static off_t segment_scan(const struct log_segment *segment, unsigned long *packets)
+{
+    char *buf = malloc(SEGMENT_SCAN_CHUNK);
+    off_t offset = 0;
+    off_t valid = 0;
+    ssize_t n;
+
+    if (buf == NULL) {
+        return -1;
+    }
+    while ((n = pread(segment->fd, buf, SEGMENT_SCAN_CHUNK, offset)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (buf[i] == '\0') {
+                free(buf);
+                return valid;
+            }
+            if (buf[i] == '\n') {
+                valid = offset + i + 1;
+                (*packets)++;
+            }
+        }
+        offset += n;
+    }
+    free(buf);
+    return (n == -1) ? -1 : valid;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @return the sequence numbers of the segments in @param log's directory, ascending, with their
+ * count in @param count, or NULL if there are none or the directory can't be read
+ */
+static uint64_t *segment_list_directory(struct segment_log *log, size_t *count)
+{
+    DIR *dir;
+    struct dirent *dirent;
+    uint64_t *seqs = NULL;
+    size_t cap = 0;
+    int fd = dup(log->dirfd);
+
+    *count = 0;
+    if (fd == -1 || (dir = fdopendir(fd)) == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned long long seq;
+        int consumed = 0;
+
+        if (sscanf(dirent->d_name, "segment-%llu%n", &seq, &consumed) != 1 || dirent->d_name[consumed] != '\0') {
+            continue;
+        }
+        if (*count == cap) {
+            uint64_t *grown = realloc(seqs, (cap ? cap * 2 : 16) * sizeof(uint64_t));
+            if (grown == NULL) {
+                break;
+            }
+            seqs = grown;
+            cap = cap ? cap * 2 : 16;
+        }
+        seqs[(*count)++] = seq;
+    }
+    closedir(dir);
+    if (seqs != NULL) {
+        qsort(seqs, *count, sizeof(uint64_t), compare_seq);
+    }
+    return seqs;
+}
+
+/**
+ * Opens the log in @param dir, creating the directory if needed, and recovers what it holds.
+ * Segments are replayed oldest first. The first torn one is cut back to its last whole packet
+ * and any after it are deleted, so the log is always a prefix of what was appended.
+ * @param segment_size bytes after which appends move to a new segment
+ * @param max_segments segments kept, the oldest are deleted beyond that
+ * @param commit_window_us how long a group commit leader waits for more appends, 0 for none
+ * @return 0 on success, -1 with errno set
+ */
+int segment_log_open(struct segment_log *log, const char *dir, size_t segment_size,
+                     unsigned int max_segments, long commit_window_us)
+{
+    uint64_t *seqs;
+    size_t nseqs;
+    uint64_t next_seq = 1;
+    bool torn = false;
+
+    memset(log, 0, sizeof(struct segment_log));
+    TAILQ_INIT(&log->segments);
+    log->segment_size = segment_size;
+    log->max_segments = max_segments ? max_segments : 1;
+    log->commit_window_us = commit_window_us;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    log->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (log->dirfd == -1) {
+        return -1;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->synced, NULL);
+    log->failures = malloc(SEGMENT_LOG_FAILURES * sizeof(struct segment_log_failure));
+    if (log->failures == NULL) {
+        segment_log_close(log);
+        return -1;
+    }
+    log->failure_capacity = SEGMENT_LOG_FAILURES;
+
+    seqs = segment_list_directory(log, &nseqs);
+    for (size_t i = 0; i < nseqs; i++) {
+        struct log_segment *segment;
+        struct stat st;
+        char name[64];
+        off_t valid;
+
+        next_seq = seqs[i] + 1;
+        if (torn) {
+            segment_name(name, sizeof(name), seqs[i]);
+            unlinkat(log->dirfd, name, 0);
+            continue;
+        }
+        segment = segment_open(log, seqs[i], false);
+        if (segment == NULL || fstat(segment->fd, &st) == -1 ||
+                (valid = segment_scan(segment, &log->stats.recovered_packets)) == -1) {
+            free(seqs);
+            segment_log_close(log);
+            return -1;
+        }
+        if (valid < st.st_size) {
+            // A crash tore the last packet. Nothing after it was acknowledged.
+            log->stats.truncated_bytes += st.st_size - valid;
+            if (ftruncate(segment->fd, valid) == -1 || fdatasync(segment->fd) == -1) {
+                free(seqs);
+                segment_log_close(log);
+                return -1;
+            }
+            torn = true;
+        }
+        segment->size = valid;
+        log->stats.recovered_bytes += valid;
+        TAILQ_INSERT_TAIL(&log->segments, segment, entries);
+        log->count++;
+    }
+    free(seqs);
+
+    if ((log->count == 0 && segment_create(log, next_seq) == -1) || fsync(log->dirfd) == -1) {
+        segment_log_close(log);
+        return -1;
+    }
+    while (log->count > log->max_segments) {
+        segment_retire_oldest(log);
+    }
+    return 0;
+}
+
+/**
+ * Records that the appends with lsn @param first to @param last failed to sync. If there is no
+ * room for it, the previous failure is widened to cover it: a durable append reported as failed
+ * is better than the other way around. Caller holds log->lock.
+ */
+static void segment_log_record_failure(struct segment_log *log, uint64_t first, uint64_t last)
+{
+    struct segment_log_failure *previous = (log->failure_count > 0) ? &log->failures[log->failure_count - 1] : NULL;
+
+    if (previous != NULL && previous->last + 1 == first) {
+        previous->last = last;
+        return;
+    }
+    if (log->failure_count == log->failure_capacity) {
+        struct segment_log_failure *grown = realloc(log->failures, 2 * log->failure_capacity * sizeof(*grown));
+        if (grown == NULL) {
+            previous->last = last;
+            return;
+        }
+        log->failures = grown;
+        log->failure_capacity *= 2;
+    }
+    log->failures[log->failure_count].first = first;
+    log->failures[log->failure_count].last = last;
+    log->failure_count++;
+}
+
+/**
+ * @return true if the sync of the append with @param lsn failed. Caller holds log->lock.
+ */
+static bool segment_log_failed(const struct segment_log *log, uint64_t lsn)
+{
+    // Appenders mostly ask about recent lsns, so look from the newest failure back
+    for (size_t i = log->failure_count; i-- > 0; ) {
+        if (lsn > log->failures[i].last) {
+            return false;
+        }
+        if (lsn >= log->failures[i].first) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Marks the appends up to @param target as synced, failed if @param rc, the fdatasync() result,
+ * is -1. Caller holds log->lock.
+ */
+static void segment_log_sync_done(struct segment_log *log, uint64_t target, int rc)
+{
+    if (target <= log->completed) {
+        return;
+    }
+    if (rc != 0) {
+        segment_log_record_failure(log, log->completed + 1, target);
+    }
+    log->completed = target;
+}
+
+/**
+ * Moves appends to a new segment once the current one can't take @param len more bytes,
+ * after making the current one durable. Caller holds log->lock.
+ * @return 0 on success, -1 with errno set
+ */
+static int segment_log_rotate(struct segment_log *log, size_t len)
+{
+    struct log_segment *active;
+    int rc;
+
+    // The group commit leader syncs the active segment without the lock
+    while (log->syncing) {
+        pthread_cond_wait(&log->synced, &log->lock);
+    }
+    active = TAILQ_LAST(&log->segments, log_segment_list);
+    if (active->size == 0 || (size_t)active->size + len <= log->segment_size) {
+        // Another appender rotated while this one waited
+        return 0;
+    }
+
+    // Appenders waiting on these bytes fail with it, the next sync can't cover for this one
+    rc = fdatasync(active->fd);
+    segment_log_sync_done(log, log->appended, rc);
+    if (rc == -1) {
+        return -1;
+    }
+    if (segment_create(log, active->seq + 1) == -1) {
+        return -1;
+    }
+    while (log->count > log->max_segments) {
+        segment_retire_oldest(log);
+    }
+    log->stats.rotations++;
+    return 0;
+}
+
+/**
+ * Waits until the sync of the first @param lsn bytes appended has finished. The first appender to find no
+ * fdatasync() in progress leads the next one: it waits out the commit window with the lock
+ * dropped so more appends join, then syncs everything appended so far for all of them.
+ * Caller holds log->lock.
+ * @return 0 once durable, -1 with errno set to EIO if its fdatasync() failed, even if a later
+ * one worked
+ */
+static int segment_log_commit(struct segment_log *log, uint64_t lsn)
+{
+    while (log->completed < lsn) {
+        uint64_t target;
+        int fd;
+        int rc;
+
+        if (log->syncing) {
+            pthread_cond_wait(&log->synced, &log->lock);
+            continue;
+        }
+
+        log->syncing = true;
+        if (log->commit_window_us > 0) {
+            struct timespec window = { log->commit_window_us / 1000000, (log->commit_window_us % 1000000) * 1000 };
+            pthread_mutex_unlock(&log->lock);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&log->lock);
+        }
+        // Rotation waits for syncing to clear, so everything not yet durable is in this segment
+        target = log->appended;
+        fd = TAILQ_LAST(&log->segments, log_segment_list)->fd;
+
+        pthread_mutex_unlock(&log->lock);
+        rc = fdatasync(fd);
+        pthread_mutex_lock(&log->lock);
+
+        log->syncing = false;
+        log->stats.syncs++;
+        segment_log_sync_done(log, target, rc);
+        pthread_cond_broadcast(&log->synced);
+    }
+    if (segment_log_failed(log, lsn)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends @param packet, @param len bytes ending in a newline, and waits for it to be durable.
+ * @param end is set to where the history ended with this packet, for segment_log_send_history()
+ * @return 0 on success, -1 with errno set if it could not be written or synced
+ */
+int segment_log_append(struct segment_log *log, const char *packet, size_t len, struct segment_log_position *end)
+{
+    struct log_segment *active;
+    size_t written = 0;
+    uint64_t lsn;
+    int rc;
+
+    pthread_mutex_lock(&log->lock);
+    active = TAILQ_LAST(&log->segments, log_segment_list);
+    if (active->size > 0 && (size_t)active->size + len > log->segment_size) {
+        if (segment_log_rotate(log, len) == -1) {
+            pthread_mutex_unlock(&log->lock);
+            return -1;
+        }
+        active = TAILQ_LAST(&log->segments, log_segment_list);
+    }
+
+    while (written < len) {
+        ssize_t n = write(active->fd, packet + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Don't leave a partial packet for the next append to run into
+            int err = errno;
+            if (ftruncate(active->fd, active->size) == -1) {
+                err = errno;
+            }
+            pthread_mutex_unlock(&log->lock);
+            errno = err;
+            return -1;
+        }
+        written += n;
+    }
+    active->size += len;
+    log->appended += len;
+    log->stats.appends++;
+    lsn = log->appended;
+    end->seq = active->seq;
+    end->offset = active->size;
+
+    rc = segment_log_commit(log, lsn);
+    pthread_mutex_unlock(&log->lock);
+    return rc;
+}
+
+/**
+ * Sends the first @param length bytes of segment file @param fd to @param clientfd, with
+ * sendfile() when the descriptors allow it and pread() + send() otherwise.
+ * @return 0 on success, -1 on a read or socket error
+ */
+static int segment_send(int clientfd, int fd, off_t length)
+{
+    char buf[SEGMENT_SEND_CHUNK];
+    off_t offset = 0;
+
+    while (offset < length) {
+        // sendfile() transfers at most 0x7ffff000 bytes per call and advances offset itself
+        size_t count = (length - offset > 0x7ffff000) ? 0x7ffff000 : (size_t)(length - offset);
+        ssize_t n = sendfile(clientfd, fd, &offset, count);
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+            break;
+        }
+        return -1;
+    }
+
+    while (offset < length) {
+        size_t want = (length - offset < (off_t)sizeof(buf)) ? (size_t)(length - offset) : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset);
+        if (n == 0) {
+            return 0;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t sent = 0; sent < n; ) {
+            ssize_t m = send(clientfd, buf + sent, n - sent, MSG_NOSIGNAL);
+            if (m == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            sent += m;
+        }
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * Streams the history up to @param end to @param clientfd, oldest segment first. Segments
+ * retired since the append are skipped, like commands evicted from the driver's ring.
+ * The lock is only held to pin the segments, not while sending.
+ * @return 0 on success, -1 on error
+ */
+int segment_log_send_history(struct segment_log *log, int clientfd, const struct segment_log_position *end)
+{
+    struct log_segment **segments;
+    off_t *lengths;
+    struct log_segment *segment;
+    unsigned int count = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&log->lock);
+    segments = malloc(log->count * sizeof(struct log_segment *));
+    lengths = malloc(log->count * sizeof(off_t));
+    if (segments == NULL || lengths == NULL) {
+        pthread_mutex_unlock(&log->lock);
+        free(segments);
+        free(lengths);
+        return -1;
+    }
+    TAILQ_FOREACH(segment, &log->segments, entries) {
+        if (segment->seq > end->seq) {
+            break;
+        }
+        lengths[count] = (segment->seq == end->seq) ? end->offset : segment->size;
+        segment->refs++;
+        segments[count++] = segment;
+    }
+    pthread_mutex_unlock(&log->lock);
+
+    for (unsigned int i = 0; i < count && rc == 0; i++) {
+        rc = segment_send(clientfd, segments[i]->fd, lengths[i]);
+    }
+
+    pthread_mutex_lock(&log->lock);
+    for (unsigned int i = 0; i < count; i++) {
+        segment_put(segments[i]);
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(segments);
+    free(lengths);
+    return rc;
+}
+
+/**
+ * Syncs and closes every segment. The files stay for the next segment_log_open() to recover.
+ * No appends or streams may be in progress.
+ */
+void segment_log_close(struct segment_log *log)
+{
+    struct log_segment *segment;
+
+    if (!TAILQ_EMPTY(&log->segments)) {
+        fdatasync(TAILQ_LAST(&log->segments, log_segment_list)->fd);
+    }
+    while ((segment = TAILQ_FIRST(&log->segments)) != NULL) {
+        TAILQ_REMOVE(&log->segments, segment, entries);
+        segment_put(segment);
+    }
+    log->count = 0;
+    if (log->dirfd != -1) {
+        close(log->dirfd);
+        log->dirfd = -1;
+    }
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->synced);
+    free(log->failures);
+    log->failures = NULL;
+}
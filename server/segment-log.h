@@ -0,0 +1,118 @@
+/*
+ * segment-log.h
+ *
+ * Append-only, crash recoverable packet store for aesdsocket (-l).
+ *
+ * The history is kept as numbered segment files in one directory, each holding whole packets
+ * back to back exactly as they are returned to clients. Appends go to the newest segment.
+ * Once it reaches segment_size a new one is started and the oldest are deleted, so at most
+ * max_segments remain. That bounds disk use, and the history returned, the way the driver's
+ * ring does.
+ *
+ * An append returns once its packet is on disk, but appends that arrive while one fdatasync()
+ * is in progress, or within commit_window_us of the first, share the next one (group commit).
+ *
+ * Opening the log recovers it: the segments are replayed oldest first, and a packet torn by a
+ * crash (no newline, or NUL bytes where a write never landed) is cut off with everything after it.
+ */
+
+#ifndef SEGMENT_LOG_H
+#define SEGMENT_LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+struct log_segment {
+    uint64_t seq;
+    int fd;
+    /**
+     * Bytes of whole packets in the file
+     */
+    off_t size;
+    /**
+     * Streams reading the segment, plus one while it is part of the log. The file is
+     * closed when this drops to 0, so a stream can finish a segment that was rotated out.
+     */
+    int refs;
+    TAILQ_ENTRY(log_segment) entries;
+};
+TAILQ_HEAD(log_segment_list, log_segment);
+
+/**
+ * Where the history ended right after an append: the newest segment and its size then.
+ * Segments only grow and the oldest only go away, so this is a consistent snapshot.
+ */
+struct segment_log_position {
+    uint64_t seq;
+    off_t offset;
+};
+
+/**
+ * Appends whose lsn is first to last, both included, had their sync fail
+ */
+struct segment_log_failure {
+    uint64_t first;
+    uint64_t last;
+};
+
+struct segment_log_stats {
+    unsigned long appends;
+    /**
+     * fdatasync() calls made for group commits, appends / syncs is the batch size
+     */
+    unsigned long syncs;
+    unsigned long rotations;
+    /**
+     * What opening the log found: whole packets kept, and bytes cut from a torn tail
+     */
+    unsigned long recovered_packets;
+    unsigned long long recovered_bytes;
+    unsigned long long truncated_bytes;
+};
+
+struct segment_log {
+    int dirfd;
+    size_t segment_size;
+    unsigned int max_segments;
+    long commit_window_us;
+    /**
+     * Oldest first, the last one is appended to
+     */
+    struct log_segment_list segments;
+    unsigned int count;
+    /**
+     * Bytes appended since the log was opened, and how many of them had their sync finish,
+     * whether it worked or not. An append's lsn is the appended count right after it.
+     */
+    uint64_t appended;
+    uint64_t completed;
+    /**
+     * The syncs that failed, oldest first. A later sync that works doesn't make their bytes
+     * durable, the kernel may have dropped them. Consecutive failed syncs share one entry.
+     */
+    struct segment_log_failure *failures;
+    size_t failure_count;
+    size_t failure_capacity;
+    /**
+     * Set while an appender is leading a group commit. Rotation waits for it to clear.
+     */
+    bool syncing;
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+    struct segment_log_stats stats;
+};
+
+extern int segment_log_open(struct segment_log *log, const char *dir, size_t segment_size,
+                            unsigned int max_segments, long commit_window_us);
+
+extern int segment_log_append(struct segment_log *log, const char *packet, size_t len,
+                              struct segment_log_position *end);
+
+extern int segment_log_send_history(struct segment_log *log, int clientfd, const struct segment_log_position *end);
+
+extern void segment_log_close(struct segment_log *log);
+
+#endif /* SEGMENT_LOG_H */
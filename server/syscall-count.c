@@ -0,0 +1,206 @@
+/*
+ * syscall-count.c
+ *
+ * Counts the system calls a command makes, in all of its threads, to measure aesdsocket's
+ * system calls per request without strace. The command runs under ptrace, which makes every
+ * system call several times slower: use it for counts, never for timings.
+ *
+ * SIGUSR1 prints the count since the previous SIGUSR1 (or the start) with the most frequent
+ * system calls to stderr and starts counting again, so a benchmark can count just its own
+ * requests. SIGINT and SIGTERM are forwarded to the command. When the command exits the count
+ * since the last SIGUSR1 is printed.
+ *
+ * Usage: syscall-count command [args...]
+ *   e.g. ./syscall-count ./aesdsocket -u 2> counts &
+ *        kill -USR1 $!; ./aesdsocket-bench -n 1000; kill -USR1 $!; kill -TERM $!
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define MAX_SYSCALL_NR 1024
+#define REPORT_TOP 8
+
+#define SYSCALL_NAME(name) { __NR_##name, #name }
+
+// The calls a network server makes most, anything else is reported by number
+static const struct {
+    long nr;
+    const char *name;
+} syscall_names[] = {
+    SYSCALL_NAME(read), SYSCALL_NAME(write), SYSCALL_NAME(readv), SYSCALL_NAME(writev),
+    SYSCALL_NAME(pread64), SYSCALL_NAME(pwrite64), SYSCALL_NAME(lseek), SYSCALL_NAME(sendfile),
+    SYSCALL_NAME(openat), SYSCALL_NAME(close), SYSCALL_NAME(ioctl), SYSCALL_NAME(fsync),
+    SYSCALL_NAME(fdatasync), SYSCALL_NAME(accept), SYSCALL_NAME(accept4), SYSCALL_NAME(recvfrom),
+    SYSCALL_NAME(sendto), SYSCALL_NAME(recvmsg), SYSCALL_NAME(sendmsg), SYSCALL_NAME(shutdown),
+    SYSCALL_NAME(socket), SYSCALL_NAME(connect), SYSCALL_NAME(getpeername), SYSCALL_NAME(epoll_ctl), SYSCALL_NAME(epoll_pwait),
+    SYSCALL_NAME(futex), SYSCALL_NAME(clone), SYSCALL_NAME(clone3), SYSCALL_NAME(exit),
+    SYSCALL_NAME(mmap), SYSCALL_NAME(munmap), SYSCALL_NAME(mprotect), SYSCALL_NAME(madvise),
+    SYSCALL_NAME(rt_sigprocmask), SYSCALL_NAME(set_robust_list), SYSCALL_NAME(rseq),
+    SYSCALL_NAME(rt_sigreturn), SYSCALL_NAME(clock_nanosleep), SYSCALL_NAME(unlinkat),
+    SYSCALL_NAME(io_uring_enter),
+#ifdef __NR_epoll_wait
+    SYSCALL_NAME(epoll_wait),
+#endif
+#ifdef __NR_open
+    SYSCALL_NAME(open),
+#endif
+#ifdef __NR_unlink
+    SYSCALL_NAME(unlink),
+#endif
+#ifdef __NR_newfstatat
+    SYSCALL_NAME(newfstatat),
+#endif
+};
+
+static unsigned long counts[MAX_SYSCALL_NR];
+static unsigned long total;
+static volatile sig_atomic_t report_requested;
+static volatile sig_atomic_t forward_signal;
+
+static void signal_handler(int signo) {
+    if (signo == SIGUSR1) {
+        report_requested = 1;
+    }
+    else {
+        forward_signal = signo;
+    }
+}
+
+static const char *syscall_name(long nr, char *buf, size_t size) {
+    for (size_t i = 0; i < sizeof(syscall_names) / sizeof(syscall_names[0]); i++) {
+        if (syscall_names[i].nr == nr) {
+            return syscall_names[i].name;
+        }
+    }
+    snprintf(buf, size, "#%ld", nr);
+    return buf;
+}
+
+/**
+ * Prints the total and the REPORT_TOP most frequent calls, then starts counting again
+ */
+static void report(void) {
+    fprintf(stderr, "syscalls=%lu", total);
+    for (int shown = 0; shown < REPORT_TOP; shown++) {
+        long top = -1;
+        char buf[24];
+
+        for (long nr = 0; nr < MAX_SYSCALL_NR; nr++) {
+            if (counts[nr] > 0 && (top == -1 || counts[nr] > counts[top])) {
+                top = nr;
+            }
+        }
+        if (top == -1) {
+            break;
+        }
+        fprintf(stderr, " %s=%lu", syscall_name(top, buf, sizeof(buf)), counts[top]);
+        counts[top] = 0;
+    }
+    fprintf(stderr, "\n");
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct sigaction action;
+    pid_t child;
+    int status;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s command [args...]\n", argv[0]);
+        return 1;
+    }
+
+    child = fork();
+    if (child == -1) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        // Stop so the parent can set its options before the command starts
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[1], argv + 1);
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    // No SA_RESTART: the signals have to interrupt waitpid()
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (waitpid(child, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        fprintf(stderr, "%s did not start\n", argv[1]);
+        return 1;
+    }
+    ptrace(PTRACE_SETOPTIONS, child, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, NULL, NULL);
+
+    for (;;) {
+        pid_t pid = waitpid(-1, &status, __WALL);
+        int deliver = 0;
+
+        if (report_requested) {
+            report_requested = 0;
+            report();
+        }
+        if (forward_signal) {
+            kill(child, forward_signal);
+            forward_signal = 0;
+        }
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // ECHILD: every thread is gone
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == child) {
+                report();
+                return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+
+            // Every call stops on entry and on exit, count the entries
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, (void *)sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                total++;
+                if (info.entry.nr < MAX_SYSCALL_NR) {
+                    counts[info.entry.nr]++;
+                }
+            }
+        }
+        else if (status >> 16 != 0) {
+            // A clone or exec event, not a signal. A new thread is traced already and
+            // reports its own initial SIGSTOP.
+        }
+        else if (WSTOPSIG(status) != SIGSTOP || pid == child) {
+            // A real signal, hand it to the tracee. The SIGSTOP new threads start with is ours.
+            deliver = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)deliver);
+    }
+    report();
+    return 0;
+}
@@ -0,0 +1,220 @@
+/**
+ * @file uring.c
+ * @brief io_uring setup, submission and completion without liburing
+ *
+ * Usage:
+ *
+ *     struct io_uring_sqe *sqe = uring_get_sqe(&ring);   // NULL: submit first to make room
+ *     sqe->opcode = IORING_OP_RECV;
+ *     ...
+ *     uring_submit_and_wait(&ring, 1);
+ *     while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+ *         handle(cqe->user_data, cqe->res, cqe->flags);
+ *         uring_cqe_seen(&ring);
+ *     }
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Sets up a ring of @param entries submission slots and maps its queues.
+ * @return 0 on success, -1 with errno set, e.g. ENOSYS or EPERM where io_uring is unavailable
+ */
+int uring_init(struct uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->features = params.features;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // Both rings share one mapping, sized for the larger
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+
+fail:
+    {
+        int err = errno;
+        uring_exit(ring);
+        errno = err;
+    }
+    return -1;
+}
+
+/**
+ * @return true if the kernel implements every opcode in @param ops, @param count of them
+ */
+bool uring_supports(struct uring *ring, const int *ops, size_t count)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    bool supported = true;
+
+    if (probe == NULL || sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        free(probe);
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = false;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ * @return the number of SQEs uring_get_sqe() can hand out before a submission
+ */
+unsigned int uring_sq_space(struct uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return *ring->sq_mask + 1 - (ring->sqe_tail - head);
+}
+
+/**
+ * @return a zeroed SQE to fill in, or NULL if all of them await submission
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - head > *ring->sq_mask) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/**
+ * Submits every SQE filled in since the last call and waits for @param wait_nr completions,
+ * all in one io_uring_enter().
+ * @return the number of SQEs submitted, or -1 with errno set (EINTR when a signal arrived)
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr)
+{
+    unsigned int to_submit = ring->sqe_tail - *ring->sq_tail;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    ring->enters++;
+    rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    return rc;
+}
+
+/**
+ * @return the oldest unconsumed completion, or NULL if there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Releases the completion returned by uring_peek_cqe() back to the kernel.
+ */
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Unmaps the queues and closes the ring. Operations still in flight are cancelled.
+ */
+void uring_exit(struct uring *ring)
+{
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(struct uring));
+    ring->fd = -1;
+}
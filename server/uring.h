@@ -0,0 +1,62 @@
+/*
+ * uring.h
+ *
+ * Minimal io_uring access for aesdsocket's -u engine, on the raw io_uring_setup(),
+ * io_uring_enter() and io_uring_register() system calls so the server needs no liburing.
+ *
+ * One thread owns a ring: it fills SQEs from uring_get_sqe(), submits them and waits for
+ * completions with uring_submit_and_wait(), and consumes them with uring_peek_cqe() and
+ * uring_cqe_seen().
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int features;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    /**
+     * SQEs handed out but not yet published to the kernel's tail
+     */
+    unsigned int sqe_tail;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    /**
+     * io_uring_enter() calls made, the only system calls the ring itself costs
+     */
+    unsigned long enters;
+};
+
+extern int uring_init(struct uring *ring, unsigned int entries);
+
+extern bool uring_supports(struct uring *ring, const int *ops, size_t count);
+
+extern unsigned int uring_sq_space(struct uring *ring);
+
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+extern int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+extern void uring_cqe_seen(struct uring *ring);
+
+extern void uring_exit(struct uring *ring);
+
+#endif /* URING_H */
@@ -0,0 +1,181 @@
+/**
+ * @file work-queue.c
+ * @brief Bounded producer/consumer queue with queue wait metrics
+ *
+ * Usage:
+ *
+ *     // accept loop
+ *     if (work_queue_push(&queue, conn, block_when_full) == -1) {
+ *         // full (EAGAIN) or closed (EPIPE): conn is still the caller's
+ *     }
+ *
+ *     // each worker
+ *     while ((conn = work_queue_pop(&queue)) != NULL) {
+ *         serve(conn);
+ *     }
+ *
+ * work_queue_close() lets the workers drain what is queued, then makes work_queue_pop() return NULL.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "work-queue.h"
+
+static unsigned long long elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+    long long us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - since->tv_sec) * 1000000LL + (now.tv_nsec - since->tv_nsec) / 1000;
+    return us > 0 ? us : 0;
+}
+
+/**
+ * Records one queue wait of @param wait_us. Caller holds queue->lock.
+ */
+static void work_queue_record_wait(struct work_queue_stats *stats, unsigned long long wait_us)
+{
+    unsigned int bucket = 0;
+
+    while (bucket < WORK_QUEUE_WAIT_BUCKETS - 1 && (1ULL << bucket) <= wait_us) {
+        bucket++;
+    }
+    stats->wait_buckets[bucket]++;
+    stats->wait_total_us += wait_us;
+    if (wait_us > stats->wait_max_us) {
+        stats->wait_max_us = wait_us;
+    }
+}
+
+/**
+ * Prepares an empty queue of @param depth slots.
+ * @return 0 on success, -1 if the slots could not be allocated
+ */
+int work_queue_init(struct work_queue *queue, unsigned int depth)
+{
+    queue->slots = calloc(depth, sizeof(struct work_queue_slot));
+    if (queue->slots == NULL) {
+        return -1;
+    }
+    queue->depth = depth;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = false;
+    queue->stats = (struct work_queue_stats){ 0 };
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+/**
+ * Queues @param item for a worker.
+ * @param wait whether to wait for a free slot when the queue is full, or fail at once
+ * @return 0 once queued, -1 with errno EAGAIN if full and not waiting, or EPIPE once closed
+ */
+int work_queue_push(struct work_queue *queue, void *item, bool wait)
+{
+    struct work_queue_slot *slot;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->depth && wait && !queue->closed) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    if (queue->closed || queue->count == queue->depth) {
+        int err = queue->closed ? EPIPE : EAGAIN;
+        if (err == EAGAIN) {
+            queue->stats.rejected++;
+        }
+        pthread_mutex_unlock(&queue->lock);
+        errno = err;
+        return -1;
+    }
+
+    slot = &queue->slots[(queue->head + queue->count) % queue->depth];
+    slot->item = item;
+    clock_gettime(CLOCK_MONOTONIC, &slot->queued);
+    queue->count++;
+    queue->stats.pushed++;
+    if (queue->count > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->count;
+    }
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/**
+ * Waits for the oldest queued item.
+ * @return the item, or NULL once the queue is closed and empty
+ */
+void *work_queue_pop(struct work_queue *queue)
+{
+    struct work_queue_slot *slot;
+    void *item;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+
+    slot = &queue->slots[queue->head];
+    item = slot->item;
+    work_queue_record_wait(&queue->stats, elapsed_us(&slot->queued));
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+/**
+ * Stops accepting items. Workers still get what was queued before work_queue_pop() returns NULL.
+ */
+void work_queue_close(struct work_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @return an upper bound in microseconds for the @param percent percentile of the queue waits
+ * in @param stats, at the resolution of the power of two buckets
+ */
+unsigned long long work_queue_wait_percentile(const struct work_queue_stats *stats, unsigned int percent)
+{
+    unsigned long total = 0;
+    unsigned long seen = 0;
+
+    for (unsigned int i = 0; i < WORK_QUEUE_WAIT_BUCKETS; i++) {
+        total += stats->wait_buckets[i];
+    }
+    for (unsigned int i = 0; i < WORK_QUEUE_WAIT_BUCKETS; i++) {
+        seen += stats->wait_buckets[i];
+        if (total > 0 && seen * 100 >= total * percent) {
+            return (i < WORK_QUEUE_WAIT_BUCKETS - 1) ? (1ULL << i) : stats->wait_max_us;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees the slots. Nothing may be using the queue.
+ */
+void work_queue_destroy(struct work_queue *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
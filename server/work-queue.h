@@ -0,0 +1,61 @@
+/*
+ * work-queue.h
+ *
+ * Bounded FIFO of pending connections between the aesdsocket accept loop and its worker pool (-w).
+ *
+ * When the queue is full the producer either waits for a worker to free a slot, which stops
+ * accepting and leaves further clients in the listen backlog, or is refused at once so the
+ * connection can be closed (-R). Each item's time in the queue is recorded, so overload shows up
+ * as queue wait rather than as more threads.
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+// Queue waits are counted in power of two microsecond buckets: bucket i holds waits below 2^i us
+#define WORK_QUEUE_WAIT_BUCKETS 32
+
+struct work_queue_stats {
+    unsigned long pushed;
+    unsigned long rejected;
+    unsigned int max_depth;
+    unsigned long long wait_total_us;
+    unsigned long long wait_max_us;
+    unsigned long wait_buckets[WORK_QUEUE_WAIT_BUCKETS];
+};
+
+struct work_queue_slot {
+    void *item;
+    struct timespec queued;
+};
+
+struct work_queue {
+    struct work_queue_slot *slots;
+    unsigned int depth;
+    unsigned int head;
+    unsigned int count;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct work_queue_stats stats;
+};
+
+extern int work_queue_init(struct work_queue *queue, unsigned int depth);
+
+extern int work_queue_push(struct work_queue *queue, void *item, bool wait);
+
+extern void *work_queue_pop(struct work_queue *queue);
+
+extern void work_queue_close(struct work_queue *queue);
+
+extern unsigned long long work_queue_wait_percentile(const struct work_queue_stats *stats, unsigned int percent);
+
+extern void work_queue_destroy(struct work_queue *queue);
+
+#endif /* WORK_QUEUE_H */
@@ -0,0 +1,117 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static char entry_data[256];
+
+/**
+ * Adds an entry of @param size bytes the way the driver does: make_room() until it fits, then
+ * add_entry(). Every evicted entry is counted in @param evicted and its bytes in @param evicted_bytes.
+ */
+static void add_within_budget(struct aesd_circular_buffer *buffer, size_t size,
+                              uint32_t *evicted, size_t *evicted_bytes)
+{
+    struct aesd_buffer_entry entry = { entry_data, size };
+    size_t lost_size = 0;
+    const char *lost;
+
+    while ((lost = aesd_circular_buffer_make_room(buffer, size, &lost_size)) != NULL) {
+        TEST_ASSERT_TRUE(lost == entry_data);
+        (*evicted)++;
+        *evicted_bytes += lost_size;
+    }
+    lost = aesd_circular_buffer_add_entry(buffer, &entry, &lost_size);
+    if (lost) {
+        (*evicted)++;
+        *evicted_bytes += lost_size;
+    }
+}
+
+/**
+ * A large entry evicts as many old ones as it needs, all of them reported, and what's
+ * left stays within the budget
+ */
+void test_circular_buffer_budget_evicts_until_fit()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t evicted = 0;
+    size_t evicted_bytes = 0;
+    size_t added = 0;
+    size_t offset = 0;
+    int i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 10));
+    buffer.byte_budget = 100;
+    for (i = 0; i < 8; i++) {
+        add_within_budget(&buffer, 10, &evicted, &evicted_bytes);
+        added += 10;
+    }
+    TEST_ASSERT_EQUAL_INT(0, evicted);
+    TEST_ASSERT_EQUAL_INT(80, aesd_circular_buffer_size(&buffer));
+
+    // 80 + 50 is over 100, so the three oldest go
+    add_within_budget(&buffer, 50, &evicted, &evicted_bytes);
+    added += 50;
+    TEST_ASSERT_EQUAL_INT(3, evicted);
+    TEST_ASSERT_EQUAL_INT(30, evicted_bytes);
+    TEST_ASSERT_EQUAL_INT(6, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_INT(100, aesd_circular_buffer_size(&buffer));
+    TEST_ASSERT_EQUAL_INT(added - evicted_bytes, aesd_circular_buffer_size(&buffer));
+
+    // Positions follow the new oldest entry
+    TEST_ASSERT_NOT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 99, &offset));
+    TEST_ASSERT_EQUAL_INT(49, offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 100, &offset));
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+ * An entry larger than the whole budget empties the buffer and is then kept on its own
+ */
+void test_circular_buffer_budget_oversized_entry()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t evicted = 0;
+    size_t evicted_bytes = 0;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 10));
+    buffer.byte_budget = 100;
+    add_within_budget(&buffer, 40, &evicted, &evicted_bytes);
+    add_within_budget(&buffer, 40, &evicted, &evicted_bytes);
+    add_within_budget(&buffer, 200, &evicted, &evicted_bytes);
+    TEST_ASSERT_EQUAL_INT(2, evicted);
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_INT(200, aesd_circular_buffer_size(&buffer));
+
+    // The next entry pushes it out
+    add_within_budget(&buffer, 1, &evicted, &evicted_bytes);
+    TEST_ASSERT_EQUAL_INT(3, evicted);
+    TEST_ASSERT_EQUAL_INT(1, aesd_circular_buffer_size(&buffer));
+    aesd_circular_buffer_free(&buffer);
+}
+
+/**
+ * Count still bounds the buffer under a budget, and a budget of 0 leaves only the count
+ */
+void test_circular_buffer_budget_and_count()
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t evicted = 0;
+    size_t evicted_bytes = 0;
+    size_t lost_size = 0;
+    int i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 4));
+    buffer.byte_budget = 1000;
+    for (i = 0; i < 6; i++) {
+        add_within_budget(&buffer, 5, &evicted, &evicted_bytes);
+    }
+    TEST_ASSERT_EQUAL_INT(2, evicted);
+    TEST_ASSERT_EQUAL_INT(4, aesd_circular_buffer_count(&buffer));
+
+    buffer.byte_budget = 0;
+    TEST_ASSERT_NULL(aesd_circular_buffer_make_room(&buffer, (size_t)-1, &lost_size));
+    aesd_circular_buffer_free(&buffer);
+}
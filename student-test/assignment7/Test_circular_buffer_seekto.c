@@ -0,0 +1,162 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+// Entries are slices of this, their content doesn't matter to offsets
+static char entry_data[64];
+
+/**
+ * The reference model: the sizes of every entry ever added, oldest first. The buffer holds
+ * the last min(added, capacity) of them.
+ */
+struct seekto_model
+{
+    size_t sizes[4096];
+    uint32_t added;
+    uint32_t capacity;
+};
+
+static uint32_t model_count(const struct seekto_model *model)
+{
+    return model->added < model->capacity ? model->added : model->capacity;
+}
+
+/**
+ * What AESDCHAR_IOCSEEKTO should land on, by summing the sizes of the logical entries in front
+ * of @param index the slow way.
+ * @return false if @param index or @param offset is out of range
+ */
+static bool model_fpos(const struct seekto_model *model, uint32_t index, size_t offset, size_t *fpos)
+{
+    uint32_t first = model->added - model_count(model);
+    size_t sum = 0;
+    uint32_t i;
+
+    if (index >= model_count(model) || offset >= model->sizes[first + index]) {
+        return false;
+    }
+    for (i = 0; i < index; i++) {
+        sum += model->sizes[first + i];
+    }
+    *fpos = sum + offset;
+    return true;
+}
+
+/**
+ * A fixed xorshift sequence, so a failure reproduces
+ */
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Compares every (index, offset) pair in and just past the history with the model,
+ * and checks found positions map back to the same entry and offset
+ */
+static void check_against_model(struct aesd_circular_buffer *buffer, const struct seekto_model *model)
+{
+    uint32_t count = model_count(model);
+    uint32_t index;
+    char message[128];
+
+    for (index = 0; index <= count; index++) {
+        size_t size = index < count ? model->sizes[model->added - count + index] : 1;
+        size_t offset;
+        for (offset = 0; offset <= size; offset++) {
+            size_t expected = 0;
+            size_t actual = 0;
+            size_t entry_offset = 0;
+            bool in_range = model_fpos(model, index, offset, &expected);
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_fpos_for_entry_offset(buffer, index, offset, &actual);
+
+            snprintf(message, sizeof(message), "capacity %u after %u adds, entry %u offset %zu",
+                     model->capacity, model->added, index, offset);
+            TEST_ASSERT_EQUAL_MESSAGE(in_range, entry != NULL, message);
+            if (!in_range) {
+                continue;
+            }
+            TEST_ASSERT_EQUAL_INT_MESSAGE(expected, actual, message);
+            TEST_ASSERT_TRUE_MESSAGE(entry == aesd_circular_buffer_find_entry_offset_for_fpos(buffer, actual,
+                                     &entry_offset), message);
+            TEST_ASSERT_EQUAL_INT_MESSAGE(offset, entry_offset, message);
+        }
+    }
+}
+
+/**
+ * Adds entries of random sizes to buffers of several capacities, wrapping each many times,
+ * and checks seekto positions against the reference model after every add
+ */
+void test_circular_buffer_seekto_matches_model()
+{
+    static const uint32_t capacities[] = { 1, 2, 3, 7, 10, 16, 33 };
+    uint32_t seed = 0x2545F491;
+    size_t c;
+
+    for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        struct aesd_circular_buffer buffer;
+        struct seekto_model model;
+        uint32_t adds = 5 * capacities[c] + 20;
+        uint32_t i;
+
+        memset(&model, 0, sizeof(model));
+        model.capacity = capacities[c];
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, capacities[c]));
+        check_against_model(&buffer, &model);
+        for (i = 0; i < adds; i++) {
+            struct aesd_buffer_entry entry;
+            size_t lost_size = 0;
+
+            entry.size = 1 + next_random(&seed) % (sizeof(entry_data) - 1);
+            entry.buffptr = entry_data;
+            aesd_circular_buffer_add_entry(&buffer, &entry, &lost_size);
+            model.sizes[model.added++] = entry.size;
+            check_against_model(&buffer, &model);
+        }
+        aesd_circular_buffer_free(&buffer);
+    }
+}
+
+/**
+ * The case the physical indexing got wrong: once the ring wraps, command 0 is the oldest
+ * entry, which no longer sits in slot 0
+ */
+void test_circular_buffer_seekto_after_wrap()
+{
+    static const char *commands[] = { "one\n", "two\n", "three\n", "four\n" };
+    struct aesd_circular_buffer buffer;
+    size_t fpos = 0;
+    size_t entry_offset = 0;
+    size_t lost_size = 0;
+    struct aesd_buffer_entry *entry;
+    size_t i;
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, 3));
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        struct aesd_buffer_entry add = { commands[i], strlen(commands[i]) };
+        aesd_circular_buffer_add_entry(&buffer, &add, &lost_size);
+    }
+
+    // The history is now "two\nthree\nfour\n"
+    entry = aesd_circular_buffer_find_fpos_for_entry_offset(&buffer, 0, 1, &fpos);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING("two\n", entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(1, fpos);
+    entry = aesd_circular_buffer_find_fpos_for_entry_offset(&buffer, 2, 3, &fpos);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_STRING("four\n", entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(13, fpos);
+    TEST_ASSERT_TRUE(entry == aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &entry_offset));
+    TEST_ASSERT_EQUAL_INT(3, entry_offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_fpos_for_entry_offset(&buffer, 2, 5, &fpos));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_fpos_for_entry_offset(&buffer, 3, 0, &fpos));
+    aesd_circular_buffer_free(&buffer);
+}